@@ -0,0 +1,154 @@
+/*
+ * The APC commands script adds to typescripts, as read back by scriptreplay
+ * and scriptconvert.
+ *
+ * This file is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ *
+ * Delays are "ESC _ D ; <seconds> ESC \", or as written by script
+ * --compact-delays "ESC _ d ; <microseconds in hexadecimal> ESC \".
+ * Keyframes are "ESC _ K ; <size in hexadecimal> ; <data> ESC \", with the
+ * data being what redraws the screen, zlib compressed and base64 encoded.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "apc.h"
+
+/*
+ * Matches the APC command starting with the ESC at data[0] the same way
+ * script writes them: a delay (D or d) or a keyframe (K). Returns the length
+ * of the command, with *type set to its letter, or when it doesn't match that
+ * of the text to output as-is, with *type set to 0. Returns 0 when there's
+ * too little data to tell, which for a command that isn't terminated is only
+ * up to the longest one of its type.
+ */
+size_t
+apc_match(const char* data, const size_t len, char* type, const char** payload, size_t* payload_len)
+{
+	static const char prefix[] = "\x1B_D;";
+	size_t i;
+
+	*type = 0;
+	for (i = 1; i < sizeof(prefix) - 1; ++i)
+	{
+		if (i == len)
+			return 0;
+		if (data[i] != prefix[i] && (i != 2 || (data[i] != 'd' && data[i] != 'K')))
+			return i;
+	}
+
+	const size_t max = data[2] == 'K' ? KEYFRAME_MAX : DELAY_MAX;
+	const char* const st = memchr(data + i, 0x1B, (len < max ? len : max) - i);
+	if (!st)
+		return len < max ? 0 : i;
+	if (st + 1 == data + len)
+		return 0;
+	if (st[1] != '\\')
+		return st - data;
+
+	*type = data[2];
+	*payload = data + i;
+	*payload_len = st - *payload;
+	return st + 2 - data;
+}
+
+/*
+ * Parses the payload of a delay command: seconds as a decimal fraction, or
+ * with compact set, as written by script --compact-delays, microseconds in
+ * hexadecimal.
+ */
+bool
+delay_parse(const char* payload, const size_t len, const bool compact, double* delay)
+{
+	char tmp[64];
+	char* end;
+
+	if (len >= sizeof(tmp))
+		return false;
+	memcpy(tmp, payload, len);
+	tmp[len] = '\0';
+
+	if (compact)
+		*delay = strtoull(tmp, &end, 16) / 1e6;
+	else
+		*delay = strtod(tmp, &end);
+	return end == tmp + len;
+}
+
+static size_t
+base64_decode(unsigned char* dst, const char* src, const size_t len)
+{
+	unsigned char* const start = dst;
+	uint32_t v = 0;
+	unsigned bits = 0;
+
+	for (size_t i = 0; i < len && src[i] != '='; ++i)
+	{
+		const char c = src[i];
+		unsigned d;
+		if (c >= 'A' && c <= 'Z')
+			d = c - 'A';
+		else if (c >= 'a' && c <= 'z')
+			d = c - 'a' + 26;
+		else if (c >= '0' && c <= '9')
+			d = c - '0' + 52;
+		else if (c == '+')
+			d = 62;
+		else if (c == '/')
+			d = 63;
+		else
+			return (size_t)-1;
+
+		v = v << 6 | d;
+		bits += 6;
+		if (bits >= 8)
+		{
+			bits -= 8;
+			*dst++ = v >> bits;
+		}
+	}
+	return dst - start;
+}
+
+/*
+ * Unpacks the payload of a keyframe into what redraws the screen, returns it
+ * as allocated with malloc() with its length in *size. Returns NULL when
+ * it's malformed or memory runs out.
+ */
+char*
+keyframe_decode(const char* payload, const size_t len, size_t* size)
+{
+	char* end;
+	const unsigned long long raw_size = strtoull(payload, &end, 16);
+	if (end == payload || end == payload + len || *end != ';' || !raw_size || raw_size > KEYFRAME_MAX)
+		return NULL;
+	const char* const data = end + 1;
+	const size_t data_len = payload + len - data;
+
+	unsigned char* const packed = malloc(data_len / 4 * 3 + 3);
+	char* raw = malloc(raw_size);
+	const size_t packed_len = packed && raw ? base64_decode(packed, data, data_len) : (size_t)-1;
+	uLongf raw_len = raw_size;
+	if (packed_len == (size_t)-1
+	 || uncompress((Bytef*)raw, &raw_len, packed, packed_len) != Z_OK || raw_len != raw_size)
+	{
+		free(raw);
+		raw = NULL;
+	}
+	free(packed);
+
+	*size = raw_len;
+	return raw;
+}
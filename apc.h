@@ -0,0 +1,33 @@
+/*
+ * The APC commands script adds to typescripts, as read back by scriptreplay
+ * and scriptconvert.
+ *
+ * This file is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef APC_H
+#define APC_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Keyframes as written by script --keyframe-interval, and the largest one we take */
+#define KEYFRAME_PREFIX "\x1B_K;"
+#define KEYFRAME_MAX (16UL << 20)
+
+/* The longest delay command we take, script's are far shorter */
+#define DELAY_MAX 64
+
+size_t apc_match(const char* data, size_t len, char* type, const char** payload, size_t* payload_len);
+bool delay_parse(const char* payload, size_t len, bool compact, double* delay);
+char* keyframe_decode(const char* payload, size_t len, size_t* size);
+
+#endif
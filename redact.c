@@ -0,0 +1,1088 @@
+/*
+ * Streaming redaction, keeping secrets out of typescripts.
+ *
+ * This file is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ *
+ * All patterns get compiled into a single NFA, searched with a DFA that gets
+ * built from it while going, which for literals only is what Aho-Corasick
+ * would build. That DFA tells where matches end, a second one of the
+ * reversed patterns finds where they start by going back from there. Output
+ * is only held back while the first DFA is in the middle of a possible match,
+ * so a match arriving in pieces still gets replaced as a whole.
+ *
+ * Regular expressions are matched on bytes and understand ., [...] with
+ * ranges and ^, \d \w \s and their negations, \t \n \r \xHH, escaped
+ * punctuation, (...), |, *, +, ? and {m,n}. Neither . nor negations match a
+ * newline. Anchors aren't supported, nor are patterns matching nothing.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#include "redact.h"
+
+/* Limits to the NFA and to the DFA states kept before starting over */
+#define NFA_MAX    65536
+#define DFA_MAX    2048
+#define REPEAT_MAX 1000
+
+enum node_type
+{
+	NODE_EMPTY,
+	NODE_CLASS,
+	NODE_CAT,
+	NODE_ALT,
+	NODE_STAR,
+	NODE_PLUS,
+	NODE_QUEST,
+};
+
+struct node
+{
+	enum node_type type;
+	struct node*   a;
+	struct node*   b;
+	uint32_t       set[8];	/* Bytes matched by NODE_CLASS */
+};
+
+struct parser
+{
+	const unsigned char* p;
+	const unsigned char* end;
+	const char*          error;
+	struct node**        nodes;	/* Everything allocated, to free at once */
+	size_t               count, size;
+};
+
+enum nfa_type
+{
+	NFA_CLASS,
+	NFA_SPLIT,
+	NFA_MATCH,
+};
+
+struct nfa_state
+{
+	enum nfa_type type;
+	int           out, out1;	/* Next states, out1 only for NFA_SPLIT, -1 for none */
+	uint32_t      set[8];
+};
+
+#define DFA_ACCEPT 0x01
+#define DFA_DEAD   0x02
+
+struct dfa
+{
+	const struct redact* r;
+	int            root;	/* Where the NFA starts */
+	bool           search;	/* Matches may start anywhere, instead of only where the DFA starts */
+	int*           root_set;	/* The NFA states it starts in, for search */
+	int            root_len;
+	int*           trans;	/* 256 next states for each state, -1 for not known yet */
+	unsigned char* flags;
+	size_t*        first;	/* Where each state's NFA states are in members, sorted */
+	int*           len;
+	int*           members;
+	size_t         members_len, members_size;
+	int*           hash;	/* Open addressing of state + 1, twice DFA_MAX entries */
+	int            count;
+
+	/* Scratch for computing states */
+	int*           stack;
+	int*           set;
+	unsigned*      mark;
+	unsigned       gen;
+};
+
+struct redact
+{
+	struct nfa_state* nfa;
+	int               nfa_len, nfa_size;
+	int               forward, reverse;	/* Roots of both NFAs */
+	int               match;
+	struct dfa        dfa[2];	/* Forward and reverse */
+	bool              started;
+	int               state;	/* Of the forward DFA */
+
+	/* Output not written yet, and which of it got matched */
+	unsigned char*    hold;
+	unsigned char*    mask;
+	size_t            held, hold_size;
+	bool              masked;	/* The last byte written got replaced */
+
+	char*             out;
+	size_t            out_size;
+};
+
+static void
+set_add(uint32_t* set, const unsigned c)
+{
+	set[c / 32] |= 1U << c % 32;
+}
+
+static bool
+set_has(const uint32_t* set, const unsigned c)
+{
+	return set[c / 32] >> c % 32 & 1;
+}
+
+static void
+set_range(uint32_t* set, const unsigned from, const unsigned to)
+{
+	for (unsigned c = from; c <= to; ++c)
+		set_add(set, c);
+}
+
+static struct node*
+node_new(struct parser* ps, const enum node_type type, struct node* a, struct node* b)
+{
+	if (ps->count == NFA_MAX)
+	{
+		ps->error = "pattern too large";
+		return NULL;
+	}
+	if (ps->count == ps->size)
+	{
+		const size_t size = ps->size ? ps->size * 2 : 64;
+		struct node** const nodes = realloc(ps->nodes, size * sizeof(*nodes));
+		if (!nodes)
+		{
+			ps->error = strerror(ENOMEM);
+			return NULL;
+		}
+		ps->nodes = nodes;
+		ps->size = size;
+	}
+
+	struct node* const n = calloc(1, sizeof(*n));
+	if (!n)
+	{
+		ps->error = strerror(ENOMEM);
+		return NULL;
+	}
+	n->type = type;
+	n->a = a;
+	n->b = b;
+	ps->nodes[ps->count++] = n;
+	return n;
+}
+
+static struct node*
+node_copy(struct parser* ps, const struct node* n)
+{
+	if (!n)
+		return NULL;
+
+	struct node* const a = node_copy(ps, n->a);
+	struct node* const b = node_copy(ps, n->b);
+	if ((n->a && !a) || (n->b && !b))
+		return NULL;
+	struct node* const copy = node_new(ps, n->type, a, b);
+	if (copy)
+		memcpy(copy->set, n->set, sizeof(copy->set));
+	return copy;
+}
+
+static bool
+node_nullable(const struct node* n)
+{
+	switch (n->type)
+	{
+		case NODE_CLASS:
+			return false;
+		case NODE_CAT:
+			return node_nullable(n->a) && node_nullable(n->b);
+		case NODE_ALT:
+			return node_nullable(n->a) || node_nullable(n->b);
+		case NODE_PLUS:
+			return node_nullable(n->a);
+		default:
+			return true;
+	}
+}
+
+static int
+hex_digit(const unsigned char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+/*
+ * Parses the escape following a backslash into the bytes it stands for.
+ */
+static bool
+parse_escape(struct parser* ps, uint32_t* set)
+{
+	if (ps->p == ps->end)
+	{
+		ps->error = "trailing backslash";
+		return false;
+	}
+
+	uint32_t class[8] = { 0 };
+	bool negate = false;
+	const unsigned char c = *ps->p++;
+	switch (c)
+	{
+		case 'D':
+			negate = true;
+			/* fall through */
+		case 'd':
+			set_range(class, '0', '9');
+			break;
+		case 'W':
+			negate = true;
+			/* fall through */
+		case 'w':
+			set_range(class, '0', '9');
+			set_range(class, 'A', 'Z');
+			set_range(class, 'a', 'z');
+			set_add(class, '_');
+			break;
+		case 'S':
+			negate = true;
+			/* fall through */
+		case 's':
+			set_range(class, '\t', '\r');
+			set_add(class, ' ');
+			break;
+		case 't':
+			set_add(class, '\t');
+			break;
+		case 'n':
+			set_add(class, '\n');
+			break;
+		case 'r':
+			set_add(class, '\r');
+			break;
+		case 'x':
+		{
+			const int hi = ps->end - ps->p >= 2 ? hex_digit(ps->p[0]) : -1;
+			const int lo = hi >= 0 ? hex_digit(ps->p[1]) : -1;
+			if (lo < 0)
+			{
+				ps->error = "\\x needs two hexadecimal digits";
+				return false;
+			}
+			ps->p += 2;
+			set_add(class, hi << 4 | lo);
+			break;
+		}
+		default:
+			if ((c >= '0' && c <= '9') || (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z'))
+			{
+				ps->error = "unknown escape";
+				return false;
+			}
+			set_add(class, c);
+			break;
+	}
+
+	for (unsigned i = 0; i < 8; ++i)
+		set[i] |= negate ? ~class[i] : class[i];
+	if (negate)
+		set['\n' / 32] &= ~(1U << '\n' % 32);
+	return true;
+}
+
+static struct node*
+parse_class(struct parser* ps)
+{
+	struct node* const n = node_new(ps, NODE_CLASS, NULL, NULL);
+	if (!n)
+		return NULL;
+
+	const bool negate = ps->p != ps->end && *ps->p == '^';
+	if (negate)
+		++ps->p;
+
+	for (bool first = true; ; first = false)
+	{
+		if (ps->p == ps->end)
+		{
+			ps->error = "unmatched [";
+			return NULL;
+		}
+		if (*ps->p == ']' && !first)
+		{
+			++ps->p;
+			break;
+		}
+
+		uint32_t item[8] = { 0 };
+		unsigned from = *ps->p++;
+		if (from == '\\')
+		{
+			if (!parse_escape(ps, item))
+				return NULL;
+			/* Only a single byte can start a range */
+			unsigned bits = 0;
+			for (unsigned i = 0; i < 8; ++i)
+				bits += __builtin_popcount(item[i]);
+			if (bits != 1)
+			{
+				for (unsigned i = 0; i < 8; ++i)
+					n->set[i] |= item[i];
+				continue;
+			}
+			for (from = 0; !set_has(item, from); ++from)
+				;
+		}
+
+		unsigned to = from;
+		if (ps->end - ps->p >= 2 && ps->p[0] == '-' && ps->p[1] != ']')
+		{
+			++ps->p;
+			to = *ps->p++;
+			if (to == '\\')
+			{
+				memset(item, 0, sizeof(item));
+				if (!parse_escape(ps, item))
+					return NULL;
+				for (to = 0; to < 256 && !set_has(item, to); ++to)
+					;
+			}
+			if (to < from || to > 255)
+			{
+				ps->error = "invalid range";
+				return NULL;
+			}
+		}
+		set_range(n->set, from, to);
+	}
+
+	if (negate)
+	{
+		for (unsigned i = 0; i < 8; ++i)
+			n->set[i] = ~n->set[i];
+		n->set['\n' / 32] &= ~(1U << '\n' % 32);
+	}
+	return n;
+}
+
+static struct node* parse_alt(struct parser* ps);
+
+static struct node*
+parse_atom(struct parser* ps)
+{
+	struct node* n;
+	const unsigned char c = *ps->p++;
+	switch (c)
+	{
+		case '(':
+			n = ps->p != ps->end && *ps->p == ')' ? node_new(ps, NODE_EMPTY, NULL, NULL) : parse_alt(ps);
+			if (!n)
+				return NULL;
+			if (ps->p == ps->end || *ps->p != ')')
+			{
+				ps->error = "unmatched (";
+				return NULL;
+			}
+			++ps->p;
+			return n;
+		case '[':
+			return parse_class(ps);
+		case '.':
+			if ((n = node_new(ps, NODE_CLASS, NULL, NULL)))
+			{
+				memset(n->set, 0xFF, sizeof(n->set));
+				n->set['\n' / 32] &= ~(1U << '\n' % 32);
+			}
+			return n;
+		case '\\':
+			if ((n = node_new(ps, NODE_CLASS, NULL, NULL)) && !parse_escape(ps, n->set))
+				return NULL;
+			return n;
+		case '^':
+		case '$':
+			ps->error = "anchors aren't supported";
+			return NULL;
+		case '*':
+		case '+':
+		case '?':
+		case '{':
+			ps->error = "nothing to repeat";
+			return NULL;
+		default:
+			if ((n = node_new(ps, NODE_CLASS, NULL, NULL)))
+				set_add(n->set, c);
+			return n;
+	}
+}
+
+static bool
+parse_number(struct parser* ps, unsigned* n)
+{
+	if (ps->p == ps->end || *ps->p < '0' || *ps->p > '9')
+		return false;
+	for (*n = 0; ps->p != ps->end && *ps->p >= '0' && *ps->p <= '9'; ++ps->p)
+		if ((*n = *n * 10 + (*ps->p - '0')) > REPEAT_MAX)
+			*n = REPEAT_MAX + 1;
+	return true;
+}
+
+/*
+ * Expands n{min,max} into copies of n, with max of UINT32_MAX for no maximum:
+ * min copies, followed by a star or by nested optional copies.
+ */
+static struct node*
+expand_repeat(struct parser* ps, struct node* n, const unsigned min, const unsigned max)
+{
+	struct node* tail = NULL;
+	if (max == UINT32_MAX)
+		tail = node_new(ps, NODE_STAR, n, NULL);
+	else
+		for (unsigned i = min; i < max; ++i)
+		{
+			struct node* const copy = node_copy(ps, n);
+			if (tail && copy)
+				tail = node_new(ps, NODE_CAT, copy, tail);
+			else
+				tail = copy;
+			if (tail)
+				tail = node_new(ps, NODE_QUEST, tail, NULL);
+			if (!tail)
+				return NULL;
+		}
+
+	struct node* result = tail;
+	for (unsigned i = 0; i < min; ++i)
+	{
+		struct node* const copy = i ? node_copy(ps, n) : n;
+		result = result && copy ? node_new(ps, NODE_CAT, copy, result) : copy;
+		if (!result)
+			return NULL;
+	}
+	return result ? result : node_new(ps, NODE_EMPTY, NULL, NULL);
+}
+
+static struct node*
+parse_repeat(struct parser* ps)
+{
+	struct node* n = parse_atom(ps);
+	while (n && ps->p != ps->end)
+	{
+		switch (*ps->p)
+		{
+			case '*':
+				++ps->p;
+				n = node_new(ps, NODE_STAR, n, NULL);
+				break;
+			case '+':
+				++ps->p;
+				n = node_new(ps, NODE_PLUS, n, NULL);
+				break;
+			case '?':
+				++ps->p;
+				n = node_new(ps, NODE_QUEST, n, NULL);
+				break;
+			case '{':
+			{
+				unsigned min, max;
+				++ps->p;
+				if (!parse_number(ps, &min))
+				{
+					ps->error = "invalid repetition";
+					return NULL;
+				}
+				max = min;
+				if (ps->p != ps->end && *ps->p == ',')
+				{
+					++ps->p;
+					if (!parse_number(ps, &max))
+						max = UINT32_MAX;
+				}
+				if (ps->p == ps->end || *ps->p != '}' || max < min)
+				{
+					ps->error = "invalid repetition";
+					return NULL;
+				}
+				++ps->p;
+				if (min > REPEAT_MAX || (max != UINT32_MAX && max > REPEAT_MAX))
+				{
+					ps->error = "repetition too large";
+					return NULL;
+				}
+				n = expand_repeat(ps, n, min, max);
+				break;
+			}
+			default:
+				return n;
+		}
+	}
+	return n;
+}
+
+static struct node*
+parse_cat(struct parser* ps)
+{
+	struct node* n = NULL;
+	while (ps->p != ps->end && *ps->p != '|' && *ps->p != ')')
+	{
+		struct node* const next = parse_repeat(ps);
+		if (!next)
+			return NULL;
+		n = n ? node_new(ps, NODE_CAT, n, next) : next;
+		if (!n)
+			return NULL;
+	}
+	return n ? n : node_new(ps, NODE_EMPTY, NULL, NULL);
+}
+
+static struct node*
+parse_alt(struct parser* ps)
+{
+	struct node* n = parse_cat(ps);
+	while (n && ps->p != ps->end && *ps->p == '|')
+	{
+		++ps->p;
+		struct node* const next = parse_cat(ps);
+		n = next ? node_new(ps, NODE_ALT, n, next) : NULL;
+	}
+	return n;
+}
+
+static int
+nfa_new(struct redact* r, const enum nfa_type type, const int out, const int out1)
+{
+	if (r->nfa_len == NFA_MAX)
+		return -1;
+	if (r->nfa_len == r->nfa_size)
+	{
+		const int size = r->nfa_size ? r->nfa_size * 2 : 256;
+		struct nfa_state* const nfa = realloc(r->nfa, size * sizeof(*nfa));
+		if (!nfa)
+			return -1;
+		r->nfa = nfa;
+		r->nfa_size = size;
+	}
+
+	struct nfa_state* const s = &r->nfa[r->nfa_len];
+	s->type = type;
+	s->out = out;
+	s->out1 = out1;
+	memset(s->set, 0, sizeof(s->set));
+	return r->nfa_len++;
+}
+
+/*
+ * Compiles n into NFA states leading to next once it matched, reversed or
+ * not, and returns where they start. Returns -1 on running out of states.
+ */
+static int
+nfa_compile(struct redact* r, const struct node* n, const int next, const bool reverse)
+{
+	int s, start;
+	switch (n->type)
+	{
+		case NODE_EMPTY:
+			return next;
+		case NODE_CLASS:
+			if ((s = nfa_new(r, NFA_CLASS, next, -1)) >= 0)
+				memcpy(r->nfa[s].set, n->set, sizeof(n->set));
+			return s;
+		case NODE_CAT:
+			if (reverse)
+				return (s = nfa_compile(r, n->a, next, reverse)) < 0 ? -1 : nfa_compile(r, n->b, s, reverse);
+			return (s = nfa_compile(r, n->b, next, reverse)) < 0 ? -1 : nfa_compile(r, n->a, s, reverse);
+		case NODE_ALT:
+			if ((s = nfa_compile(r, n->a, next, reverse)) < 0 || (start = nfa_compile(r, n->b, next, reverse)) < 0)
+				return -1;
+			return nfa_new(r, NFA_SPLIT, s, start);
+		case NODE_QUEST:
+			if ((s = nfa_compile(r, n->a, next, reverse)) < 0)
+				return -1;
+			return nfa_new(r, NFA_SPLIT, s, next);
+		case NODE_STAR:
+			if ((s = nfa_new(r, NFA_SPLIT, -1, next)) < 0 || (start = nfa_compile(r, n->a, s, reverse)) < 0)
+				return -1;
+			r->nfa[s].out = start;
+			return s;
+		case NODE_PLUS:
+			if ((s = nfa_new(r, NFA_SPLIT, -1, next)) < 0 || (start = nfa_compile(r, n->a, s, reverse)) < 0)
+				return -1;
+			r->nfa[s].out = start;
+			return start;
+	}
+	return -1;
+}
+
+struct redact*
+redact_new(void)
+{
+	struct redact* const r = calloc(1, sizeof(*r));
+	if (!r)
+		return NULL;
+	r->forward = r->reverse = -1;
+	if ((r->match = nfa_new(r, NFA_MATCH, -1, -1)) < 0)
+	{
+		free(r);
+		return NULL;
+	}
+	return r;
+}
+
+/*
+ * Adds a literal string or a regular expression to what gets replaced, all of
+ * them need adding before redact_feed(). Returns NULL, or what's wrong with
+ * the pattern.
+ */
+const char*
+redact_add(struct redact* r, const char* pattern, const size_t len, const bool regex)
+{
+	struct parser ps = { .p = (const unsigned char*)pattern, .end = (const unsigned char*)pattern + len };
+	struct node* n = NULL;
+
+	if (regex)
+	{
+		n = parse_alt(&ps);
+		if (n && ps.p != ps.end)
+			ps.error = "unmatched )";
+	}
+	else
+		for (size_t i = 0; i < len && !ps.error; ++i)
+		{
+			struct node* const c = node_new(&ps, NODE_CLASS, NULL, NULL);
+			if (c)
+			{
+				set_add(c->set, (unsigned char)pattern[i]);
+				n = n ? node_new(&ps, NODE_CAT, n, c) : c;
+			}
+		}
+
+	if (!ps.error && (!n || node_nullable(n)))
+		ps.error = "pattern matches nothing";
+
+	if (!ps.error)
+	{
+		const int nfa_len = r->nfa_len;
+		const int forward = nfa_compile(r, n, r->match, false);
+		const int reverse = forward < 0 ? -1 : nfa_compile(r, n, r->match, true);
+		const int forward_root = reverse < 0 ? -1 : nfa_new(r, NFA_SPLIT, forward, r->forward);
+		const int reverse_root = forward_root < 0 ? -1 : nfa_new(r, NFA_SPLIT, reverse, r->reverse);
+		if (reverse_root < 0)
+		{
+			r->nfa_len = nfa_len;
+			ps.error = "pattern too large";
+		}
+		else
+		{
+			r->forward = forward_root;
+			r->reverse = reverse_root;
+		}
+	}
+
+	for (size_t i = 0; i < ps.count; ++i)
+		free(ps.nodes[i]);
+	free(ps.nodes);
+	return ps.error;
+}
+
+static void
+dfa_closure(struct dfa* d, const int start, int* n)
+{
+	const struct nfa_state* const nfa = d->r->nfa;
+	int sp = 0;
+
+	d->stack[sp++] = start;
+	while (sp)
+	{
+		const int s = d->stack[--sp];
+		if (s < 0 || d->mark[s] == d->gen)
+			continue;
+		d->mark[s] = d->gen;
+		if (nfa[s].type == NFA_SPLIT)
+		{
+			d->stack[sp++] = nfa[s].out1;
+			d->stack[sp++] = nfa[s].out;
+		}
+		else
+			d->set[(*n)++] = s;
+	}
+}
+
+static int
+compare_int(const void* a, const void* b)
+{
+	return *(const int*)a - *(const int*)b;
+}
+
+static void
+dfa_reset(struct dfa* d)
+{
+	d->count = 0;
+	d->members_len = 0;
+	memset(d->hash, 0, 2 * DFA_MAX * sizeof(*d->hash));
+}
+
+/*
+ * Returns the DFA state for the n NFA states in d->set, adding it when new.
+ * Returns -1 when there's no room for it, or memory runs out.
+ */
+static int
+dfa_intern(struct dfa* d, const int n)
+{
+	qsort(d->set, n, sizeof(*d->set), compare_int);
+
+	uint32_t hash = 2166136261U;
+	for (int i = 0; i < n; ++i)
+		hash = (hash ^ (uint32_t)d->set[i]) * 16777619U;
+
+	size_t h = hash % (2 * DFA_MAX);
+	for (; d->hash[h]; h = (h + 1) % (2 * DFA_MAX))
+	{
+		const int s = d->hash[h] - 1;
+		if (d->len[s] == n && !memcmp(d->members + d->first[s], d->set, n * sizeof(*d->set)))
+			return s;
+	}
+
+	if (d->count == DFA_MAX)
+		return -1;
+	if (d->members_len + n > d->members_size)
+	{
+		size_t size = d->members_size ? d->members_size : 4096;
+		while (d->members_len + n > size)
+			size *= 2;
+		int* const members = realloc(d->members, size * sizeof(*members));
+		if (!members)
+			return -1;
+		d->members = members;
+		d->members_size = size;
+	}
+
+	const int s = d->count++;
+	d->first[s] = d->members_len;
+	d->len[s] = n;
+	memcpy(d->members + d->members_len, d->set, n * sizeof(*d->set));
+	d->members_len += n;
+	d->flags[s] = n ? 0 : DFA_DEAD;
+	for (int i = 0; i < n; ++i)
+		if (d->r->nfa[d->set[i]].type == NFA_MATCH)
+			d->flags[s] |= DFA_ACCEPT;
+	memset(d->trans + (size_t)s * 256, 0xFF, 256 * sizeof(*d->trans));
+	d->hash[h] = s + 1;
+	return s;
+}
+
+/* Starts computing another state, with no NFA states in it yet */
+static void
+dfa_generation(struct dfa* d)
+{
+	if (!++d->gen)
+	{
+		memset(d->mark, 0, d->r->nfa_len * sizeof(*d->mark));
+		d->gen = 1;
+	}
+}
+
+/*
+ * Interns the state the DFA starts in. Searching, it's the one with no NFA
+ * states at all, the root is entered anew on every byte instead of being part
+ * of the states. They then only hold matches in progress, and the DFA being
+ * back at its start tells there are none.
+ */
+static int
+dfa_start(struct dfa* d)
+{
+	int n = 0;
+	if (!d->search)
+	{
+		dfa_generation(d);
+		dfa_closure(d, d->root, &n);
+	}
+	return dfa_intern(d, n);
+}
+
+static bool
+dfa_init(struct dfa* d, const struct redact* r, const int root, const bool search)
+{
+	d->r = r;
+	d->root = root;
+	d->search = search;
+	d->trans = malloc((size_t)DFA_MAX * 256 * sizeof(*d->trans));
+	d->flags = malloc(DFA_MAX * sizeof(*d->flags));
+	d->first = malloc(DFA_MAX * sizeof(*d->first));
+	d->len = malloc(DFA_MAX * sizeof(*d->len));
+	d->hash = malloc(2 * DFA_MAX * sizeof(*d->hash));
+	d->stack = malloc((2 * r->nfa_len + 1) * sizeof(*d->stack));
+	d->set = malloc(r->nfa_len * sizeof(*d->set));
+	d->mark = calloc(r->nfa_len, sizeof(*d->mark));
+	if (!d->trans || !d->flags || !d->first || !d->len || !d->hash || !d->stack || !d->set || !d->mark)
+		return false;
+
+	if (search)
+	{
+		dfa_generation(d);
+		dfa_closure(d, root, &d->root_len);
+		if (!(d->root_set = malloc(d->root_len * sizeof(*d->root_set) + 1)))
+			return false;
+		memcpy(d->root_set, d->set, d->root_len * sizeof(*d->root_set));
+	}
+	dfa_reset(d);
+	return dfa_start(d) == 0;
+}
+
+static void
+dfa_free(struct dfa* d)
+{
+	free(d->trans);
+	free(d->flags);
+	free(d->first);
+	free(d->len);
+	free(d->members);
+	free(d->hash);
+	free(d->stack);
+	free(d->set);
+	free(d->mark);
+	free(d->root_set);
+}
+
+static void
+dfa_step(struct dfa* d, const int* members, const int len, const unsigned char c, int* n)
+{
+	const struct nfa_state* const nfa = d->r->nfa;
+
+	for (int i = 0; i < len; ++i)
+		if (nfa[members[i]].type == NFA_CLASS && set_has(nfa[members[i]].set, c))
+			dfa_closure(d, nfa[members[i]].out, n);
+}
+
+/*
+ * Computes where s goes on c. When the DFA is full it starts over, with all
+ * states but the start forgotten. Returns -1 when memory runs out.
+ */
+static int
+dfa_next(struct dfa* d, const int s, const unsigned char c)
+{
+	int n = 0;
+
+	dfa_generation(d);
+	dfa_step(d, d->members + d->first[s], d->len[s], c, &n);
+	if (d->search)
+		dfa_step(d, d->root_set, d->root_len, c, &n);
+
+	int next = dfa_intern(d, n);
+	if (next >= 0)
+		d->trans[(size_t)s * 256 + c] = next;
+	else if (d->count == DFA_MAX)
+	{
+		/* Starting over overwrites the scratch, keep the set aside */
+		int* const set = malloc(n * sizeof(*set) + 1);
+		if (!set)
+			return -1;
+		memcpy(set, d->set, n * sizeof(*set));
+		dfa_reset(d);
+		if (dfa_start(d) == 0)
+		{
+			memcpy(d->set, set, n * sizeof(*set));
+			next = dfa_intern(d, n);
+		}
+		free(set);
+	}
+	return next;
+}
+
+static bool
+redact_start(struct redact* r)
+{
+	if (r->forward < 0)
+		r->forward = r->reverse = nfa_new(r, NFA_SPLIT, -1, -1);
+	r->started = true;
+	return r->forward >= 0
+	    && dfa_init(&r->dfa[0], r, r->forward, true)
+	    && dfa_init(&r->dfa[1], r, r->reverse, false);
+}
+
+void
+redact_free(struct redact* r)
+{
+	if (!r)
+		return;
+	dfa_free(&r->dfa[0]);
+	dfa_free(&r->dfa[1]);
+	free(r->nfa);
+	free(r->hold);
+	free(r->mask);
+	free(r->out);
+	free(r);
+}
+
+/*
+ * Bytes held back in the middle of a possible match, that redact_feed() or
+ * redact_flush() will return later.
+ */
+size_t
+redact_held(const struct redact* r)
+{
+	return r->held;
+}
+
+/*
+ * Marks the match ending at hold[end] as replaced, from where the reverse DFA
+ * finds it starts the earliest. When that's before what's still held, it all
+ * gets replaced.
+ */
+static bool
+redact_mark(struct redact* r, const size_t end)
+{
+	struct dfa* const d = &r->dfa[1];
+	size_t start = 0;
+	int s = 0;
+
+	for (size_t i = end + 1; i--; )
+	{
+		int next = d->trans[(size_t)s * 256 + r->hold[i]];
+		if (next < 0 && (next = dfa_next(d, s, r->hold[i])) < 0)
+			return false;
+		s = next;
+		if (d->flags[s] & DFA_DEAD)
+			break;
+		if (d->flags[s] & DFA_ACCEPT)
+			start = i;
+	}
+
+	memset(r->mask + start, 1, end + 1 - start);
+	return true;
+}
+
+/*
+ * Writes the first len bytes held to r->out and drops them, with every
+ * replaced character becoming a single '*', to keep the layout of the screen.
+ */
+static size_t
+redact_emit(struct redact* r, const size_t len)
+{
+	if (len > r->out_size)
+	{
+		char* const out = realloc(r->out, len);
+		if (!out)
+			return (size_t)-1;
+		r->out = out;
+		r->out_size = len;
+	}
+
+	char* o = r->out;
+	for (size_t i = 0; i < len; )
+	{
+		const unsigned char* const m = memchr(r->mask + i, 1, len - i);
+		const size_t run = m ? (size_t)(m - r->mask) - i : len - i;
+		if (run)
+		{
+			memcpy(o, r->hold + i, run);
+			o += run;
+			i += run;
+			r->masked = false;
+		}
+		for (; i < len && r->mask[i]; ++i)
+		{
+			/* Continuation bytes of UTF-8 belong to the character already replaced */
+			if ((r->hold[i] & 0xC0) != 0x80 || !r->masked)
+				*o++ = '*';
+			r->masked = true;
+		}
+	}
+
+	r->held -= len;
+	memmove(r->hold, r->hold + len, r->held);
+	memmove(r->mask, r->mask + len, r->held);
+	return o - r->out;
+}
+
+/*
+ * Passes the data in iov through, with *out set to what of it and of what
+ * was held before can be written. Returns its length, or (size_t)-1 when
+ * memory runs out.
+ */
+size_t
+redact_feed(struct redact* r, const struct iovec* iov, const int cnt, const char** out)
+{
+	if (!r->started && !redact_start(r))
+		return (size_t)-1;
+
+	size_t len = r->held;
+	for (int i = 0; i < cnt; ++i)
+		len += iov[i].iov_len;
+	if (len > r->hold_size)
+	{
+		unsigned char* const hold = realloc(r->hold, len);
+		if (hold)
+			r->hold = hold;
+		unsigned char* const mask = realloc(r->mask, len);
+		if (mask)
+			r->mask = mask;
+		if (!hold || !mask)
+			return (size_t)-1;
+		r->hold_size = len;
+	}
+
+	const size_t from = r->held;
+	for (int i = 0; i < cnt; ++i)
+	{
+		memcpy(r->hold + r->held, iov[i].iov_base, iov[i].iov_len);
+		r->held += iov[i].iov_len;
+	}
+	memset(r->mask + from, 0, len - from);
+
+	/* What comes before the DFA returning to its start can't be part of a match anymore */
+	struct dfa* const d = &r->dfa[0];
+	size_t safe = 0;
+	int s = r->state;
+	for (size_t i = from; i < len; ++i)
+	{
+		if (!s)
+		{
+			/* Nothing's in progress most of the time, skip ahead while that lasts */
+			while (i < len && !d->trans[r->hold[i]])
+				++i;
+			safe = i;
+			if (i == len)
+				break;
+		}
+
+		int next = d->trans[(size_t)s * 256 + r->hold[i]];
+		if (next < 0 && (next = dfa_next(d, s, r->hold[i])) < 0)
+			return (size_t)-1;
+		s = next;
+		if (!s)
+			safe = i + 1;
+		else if (d->flags[s] & DFA_ACCEPT && !redact_mark(r, i))
+			return (size_t)-1;
+	}
+	r->state = s;
+
+	if (len - safe > REDACT_HOLD_MAX)
+		safe = len - REDACT_HOLD_MAX;
+	const size_t n = redact_emit(r, safe);
+	*out = r->out;
+	return n;
+}
+
+/*
+ * Returns what's held back, at the end of the data.
+ */
+size_t
+redact_flush(struct redact* r, const char** out)
+{
+	r->state = 0;
+	const size_t n = redact_emit(r, r->held);
+	*out = r->out;
+	return n;
+}
@@ -0,0 +1,34 @@
+/*
+ * Streaming redaction, keeping secrets out of typescripts.
+ *
+ * This file is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef REDACT_H
+#define REDACT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Output held back for a match that may still be coming, matches longer than this are only partly replaced */
+#define REDACT_HOLD_MAX 4096
+
+struct iovec;
+struct redact;
+
+struct redact* redact_new(void);
+void redact_free(struct redact* r);
+const char* redact_add(struct redact* r, const char* pattern, size_t len, bool regex);
+size_t redact_held(const struct redact* r);
+size_t redact_feed(struct redact* r, const struct iovec* iov, int cnt, const char** out);
+size_t redact_flush(struct redact* r, const char** out);
+
+#endif
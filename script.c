@@ -38,12 +38,15 @@
  * 2000-07-30 Per Andreas Buer <per@linpro.no> - added "q"-option
  */
 
-#define _XOPEN_SOURCE 500
+#define _GNU_SOURCE
 
 /*
  * script
  */
+#include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
@@ -54,6 +57,14 @@
 #include <sys/time.h>
 #include <sys/file.h>
 #include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
 #include <signal.h>
 #include <errno.h>
 #include <string.h>
@@ -61,8 +72,14 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <locale.h>
+#include <pthread.h>
+#include <spawn.h>
 #include <stropts.h>
 #include <sysexits.h>
+#include <zlib.h>
+
+#include "redact.h"
+#include "vt.h"
 
 #define _(Text) (Text)
 
@@ -78,14 +95,26 @@
 
 #define BUFSIZE (65536UL)
 
+/* How long to wait for more output on the pty after the child died */
+#define CHILD_LINGER_MS 10
+
+/* Intervals in seconds get counted in nanoseconds */
+#define INTERVAL_MAX (LLONG_MAX / 1000000000LL)
+
 static void finish(int);
 static void fail(void) __attribute__((__noreturn__));
 static void resize(int);
+static void request_stats(int);
 static void fixtty(const struct termios*);
+static int open_master(void);
 static void getmaster(void);
 static int getslave(const char* pts, const struct termios* origtty);
 static int doio(const struct termios* origtty, const int pty);
 static int doshell(const char* pts, const struct termios* origtty);
+static pid_t spawnshell(const char* pts, const struct termios* origtty, const sigset_t* mask);
+static int daemon_main(const char* path);
+static size_t writer_queue_min(void);
+static int client_main(const char* path);
 
 static int master = -1;
 static pid_t child;
@@ -99,11 +128,126 @@ static int fflg = 0;
 static int nflg = 0;
 static int qflg = 0;
 static int tflg = 0;
+static int zflg = 0;
+static size_t queue_size = 0;
+static bool queue_spill = false;
+static long sync_interval = -1;
+static size_t sync_size = 0;
+static int compress_level = Z_DEFAULT_COMPRESSION;
+static size_t compress_block = 256UL << 10;
+static long index_interval = -1;
+static size_t index_size = 0;
+static long keyframe_interval = -1;
+static long delay_resolution = 0;
+static bool compact_delays = false;
+static bool nsec_delays = false;
+static bool binary_timing = false;
+static long rotate_interval = -1;
+static size_t rotate_size = 0;
+static clockid_t delay_clock = CLOCK_MONOTONIC;
+static bool stats_enabled = false;
+static const char* daemon_socket = NULL;
+static const char* connect_socket = NULL;
+static const char* share_socket = NULL;
+static size_t pool_size = 64UL << 20;
+static const char* stats_file = NULL;
+static char* const* exec_argv = NULL;
+static struct redact* redaction = NULL;
+
+enum {
+	OPT_WRITER_QUEUE = CHAR_MAX + 1,
+	OPT_QUEUE_FULL,
+	OPT_SYNC_INTERVAL,
+	OPT_SYNC_SIZE,
+	OPT_COMPRESS_BLOCK,
+	OPT_INDEX_INTERVAL,
+	OPT_INDEX_SIZE,
+	OPT_KEYFRAME_INTERVAL,
+	OPT_DELAY_RESOLUTION,
+	OPT_COMPACT_DELAYS,
+	OPT_NSEC_DELAYS,
+	OPT_COARSE_CLOCK,
+	OPT_BINARY_TIMING,
+	OPT_ROTATE_INTERVAL,
+	OPT_ROTATE_SIZE,
+	OPT_STATS,
+	OPT_DAEMON,
+	OPT_CONNECT,
+	OPT_POOL_SIZE,
+	OPT_SHARE,
+	OPT_EXEC,
+	OPT_REDACT,
+	OPT_REDACT_REGEX,
+	OPT_REDACT_FILE,
+};
 
 static const char* progname;
 
 static volatile bool die;
 static volatile unsigned resized;
+static volatile unsigned stats_requested;
+
+/* Parses a size option, in bytes or with a K, M or G suffix, of at least min bytes. */
+static size_t
+getsize(const char* s, const size_t min) {
+	char* end;
+	unsigned shift = 0;
+
+	errno = 0;
+	const unsigned long long size = strtoull(s, &end, 10);
+	switch (*end) {
+		case 'G':
+			shift += 10;
+			/* fall through */
+		case 'M':
+			shift += 10;
+			/* fall through */
+		case 'k':
+		case 'K':
+			shift += 10;
+			++end;
+	}
+
+	if (errno || end == s || *end || *s == '-' || size > SIZE_MAX >> shift) {
+		fprintf(stderr, _("%s: invalid size '%s'\n"), progname, s);
+		exit(EX_USAGE);
+	}
+	if (size << shift < min) {
+		fprintf(stderr, _("%s: size '%s' too small, it takes at least %zu bytes\n"), progname, s, min);
+		exit(EX_USAGE);
+	}
+	return size << shift;
+}
+
+/* Parses an interval option, a whole number of seconds or milliseconds up to max. */
+static long
+getinterval(const char* s, const long long max) {
+	char* end;
+
+	errno = 0;
+	const long interval = strtol(s, &end, 10);
+	if (errno || end == s || *end || interval < 0 || interval > max) {
+		fprintf(stderr, _("%s: invalid interval '%s'\n"), progname, s);
+		exit(EX_USAGE);
+	}
+	return interval;
+}
+
+/* Returns whether the file starts with a gzip header, -1 when it's empty or missing. */
+static int
+is_compressed(const char* fn) {
+	unsigned char magic[2];
+
+	const int fd = open(fn, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return -1;
+	const ssize_t len = read(fd, magic, sizeof(magic));
+	close(fd);
+
+	if (len <= 0)
+		return -1;
+	return len == sizeof(magic) && magic[0] == 0x1f && magic[1] == 0x8b;
+}
 
 static void
 die_if_link(const char* fn) {
@@ -120,6 +264,49 @@ die_if_link(const char* fn) {
 	}
 }
 
+/* Adds a pattern to replace in the typescript, exits on one that won't do. */
+static void
+add_redaction(const char* pattern, const size_t len, const bool regex) {
+	if (!redaction && !(redaction = redact_new())) {
+		perror("malloc");
+		exit(EX_OSERR);
+	}
+
+	const char* const error = redact_add(redaction, pattern, len, regex);
+	if (error) {
+		fprintf(stderr, _("%s: invalid pattern '%.*s': %s\n"), progname, (int)len, pattern, error);
+		exit(EX_USAGE);
+	}
+}
+
+/* Adds every non-empty line of the file as a string to replace. */
+static void
+add_redaction_file(const char* fn) {
+	FILE* const f = fopen(fn, "re");
+	if (!f) {
+		perror(fn);
+		exit(EX_NOINPUT);
+	}
+
+	char* line = NULL;
+	size_t size = 0;
+	ssize_t len;
+	while ((len = getline(&line, &size, f)) != -1) {
+		if (len && line[len - 1] == '\n')
+			--len;
+		if (len && line[len - 1] == '\r')
+			--len;
+		if (len)
+			add_redaction(line, len, false);
+	}
+	if (ferror(f)) {
+		perror(fn);
+		exit(EX_IOERR);
+	}
+	free(line);
+	fclose(f);
+}
+
 /*
  * script -t prints time delays as floating point numbers
  * The example program (scriptreplay) that we provide to handle this
@@ -135,6 +322,40 @@ main(int argc, char **argv) {
 	extern int optind;
 	const char* p;
 	int ch;
+	static const struct option longopts[] = {
+		{ "append",       no_argument,       NULL, 'a' },
+		{ "command",      required_argument, NULL, 'c' },
+		{ "return",       no_argument,       NULL, 'e' },
+		{ "flush",        no_argument,       NULL, 'f' },
+		{ "quiet",        no_argument,       NULL, 'q' },
+		{ "timing",       no_argument,       NULL, 't' },
+		{ "writer-queue", required_argument, NULL, OPT_WRITER_QUEUE },
+		{ "queue-full",   required_argument, NULL, OPT_QUEUE_FULL },
+		{ "sync-interval", required_argument, NULL, OPT_SYNC_INTERVAL },
+		{ "sync-size",    required_argument, NULL, OPT_SYNC_SIZE },
+		{ "compress",     optional_argument, NULL, 'z' },
+		{ "compress-block", required_argument, NULL, OPT_COMPRESS_BLOCK },
+		{ "index-interval", required_argument, NULL, OPT_INDEX_INTERVAL },
+		{ "index-size",   required_argument, NULL, OPT_INDEX_SIZE },
+		{ "keyframe-interval", required_argument, NULL, OPT_KEYFRAME_INTERVAL },
+		{ "delay-resolution", required_argument, NULL, OPT_DELAY_RESOLUTION },
+		{ "compact-delays", no_argument,     NULL, OPT_COMPACT_DELAYS },
+		{ "nanosecond-delays", no_argument,  NULL, OPT_NSEC_DELAYS },
+		{ "coarse-clock", no_argument,       NULL, OPT_COARSE_CLOCK },
+		{ "binary-timing", no_argument,      NULL, OPT_BINARY_TIMING },
+		{ "rotate-interval", required_argument, NULL, OPT_ROTATE_INTERVAL },
+		{ "rotate-size",  required_argument, NULL, OPT_ROTATE_SIZE },
+		{ "stats",        optional_argument, NULL, OPT_STATS },
+		{ "daemon",       required_argument, NULL, OPT_DAEMON },
+		{ "connect",      required_argument, NULL, OPT_CONNECT },
+		{ "pool-size",    required_argument, NULL, OPT_POOL_SIZE },
+		{ "share",        required_argument, NULL, OPT_SHARE },
+		{ "exec",         no_argument,       NULL, OPT_EXEC },
+		{ "redact",       required_argument, NULL, OPT_REDACT },
+		{ "redact-regex", required_argument, NULL, OPT_REDACT_REGEX },
+		{ "redact-file",  required_argument, NULL, OPT_REDACT_FILE },
+		{ NULL,           0,                 NULL, 0 }
+	};
 
 	progname = argv[0];
 	if ((p = strrchr(progname, '/')) != NULL)
@@ -152,8 +373,9 @@ main(int argc, char **argv) {
 		}
 	}
 
-	while ((ch = getopt(argc, argv, "ac:efnqt")) != -1)
-		switch((char)ch) {
+	bool exec_command = false;
+	while ((ch = getopt_long(argc, argv, "ac:efnqtz::", longopts, NULL)) != -1)
+		switch(ch) {
 		case 'a':
 			aflg++;
 			break;
@@ -175,10 +397,101 @@ main(int argc, char **argv) {
 		case 't':
 			tflg++;
 			break;
+		case OPT_WRITER_QUEUE:
+			queue_size = getsize(optarg, writer_queue_min());
+			break;
+		case OPT_QUEUE_FULL:
+			if (!strcmp(optarg, "spill"))
+				queue_spill = true;
+			else if (!strcmp(optarg, "block"))
+				queue_spill = false;
+			else {
+				fprintf(stderr, _("%s: unknown queue policy '%s'\n"), progname, optarg);
+				return EX_USAGE;
+			}
+			break;
+		case OPT_SYNC_INTERVAL:
+			sync_interval = getinterval(optarg, INT_MAX);
+			break;
+		case OPT_SYNC_SIZE:
+			sync_size = getsize(optarg, 0);
+			break;
+		case 'z':
+			zflg++;
+			if (optarg) {
+				char* end;
+				compress_level = strtol(optarg, &end, 10);
+				if (end == optarg || *end || compress_level < 1 || compress_level > 9) {
+					fprintf(stderr, _("%s: invalid compression level '%s'\n"), progname, optarg);
+					return EX_USAGE;
+				}
+			}
+			break;
+		case OPT_COMPRESS_BLOCK:
+			compress_block = getsize(optarg, 1);
+			break;
+		case OPT_INDEX_INTERVAL:
+			index_interval = getinterval(optarg, INTERVAL_MAX);
+			break;
+		case OPT_INDEX_SIZE:
+			index_size = getsize(optarg, 0);
+			break;
+		case OPT_KEYFRAME_INTERVAL:
+			keyframe_interval = getinterval(optarg, INTERVAL_MAX);
+			break;
+		case OPT_DELAY_RESOLUTION:
+			delay_resolution = getinterval(optarg, INT_MAX);
+			break;
+		case OPT_COMPACT_DELAYS:
+			compact_delays = true;
+			break;
+		case OPT_NSEC_DELAYS:
+			nsec_delays = true;
+			break;
+		case OPT_COARSE_CLOCK:
+#ifdef CLOCK_MONOTONIC_COARSE
+			delay_clock = CLOCK_MONOTONIC_COARSE;
+#endif
+			break;
+		case OPT_BINARY_TIMING:
+			binary_timing = true;
+			break;
+		case OPT_ROTATE_INTERVAL:
+			rotate_interval = getinterval(optarg, INTERVAL_MAX);
+			break;
+		case OPT_ROTATE_SIZE:
+			rotate_size = getsize(optarg, 0);
+			break;
+		case OPT_STATS:
+			stats_enabled = true;
+			stats_file = optarg;
+			break;
+		case OPT_DAEMON:
+			daemon_socket = optarg;
+			break;
+		case OPT_CONNECT:
+			connect_socket = optarg;
+			break;
+		case OPT_POOL_SIZE:
+			pool_size = getsize(optarg, 0);
+			break;
+		case OPT_SHARE:
+			share_socket = optarg;
+			break;
+		case OPT_EXEC:
+			exec_command = true;
+			break;
+		case OPT_REDACT:
+		case OPT_REDACT_REGEX:
+			add_redaction(optarg, strlen(optarg), ch == OPT_REDACT_REGEX);
+			break;
+		case OPT_REDACT_FILE:
+			add_redaction_file(optarg);
+			break;
 		case '?':
 		default:
 			fprintf(stderr,
-				_("usage: script [-a] [-e] [-f] [-n] [-q] [-t] [file]\n"
+				_("usage: script [-a] [-e] [-f] [-n] [-q] [-t] [-z[LEVEL]] [--writer-queue SIZE] [--sync-interval MS] [--sync-size SIZE] [--index-interval SECONDS] [--index-size SIZE] [--keyframe-interval SECONDS] [--delay-resolution MS] [--compact-delays] [--nanosecond-delays] [--coarse-clock] [--binary-timing] [--rotate-interval SECONDS] [--rotate-size SIZE] [--stats[=FILE]] [--daemon SOCKET [--pool-size SIZE]] [--connect SOCKET] [--share SOCKET] [--redact STRING] [--redact-regex REGEX] [--redact-file FILE] [file | --exec [--] file command [argument...]]\n"
 				  "\n"
 				  "makes a typescript of everything printed on your terminal.\n"
 				  "It is useful for students who need a hardcopy record of an interactive\n"
@@ -188,17 +501,95 @@ main(int argc, char **argv) {
 				  "\n"
 				  "    -a          Append the output to file, retaining the prior contents.\n"
 				  "    -c COMMAND  Run the COMMAND rather than an interactive shell.\n"
+				  "    --exec      Run the command following the file directly, without a shell.\n"
 				  "    -e          Return the exit code of the child process.\n"
 				  "    -f          Flush output after each write.\n"
 				  "    -n          Prevents overwriting of file if it exists already.\n"
 				  "    -q          Be quiet (supresses script started/stopped on $date messages).\n"
 				  "    -t          Output timing data to standard error.\n"
+				  "    --binary-timing\n"
+				  "                With -t, output fixed-width binary records instead of text.\n"
+				  "    -z[LEVEL]   Compress the typescript with gzip.\n"
+				  "    --writer-queue SIZE\n"
+				  "                Write the typescript from a separate thread, queueing at most SIZE bytes.\n"
+				  "    --queue-full block|spill\n"
+				  "                When that queue is full stop reading (block) or use a temporary file (spill).\n"
+				  "    --sync-interval MS, --sync-size SIZE\n"
+				  "                Instead of synchronous writes for -f, fdatasync() the typescript once data\n"
+				  "                went unsynced for MS milliseconds or SIZE bytes went unsynced.\n"
+				  "    --compress-block SIZE\n"
+				  "                With -z, start a new gzip member after every SIZE bytes of output.\n"
+				  "    --index-interval SECONDS, --index-size SIZE\n"
+				  "                Write file.idx, pointing scriptreplay --start at the typescript every\n"
+				  "                SECONDS seconds or SIZE bytes of output.\n"
+				  "    --keyframe-interval SECONDS\n"
+				  "                Add a snapshot of the screen every SECONDS seconds, and at every index\n"
+				  "                point, for scriptreplay --start to show the screen from.\n"
+				  "    --delay-resolution MS\n"
+				  "                Only add a delay command once MS milliseconds of delay accumulated.\n"
+				  "    --compact-delays\n"
+				  "                Write delay commands as hexadecimal microseconds.\n"
+				  "    --nanosecond-delays\n"
+				  "                Write delay commands with nanoseconds instead of microseconds.\n"
+				  "    --coarse-clock\n"
+				  "                Time output with the cheaper, but only millisecond accurate, coarse clock.\n"
+				  "    --rotate-interval SECONDS, --rotate-size SIZE\n"
+				  "                Continue the typescript in file.0001, file.0002 and so on, every\n"
+				  "                SECONDS seconds or SIZE bytes of output.\n"
+				  "    --stats[=FILE]\n"
+				  "                Report throughput and latency to FILE, or standard error, on SIGUSR1 and at exit.\n"
+				  "    --daemon SOCKET\n"
+				  "                Record the sessions of every script --connect SOCKET from a single process.\n"
+				  "    --pool-size SIZE\n"
+				  "                Have that daemon use at most SIZE bytes of buffers for all its sessions.\n"
+				  "    --connect SOCKET\n"
+				  "                Have the daemon listening on SOCKET record this session.\n"
+				  "    --share SOCKET\n"
+				  "                Let scriptreplay --attach SOCKET watch the session live.\n"
+				  "    --redact STRING, --redact-regex REGEX\n"
+				  "                Replace STRING, or what matches REGEX, with asterisks in the typescript.\n"
+				  "    --redact-file FILE\n"
+				  "                Replace every line of FILE as a string, keeping them off the command line.\n"
 				  "\n"));
 			return EX_USAGE;
 		}
 	argc -= optind;
 	argv += optind;
 
+	if (aflg && (rotate_interval >= 0 || rotate_size)) {
+		fprintf(stderr, _("%s: can't append to a rotated typescript\n"), progname);
+		return EX_USAGE;
+	}
+
+	if (nsec_delays && compact_delays) {
+		fprintf(stderr, _("%s: --nanosecond-delays can't be combined with --compact-delays\n"), progname);
+		return EX_USAGE;
+	}
+
+	// Sessions recorded by the daemon only get plain typescripts
+	if ((daemon_socket || connect_socket)
+	 && (zflg || tflg || fflg || queue_size || sync_interval >= 0 || sync_size || index_interval >= 0 || index_size || keyframe_interval >= 0
+	  || rotate_interval >= 0 || rotate_size || stats_enabled || share_socket || redaction || (daemon_socket && connect_socket))) {
+		fprintf(stderr, _("%s: --daemon and --connect can only be combined with -a, -c, -e, -n, -q and the delay options\n"), progname);
+		return EX_USAGE;
+	}
+
+	if (exec_command) {
+		if (argc < 2 || cflg || daemon_socket || connect_socket) {
+			fprintf(stderr, _("%s: --exec needs a file and a command, and can't be combined with -c, --daemon or --connect\n"), progname);
+			return EX_USAGE;
+		}
+		exec_argv = argv + 1;
+	}
+
+	if (daemon_socket) {
+		if (argc > 0 || cflg || aflg || nflg || eflg) {
+			fprintf(stderr, _("%s: the clients choose the file and the command\n"), progname);
+			return EX_USAGE;
+		}
+		return daemon_main(daemon_socket);
+	}
+
 	if (argc > 0)
 		fname = argv[0];
 	else {
@@ -206,6 +597,22 @@ main(int argc, char **argv) {
 		die_if_link(fname);
 	}
 
+	// Gzip members can be concatenated, but we can't mix them with plain text
+	if (aflg && is_compressed(fname) == !zflg) {
+		fprintf(stderr, zflg
+			? _("%s: can't append compressed output to an uncompressed typescript\n")
+			: _("%s: can't append uncompressed output to a compressed typescript\n"),
+			fname);
+		return EX_DATAERR;
+	}
+
+	if (connect_socket)
+		return client_main(connect_socket);
+
+	// Compression happens on the writer thread
+	if (zflg && !queue_size)
+		queue_size = 1UL << 20;
+
 	getmaster();
 	if (!qflg)
 		printf(_("Script started, file is %s\n"), fname);
@@ -223,14 +630,9 @@ main(int argc, char **argv) {
 	sigaddset(&block_mask, SIGCHLD);
 
 	sigprocmask(SIG_SETMASK, &block_mask, &unblock_mask);
-	child = fork();
-	sigprocmask(SIG_SETMASK, &unblock_mask, NULL);
-
-	if (child == -1) {
-		perror("fork");
-		fail();
-	}
+	child = spawnshell(pts, &origtty, &unblock_mask);
 	if (child == 0) {
+		sigprocmask(SIG_SETMASK, &unblock_mask, NULL);
 		close(master);
 		master = -1;
 		return doshell(pts, &origtty);
@@ -247,223 +649,2083 @@ main(int argc, char **argv) {
 	sa.sa_handler = resize;
 	sigaction(SIGWINCH, &sa, NULL);
 
+	/* SIGUSR1 handler */
+	if (stats_enabled) {
+		sa.sa_handler = request_stats;
+		sigaction(SIGUSR1, &sa, NULL);
+	}
+
+	// A child that's quick to exit mustn't do so before there's a handler to notice
+	sigprocmask(SIG_SETMASK, &unblock_mask, NULL);
+
 	return doio(&origtty, master);
 }
 
 #define MAX(a,b) ((a) < (b) ? (b) : (a))
 #define MIN(a,b) ((a) < (b) ? (a) : (b))
 
-static int
-doio(const struct termios* origtty, const int pty) {
-	bool stdin_open  = true,
-	     stdout_open = true,
-	     script_open = true,
-	     ptyin_open  = true,
-	     ptyout_open = true;
-	char ptyoutbuf[BUFSIZE],
-	     stdoutbuf[BUFSIZE],
-	     scriptbuf[BUFSIZE];
-	size_t ptyoutpending = 0,
-	       stdoutpending = 0,
-	       scriptpending = 0;
-	static const size_t delay_spec_size  = sizeof("\x1B_D;18446744073709551615.999999\x1B\\") - 1;
-	static const size_t resize_spec_size = sizeof("\x1B[8;65535;65535t") - 1;
+/*
+ * FIFO byte buffer for doio(). Whenever the kernel allows it the backing
+ * memory gets mapped twice, back to back, which makes every pending and every
+ * free region contiguous. Otherwise regions may wrap around the end, in which
+ * case they're described by two iovecs instead of one. Either way consuming
+ * data never has to move the remainder to the front of the buffer.
+ */
+struct ring {
+	char*  data;
+	size_t size;     /* Must be a power of two */
+	size_t head;     /* Total amount of bytes ever produced */
+	size_t tail;     /* Total amount of bytes ever consumed */
+	bool   mirrored;
+};
 
-	const int scriptfd = open(fname, O_WRONLY | O_CREAT | (aflg ? O_APPEND : (nflg ? O_EXCL : O_TRUNC))
-			/* Flush data after each write when requested. */
-#if O_DSYNC
-			| (fflg ? O_DSYNC : 0)
-#elif O_SYNC
-			| (fflg ? O_SYNC : 0)
-#elif O_FSYNC
-			| (fflg ? O_FSYNC : 0)
+static void
+ring_init(struct ring* r, const size_t size) {
+	r->size = size;
+	r->head = r->tail = 0;
+	r->mirrored = false;
+
+#ifdef MFD_CLOEXEC
+	const int fd = size % sysconf(_SC_PAGESIZE) == 0 ? memfd_create("script-ring", MFD_CLOEXEC) : -1;
+	if (fd != -1) {
+		char* const base = ftruncate(fd, size) == 0
+			? mmap(NULL, 2 * size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)
+			: MAP_FAILED;
+		if (base != MAP_FAILED) {
+			if (mmap(base,        size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == base
+			 && mmap(base + size, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == base + size) {
+				close(fd);
+				r->data = base;
+				r->mirrored = true;
+				return;
+			}
+			munmap(base, 2 * size);
+		}
+		close(fd);
+	}
 #endif
-			, 0666);
-	if (scriptfd == -1) {
-		perror(fname);
+
+	r->data = malloc(size);
+	if (!r->data) {
+		perror("malloc");
 		fail();
 	}
+}
 
-	struct timeval oldtime, newtime;
-	gettimeofday(&newtime, NULL);
-	oldtime = newtime;
-	{
-		char tbuf[256];
-		if (strftime(tbuf, sizeof(tbuf), "%Y-%m-%d %H:%M:%S %Z\n", gmtime(&newtime.tv_sec)))
-			scriptpending = snprintf(scriptbuf, sizeof(scriptbuf), _("Script started on %s\r\n"), tbuf);
-		else
-			scriptpending = snprintf(scriptbuf, sizeof(scriptbuf), "%s", _("Script started\r\n"));
+static size_t
+ring_pending(const struct ring* r) {
+	return r->head - r->tail;
+}
+
+static int
+ring_iov(const struct ring* r, const size_t pos, const size_t len, struct iovec iov[2]) {
+	const size_t off = pos & (r->size - 1);
+
+	if (!len)
+		return 0;
+
+	iov[0].iov_base = r->data + off;
+	if (r->mirrored || off + len <= r->size) {
+		iov[0].iov_len = len;
+		return 1;
 	}
 
-	const int nfds = MAX(STDIN_FILENO, MAX(STDOUT_FILENO, MAX(pty, scriptfd))) + 1;
+	iov[0].iov_len = r->size - off;
+	iov[1].iov_base = r->data;
+	iov[1].iov_len = len - iov[0].iov_len;
+	return 2;
+}
 
-	fixtty(origtty);
-	int exitcode = EX_OK;
+/* Describes up to max bytes of pending data, returns the iovec count. */
+static int
+ring_data(const struct ring* r, struct iovec iov[2], const size_t max) {
+	return ring_iov(r, r->tail, MIN(ring_pending(r), max), iov);
+}
 
-	while (stdin_open || (ptyout_open && ptyoutpending)
-	    || ptyin_open || (stdout_open && stdoutpending) || (script_open && scriptpending))
-	{
-		fd_set rfds, wfds;
-		FD_ZERO(&rfds);
-		FD_ZERO(&wfds);
-
-		if (stdin_open && ptyoutpending < sizeof(ptyoutbuf))
-			FD_SET(STDIN_FILENO, &rfds);
-		if (stdout_open && stdoutpending)
-			FD_SET(STDOUT_FILENO, &wfds);
-		if (script_open && scriptpending)
-			FD_SET(scriptfd, &wfds);
-
-		if (ptyin_open && MAX(stdoutpending, scriptpending + delay_spec_size) < MIN(sizeof(stdoutbuf), sizeof(scriptbuf)))
-			FD_SET(pty, &rfds);
-		if (ptyout_open && ptyoutpending)
-			FD_SET(pty, &wfds);
-
-		const int ret = select(nfds, &rfds, &wfds, NULL, NULL);
-		if (ret == -1)
-		{
-			if (errno == EINTR)
-			{
-				FD_ZERO(&rfds);
-				FD_ZERO(&wfds);
-			}
-			else
-			{
-				perror("select");
-				exitcode = EX_OSERR;
-				goto restoretty;
-			}
-		}
+/* Describes up to max bytes of free space, returns the iovec count. */
+static int
+ring_space(const struct ring* r, struct iovec iov[2], const size_t max) {
+	return ring_iov(r, r->head, MIN(r->size - ring_pending(r), max), iov);
+}
 
-		// Process resizes ASAP
-		if (scriptpending + resize_spec_size < sizeof(scriptbuf) && resized)
-		{
-			__sync_fetch_and_sub(&resized, 1);
+static void
+ring_produce(struct ring* r, const size_t len) {
+	r->head += len;
+}
 
-			struct winsize win;
-			if (ioctl(STDIN_FILENO, TIOCGWINSZ, &win) == -1)
-			{
-				switch (errno)
-				{
-					case EINTR:
-						break;
-					case EBADF:
-						if (!stdin_open)
-							break;
-					default:
-						perror("ioctl(stdin, TIOCGWINSZ /* get window size */)");
-						exitcode = EX_IOERR;
-						goto restoretty;
-				}
-			}
-			else
-			{
-				// Notify PTY clients
-				ioctl(pty, TIOCSWINSZ, &win);
+static void
+ring_consume(struct ring* r, const size_t len) {
+	r->tail += len;
+}
 
-				const int len = snprintf(scriptbuf + scriptpending, sizeof(scriptbuf) - scriptpending,
-						"\x1B[8;%hu;%hut", win.ws_row, win.ws_col);
-				if (len >= 0 && len < sizeof(scriptbuf) - scriptpending)
-					scriptpending += len;
-			}
-		}
+static void
+ring_put(struct ring* r, const void* data, size_t len) {
+	struct iovec iov[2];
+	const int cnt = ring_space(r, iov, len);
+	for (int i = 0; i < cnt; ++i) {
+		memcpy(iov[i].iov_base, data, iov[i].iov_len);
+		data = (const char*)data + iov[i].iov_len;
+		ring_produce(r, iov[i].iov_len);
+	}
+}
 
-		gettimeofday(&newtime, NULL);
+static size_t
+ring_pending_from(const struct ring* r, const size_t pos) {
+	return r->head - pos;
+}
 
-		// Send data down the pseudo terminal first
-		if (ptyoutpending && FD_ISSET(pty, &wfds))
-		{
-			ssize_t ret = write(pty, ptyoutbuf, ptyoutpending);
-			if (ret == -1)
-			{
-				switch (errno)
-				{
-					case EINTR:
-						break;
-					case ECONNRESET:
-					case EPIPE:
-						ptyout_open = false;
-						break;
-					default:
-						perror("write(pty)");
-						exitcode = EX_IOERR;
-						goto restoretty;
-				}
-			}
-			else
-			{
-				ptyoutpending -= ret;
-				memmove(ptyoutbuf, ptyoutbuf + ret, ptyoutpending);
-			}
-		}
+/* Releases the data that both readers, at the given positions, are done with. */
+static void
+ring_release(struct ring* r, const size_t pos1, const size_t pos2) {
+	r->tail = (pos1 - r->tail) < (pos2 - r->tail) ? pos1 : pos2;
+}
 
-		// Send data down stdout next
-		if (stdoutpending && FD_ISSET(STDOUT_FILENO, &wfds))
-		{
-			ssize_t ret = write(STDOUT_FILENO, stdoutbuf, stdoutpending);
-			if (ret == -1)
-			{
-				switch (errno)
-				{
-					case EINTR:
-						break;
-					case ECONNRESET:
-					case EPIPE:
-						close(STDOUT_FILENO);
-						stdout_open = false;
-						break;
-					default:
-						perror("write");
-						exitcode = EX_IOERR;
-						goto restoretty;
-				}
-			}
-			else
-			{
-				stdoutpending -= ret;
-				memmove(stdoutbuf, stdoutbuf + ret, stdoutpending);
-			}
-		}
+/* Describes up to max bytes of the data between pos and the head. */
+static int
+ring_data_from(const struct ring* r, const size_t pos, struct iovec iov[2], const size_t max) {
+	return ring_iov(r, pos, MIN(r->head - pos, max), iov);
+}
 
-		// Send data down typescript next
-		if (scriptpending && FD_ISSET(scriptfd, &wfds))
-		{
-			ssize_t ret = write(scriptfd, scriptbuf, scriptpending);
-			if (ret == -1)
-			{
-				switch (errno)
-				{
-					case EINTR:
-						break;
-					case ECONNRESET:
-					case EPIPE:
-						close(scriptfd);
-						script_open = false;
-						break;
-					default:
-						perror("write");
-						exitcode = EX_IOERR;
-						goto restoretty;
-				}
-			}
-			else
-			{
-				scriptpending -= ret;
-				memmove(scriptbuf, scriptbuf + ret, scriptpending);
-			}
+#define MAX_SEGMENTS 1024
+/*
+ * The most segments a single pty read adds: the end of a rotated segment, the
+ * header of the next, an index point, the keyframe and delay command and the
+ * output itself. The end of the session adds at most two more.
+ */
+#define READ_SEGMENTS 5
+#define MAX_IOV 64
+
+/*
+ * The typescript contains the pty's output interleaved with data of its own
+ * (delay commands, resize sequences and the start/done messages). Instead of
+ * copying the pty's output from the buffer it shares with stdout we record the
+ * order in which to take data from either buffer and gather them with
+ * writev().
+ */
+struct typescript {
+	struct ring  own;
+	struct ring* shared;
+	size_t       shared_pos;
+	struct segment {
+		bool      shared;
+		bool      index;    /* An index point instead of data */
+		bool      rotate;   /* That index point ends the segment */
+		size_t    len;
+		long long elapsed;  /* Of the index point */
+	} seg[MAX_SEGMENTS];
+	size_t       seg_head, seg_tail;
+};
+
+static void
+ts_init(struct typescript* ts, struct ring* shared) {
+	ring_init(&ts->own, BUFSIZE);
+	ts->shared = shared;
+	ts->shared_pos = shared->head;
+	ts->seg_head = ts->seg_tail = 0;
+}
+
+static size_t
+ts_pending(const struct typescript* ts) {
+	return ring_pending(&ts->own) + (ts->shared->head - ts->shared_pos);
+}
+
+/* Whether there's room for own_len bytes of data of its own in up to segments more segments */
+static bool
+ts_room(const struct typescript* ts, const size_t own_len, const unsigned segments) {
+	return ring_pending(&ts->own) + own_len < ts->own.size
+	    && ts->seg_head - ts->seg_tail + segments < MAX_SEGMENTS;
+}
+
+static void
+ts_segment(struct typescript* ts, const bool shared, const size_t len) {
+	if (!len)
+		return;
+
+	if (ts->seg_head != ts->seg_tail) {
+		struct segment* const last = &ts->seg[(ts->seg_head - 1) % MAX_SEGMENTS];
+		if (!last->index && last->shared == shared) {
+			last->len += len;
+			return;
 		}
+	}
 
-		// Fetch data from the pseudo terminal first
-		if (MAX(stdoutpending, scriptpending + delay_spec_size) < MIN(sizeof(stdoutbuf), sizeof(scriptbuf)) && FD_ISSET(pty, &rfds))
-		{
-			ssize_t ret = read(pty, stdoutbuf + stdoutpending, MIN(sizeof(stdoutbuf), sizeof(scriptbuf)) - MAX(stdoutpending, scriptpending + delay_spec_size));
-			if (ret == -1)
-			{
-				switch (errno)
-				{
-					case EIO:
-						ptyin_open = false;
+	struct segment* const seg = &ts->seg[ts->seg_head++ % MAX_SEGMENTS];
+	seg->shared = shared;
+	seg->index = false;
+	seg->len = len;
+}
+
+/*
+ * Marks the position up to which the typescript will have been written as an
+ * index point, or with rotate as the end of the segment. Returns false when
+ * there's no room for it, for the caller to try again later.
+ */
+static bool
+ts_mark(struct typescript* ts, const long long elapsed, const bool rotate) {
+	if (!ts_room(ts, 0, 1))
+		return false;
+
+	struct segment* const seg = &ts->seg[ts->seg_head++ % MAX_SEGMENTS];
+	seg->index = true;
+	seg->rotate = rotate;
+	seg->len = 0;
+	seg->elapsed = elapsed;
+	return true;
+}
+
+/* Takes the index point that's next in line, returns its elapsed time or -1 when data comes first. */
+static long long
+ts_index(struct typescript* ts, bool* rotate) {
+	if (ts->seg_tail == ts->seg_head || !ts->seg[ts->seg_tail % MAX_SEGMENTS].index)
+		return -1;
+	*rotate = ts->seg[ts->seg_tail % MAX_SEGMENTS].rotate;
+	return ts->seg[ts->seg_tail++ % MAX_SEGMENTS].elapsed;
+}
+
+/* Adds the given amount of data, that just got produced in the shared buffer. */
+static void
+ts_share(struct typescript* ts, const size_t len) {
+	ts_segment(ts, true, len);
+}
+
+/*
+ * Adds pty output of its own, instead of what's in the shared buffer, which
+ * it's then done with. Only for sessions not sharing any.
+ */
+static void
+ts_put(struct typescript* ts, const char* data, const size_t len) {
+	ring_put(&ts->own, data, len);
+	ts_segment(ts, false, len);
+	ts->shared_pos = ts->shared->head;
+}
+
+static int __attribute__((__format__(__printf__, 2, 3)))
+ts_printf(struct typescript* ts, const char* fmt, ...) {
+	char tmp[256];
+
+	va_list ap;
+	va_start(ap, fmt);
+	const int len = vsnprintf(tmp, sizeof(tmp), fmt, ap);
+	va_end(ap);
+
+	if (len < 0 || len >= sizeof(tmp) || ring_pending(&ts->own) + len > ts->own.size)
+		return -1;
+
+	ring_put(&ts->own, tmp, len);
+	ts_segment(ts, false, len);
+	return len;
+}
+
+static size_t
+base64_encode(char* dst, const unsigned char* src, const size_t len) {
+	static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	char* const start = dst;
+
+	for (size_t i = 0; i < len; i += 3) {
+		const uint32_t v = (uint32_t)src[i] << 16
+		                 | (i + 1 < len ? (uint32_t)src[i + 1] << 8 : 0)
+		                 | (i + 2 < len ? src[i + 2] : 0);
+		*dst++ = alphabet[v >> 18];
+		*dst++ = alphabet[v >> 12 & 0x3F];
+		*dst++ = i + 1 < len ? alphabet[v >> 6 & 0x3F] : '=';
+		*dst++ = i + 2 < len ? alphabet[v & 0x3F] : '=';
+	}
+	return dst - start;
+}
+
+/*
+ * Adds a keyframe: an APC command holding what redraws the screen, starting
+ * with its size. It's zlib compressed and base64 encoded, preceded by its
+ * uncompressed size in hexadecimal. Returns its length, or -1 when it
+ * doesn't fit with room for reserve more bytes left.
+ */
+static int
+ts_keyframe(struct typescript* ts, const struct vt* screen, const size_t reserve) {
+	// Don't bother rendering while backed up, screens seldom take more than this
+	if (ring_pending(&ts->own) + reserve + ts->own.size / 4 > ts->own.size)
+		return -1;
+
+	char* raw = NULL;
+	size_t raw_len = 0;
+	FILE* const f = open_memstream(&raw, &raw_len);
+	if (!f)
+		return -1;
+	fprintf(f, "\x1B[8;%u;%ut", screen->rows, screen->cols);
+	vt_redraw(screen, f);
+	if (fclose(f) == EOF) {
+		free(raw);
+		return -1;
+	}
+
+	uLongf packed_len = compressBound(raw_len);
+	unsigned char* const packed = malloc(packed_len);
+	char* const cmd = malloc(sizeof("\x1B_K;ffffffffffffffff;\x1B\\") + (packed_len + 2) / 3 * 4);
+	int len = -1;
+	if (packed && cmd && compress2(packed, &packed_len, (const Bytef*)raw, raw_len, Z_DEFAULT_COMPRESSION) == Z_OK) {
+		size_t cmd_len = sprintf(cmd, "\x1B_K;%zx;", raw_len);
+		cmd_len += base64_encode(cmd + cmd_len, packed, packed_len);
+		cmd[cmd_len++] = '\x1B';
+		cmd[cmd_len++] = '\\';
+		if (cmd_len <= INT_MAX && ring_pending(&ts->own) + cmd_len + reserve <= ts->own.size) {
+			ring_put(&ts->own, cmd, cmd_len);
+			ts_segment(ts, false, cmd_len);
+			len = cmd_len;
+		}
+	}
+
+	free(cmd);
+	free(packed);
+	free(raw);
+	return len;
+}
+
+/* Describes the pending data in the order it should be written, returns the iovec count. */
+static int
+ts_data(const struct typescript* ts, struct iovec iov[MAX_IOV], size_t* len) {
+	size_t own_pos = ts->own.tail,
+	       shared_pos = ts->shared_pos;
+	int cnt = 0;
+
+	for (size_t i = ts->seg_tail; i != ts->seg_head && cnt + 2 <= MAX_IOV; ++i) {
+		const struct segment* const seg = &ts->seg[i % MAX_SEGMENTS];
+		if (seg->index)
+			break;
+		if (seg->shared) {
+			cnt += ring_iov(ts->shared, shared_pos, seg->len, iov + cnt);
+			shared_pos += seg->len;
+		} else {
+			cnt += ring_iov(&ts->own, own_pos, seg->len, iov + cnt);
+			own_pos += seg->len;
+		}
+	}
+
+	*len = (own_pos - ts->own.tail) + (shared_pos - ts->shared_pos);
+	return cnt;
+}
+
+static void
+ts_consume(struct typescript* ts, size_t len) {
+	while (len) {
+		struct segment* const seg = &ts->seg[ts->seg_tail % MAX_SEGMENTS];
+		const size_t chunk = MIN(seg->len, len);
+		if (seg->shared)
+			ts->shared_pos += chunk;
+		else
+			ring_consume(&ts->own, chunk);
+
+		len -= chunk;
+		seg->len -= chunk;
+		if (!seg->len)
+			++ts->seg_tail;
+	}
+}
+
+/*
+ * Group commit, as an alternative to -f opening the typescript with O_DSYNC
+ * which makes every single write synchronous. Data gets written normally and
+ * fdatasync()ed once the oldest unsynced write is --sync-interval old or once
+ * --sync-size bytes went unsynced, bounding what a crash can lose. Only the
+ * side writing the typescript (doio() or the writer thread) touches this.
+ */
+static struct syncer {
+	size_t          unsynced;
+	struct timespec since;
+	unsigned long   count;
+	bool            unsupported;
+} typescript_sync;
+
+static bool
+group_commit(void) {
+	return sync_interval >= 0 || sync_size;
+}
+
+static void
+syncer_wrote(struct syncer* s, const size_t len) {
+	if (!group_commit() || s->unsupported || !len)
+		return;
+
+	if (!s->unsynced)
+		clock_gettime(CLOCK_MONOTONIC, &s->since);
+	s->unsynced += len;
+}
+
+/* Milliseconds until a sync is due, -1 when there's nothing to sync. */
+static int
+syncer_timeout(const struct syncer* s) {
+	if (!s->unsynced)
+		return -1;
+	if (sync_size && s->unsynced >= sync_size)
+		return 0;
+	if (sync_interval < 0)
+		return -1;
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	const long elapsed = (now.tv_sec - s->since.tv_sec) * 1000L + (now.tv_nsec - s->since.tv_nsec) / 1000000L;
+	return elapsed >= sync_interval ? 0 : sync_interval - elapsed;
+}
+
+static int
+syncer_sync(struct syncer* s, const int fd) {
+	s->unsynced = 0;
+	if (fdatasync(fd) == -1) {
+		// Nothing to sync for pipes and the like
+		if (errno == EINVAL || errno == EROFS) {
+			s->unsupported = true;
+			return 0;
+		}
+		return -1;
+	}
+
+	++s->count;
+	return 0;
+}
+
+/*
+ * With --index-interval or --index-size a sidecar file, named after the
+ * typescript with .idx appended, maps elapsed time, as the sum of the delay
+ * commands, to offsets in the typescript where scriptreplay --start can begin
+ * playing. Records have a fixed width so it can binary search them, the last
+ * one marks where the session ended. Index points are added by the side
+ * writing the typescript, once it's written up to there.
+ */
+#define INDEX_RECORD_FMT "%012lld.%06lld %020lld\n"
+#define INDEX_RECORD_SIZE 41
+
+static struct typescript_index {
+	int       fd;
+	long long elapsed;  /* Microseconds of delay commands so far */
+	long long last;     /* Elapsed time at the last index point */
+	size_t    since;    /* Bytes of typescript since that point */
+} typescript_index = {
+	.fd = -1,
+};
+
+static bool
+indexing(void) {
+	return index_interval >= 0 || index_size;
+}
+
+static void
+index_open(struct typescript_index* idx, const int scriptfd, const char* script) {
+	char path[PATH_MAX];
+	struct stat st;
+
+	// Only regular files can be seeked in
+	if (fstat(scriptfd, &st) == -1 || !S_ISREG(st.st_mode))
+		return;
+
+	snprintf(path, sizeof(path), "%s.idx", script);
+	idx->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC | (st.st_size ? O_APPEND : O_TRUNC), 0666);
+	if (idx->fd == -1) {
+		perror(path);
+		return;
+	}
+
+	if (!st.st_size)
+		return;
+
+	// Continue the elapsed time of the session we're appending to
+	char rec[INDEX_RECORD_SIZE + 1];
+	long long sec, usec;
+	const off_t size = lseek(idx->fd, 0, SEEK_END);
+	if (size < INDEX_RECORD_SIZE || size % INDEX_RECORD_SIZE
+	 || pread(idx->fd, rec, INDEX_RECORD_SIZE, size - INDEX_RECORD_SIZE) != INDEX_RECORD_SIZE
+	 || (rec[INDEX_RECORD_SIZE] = '\0', sscanf(rec, "%lld.%lld", &sec, &usec)) != 2) {
+		fprintf(stderr, _("%s doesn't match %s, not indexing\n"), path, script);
+		if (!size)
+			unlink(path);
+		close(idx->fd);
+		idx->fd = -1;
+		return;
+	}
+	idx->elapsed = idx->last = sec * 1000000 + usec;
+}
+
+/* Whether the output that's about to be added should start at an index point. */
+static bool
+index_due(const struct typescript_index* idx) {
+	return (index_interval >= 0 && idx->elapsed - idx->last >= index_interval * 1000000LL)
+	    || (index_size && idx->since >= index_size);
+}
+
+/* Records the typescript's current position as the given elapsed time. */
+static void
+index_add(struct typescript_index* idx, const long long elapsed, const int fd) {
+	char rec[INDEX_RECORD_SIZE + 1];
+
+	if (idx->fd == -1)
+		return;
+
+	const off_t offset = lseek(fd, 0, SEEK_CUR);
+	if (offset == -1
+	 || snprintf(rec, sizeof(rec), INDEX_RECORD_FMT, elapsed / 1000000, elapsed % 1000000, (long long)offset) != INDEX_RECORD_SIZE
+	 || write(idx->fd, rec, INDEX_RECORD_SIZE) != INDEX_RECORD_SIZE) {
+		// scriptreplay rebuilds a broken index, so don't give up on the typescript
+		perror(_("index"));
+		close(idx->fd);
+		idx->fd = -1;
+	}
+}
+
+/*
+ * The timing data of -t used to be fprintf()ed to the unbuffered stderr for
+ * every read from the pty. Instead records are collected here and written
+ * once the buffer fills up or the oldest record is TIMING_FLUSH_MS old, or
+ * right away with -f. Besides the text format of "<seconds> <bytes>" lines
+ * --binary-timing writes fixed-width records of two little-endian 64 bit
+ * numbers, the delay in nanoseconds and the amount of bytes, after a header
+ * record scriptreplay recognizes them by.
+ */
+#define TIMING_MAGIC "\0script timing\0\0"
+#define TIMING_RECORD_SIZE 16
+#define TIMING_FLUSH_MS 1000
+
+static struct timing {
+	size_t          len;
+	struct timespec since;  /* When the oldest record in buf got added */
+	char            buf[4096];
+} timing;
+
+/* Writes the collected records, returns false when stderr isn't ready and block isn't set. */
+static bool
+timing_flush(struct timing* t, const bool block) {
+	size_t done = 0;
+
+	while (done < t->len) {
+		const ssize_t ret = write(STDERR_FILENO, t->buf + done, t->len - done);
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN && block) {
+				struct pollfd pfd = { .fd = STDERR_FILENO, .events = POLLOUT };
+				poll(&pfd, 1, -1);
+				continue;
+			}
+			// Nobody's listening: drop it, like fprintf() would have
+			if (errno != EAGAIN)
+				done = t->len;
+			break;
+		}
+		done += ret;
+	}
+
+	memmove(t->buf, t->buf + done, t->len - done);
+	t->len -= done;
+	if (t->len)
+		clock_gettime(CLOCK_MONOTONIC, &t->since);
+	return !t->len;
+}
+
+static void
+timing_put(struct timing* t, const void* data, const size_t len) {
+	if (t->len + len > sizeof(t->buf))
+		timing_flush(t, true);
+	if (!t->len)
+		clock_gettime(CLOCK_MONOTONIC, &t->since);
+
+	memcpy(t->buf + t->len, data, len);
+	t->len += len;
+}
+
+static void
+timing_start(struct timing* t) {
+	if (binary_timing)
+		timing_put(t, TIMING_MAGIC, TIMING_RECORD_SIZE);
+}
+
+static void
+timing_le64(unsigned char* p, uint64_t v) {
+	for (int i = 0; i < 8; ++i, v >>= 8)
+		p[i] = v & 0xff;
+}
+
+static void
+timing_add(struct timing* t, const long long delay, const size_t len) {
+	if (binary_timing) {
+		unsigned char rec[TIMING_RECORD_SIZE];
+		timing_le64(rec, delay);
+		timing_le64(rec + 8, len);
+		timing_put(t, rec, sizeof(rec));
+	} else {
+		char rec[64];
+		const int n = snprintf(rec, sizeof(rec), "%03lld.%06lld %zu\n", delay / 1000000000, delay % 1000000000 / 1000, len);
+		timing_put(t, rec, n);
+	}
+
+	if (fflg)
+		timing_flush(t, false);
+}
+
+/* Milliseconds until the records are due to be written, -1 when there are none. */
+static int
+timing_timeout(const struct timing* t) {
+	if (!t->len)
+		return -1;
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	const long elapsed = (now.tv_sec - t->since.tv_sec) * 1000L + (now.tv_nsec - t->since.tv_nsec) / 1000000L;
+	return elapsed >= TIMING_FLUSH_MS ? 0 : TIMING_FLUSH_MS - elapsed;
+}
+
+/* Flags to open the typescript with, to flush data after each write when requested, unless we do group commits. */
+static int
+sync_flags(void) {
+	if (!fflg || group_commit())
+		return 0;
+#if O_DSYNC
+	return O_DSYNC;
+#elif O_SYNC
+	return O_SYNC;
+#elif O_FSYNC
+	return O_FSYNC;
+#else
+	return 0;
+#endif
+}
+
+/*
+ * With --rotate-size or --rotate-interval the typescript gets split into
+ * segments: the file itself, then file.0001, file.0002 and so on. Every
+ * segment after the first starts with a line giving its number and the
+ * elapsed time, as the sum of the delay commands before it, so that
+ * scriptreplay --segments can play them back to back. The side writing the
+ * typescript opens the next segment in advance, so switching to it only
+ * swaps file descriptors. Every segment gets an index of its own.
+ */
+#define SEGMENT_HEADER_FMT "Script continued on %s, segment %u at %lld.%06lld\r\n"
+
+static struct rotation {
+	/* Only touched by the side writing the typescript */
+	unsigned  segment;
+	int       next_fd;
+	/* Only touched by doio() */
+	size_t    since;    /* Bytes of typescript in the current segment */
+	long long started;  /* Elapsed nanoseconds at its start */
+} rotation = {
+	.next_fd = -1,
+};
+
+static bool
+rotating(void) {
+	return rotate_interval >= 0 || rotate_size;
+}
+
+static void
+segment_path(char* path, const size_t size, const unsigned segment) {
+	if (segment)
+		snprintf(path, size, "%s.%04u", fname, segment);
+	else
+		snprintf(path, size, "%s", fname);
+}
+
+/* Whether the output that's about to be added should start a new segment. */
+static bool
+rotation_due(const struct rotation* r, const long long elapsed) {
+	return (rotate_interval >= 0 && elapsed - r->started >= rotate_interval * 1000000000LL)
+	    || (rotate_size && r->since >= rotate_size);
+}
+
+static void
+rotation_preopen(struct rotation* r) {
+	char path[PATH_MAX];
+
+	segment_path(path, sizeof(path), r->segment + 1);
+	r->next_fd = open(path, O_WRONLY | O_CREAT | (nflg ? O_EXCL : O_TRUNC) | sync_flags(), 0666);
+	if (r->next_fd == -1)
+		perror(path);
+}
+
+/*
+ * Continues the typescript in the next segment, index_elapsed being the end
+ * of the current one. Returns false when that segment couldn't be opened, in
+ * which case we stick with the current one.
+ */
+static bool
+rotation_switch(struct rotation* r, int* fd, const long long index_elapsed) {
+	char path[PATH_MAX];
+
+	if (r->next_fd == -1)
+		rotation_preopen(r);
+	if (r->next_fd == -1)
+		return false;
+
+	if (typescript_sync.unsynced && syncer_sync(&typescript_sync, *fd) == -1)
+		perror("fdatasync");
+	index_add(&typescript_index, index_elapsed, *fd);
+	if (typescript_index.fd != -1) {
+		close(typescript_index.fd);
+		typescript_index.fd = -1;
+	}
+	close(*fd);
+
+	*fd = r->next_fd;
+	r->next_fd = -1;
+	++r->segment;
+	segment_path(path, sizeof(path), r->segment);
+	if (indexing())
+		index_open(&typescript_index, *fd, path);
+
+	rotation_preopen(r);
+	return true;
+}
+
+/* Removes the segment that got opened in advance, but wasn't needed anymore. */
+static void
+rotation_end(struct rotation* r) {
+	char path[PATH_MAX];
+
+	if (r->next_fd == -1)
+		return;
+	close(r->next_fd);
+	r->next_fd = -1;
+	segment_path(path, sizeof(path), r->segment + 1);
+	unlink(path);
+}
+
+static bool
+writev_all(const int fd, struct iovec* iov, int cnt) {
+	while (cnt) {
+		ssize_t ret = writev(fd, iov, cnt);
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+
+		while (cnt && (size_t)ret >= iov->iov_len) {
+			ret -= iov->iov_len;
+			++iov;
+			--cnt;
+		}
+		if (cnt) {
+			iov->iov_base = (char*)iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
+	}
+
+	return true;
+}
+
+/*
+ * With -z the writer thread deflates the typescript into a series of
+ * independent gzip members, each holding --compress-block bytes of output.
+ * A crash loses at most the member being written, while concatenated members
+ * are a valid gzip file themselves, so -a just adds more of them.
+ */
+static struct compressor {
+	z_stream      z;
+	bool          open;   /* In the middle of a member */
+	size_t        in;     /* Bytes of output in that member */
+	unsigned char out[BUFSIZE];
+} compressor;
+
+static bool
+compress_init(struct compressor* c) {
+	return deflateInit2(&c->z, compress_level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+}
+
+/* Runs deflate() until it consumed all input, or finished flushing, and writes what it produced. */
+static bool
+compress_deflate(struct compressor* c, const int fd, const int flush) {
+	int ret;
+	do {
+		c->z.next_out = c->out;
+		c->z.avail_out = sizeof(c->out);
+		ret = deflate(&c->z, flush);
+		if (ret == Z_STREAM_ERROR) {
+			errno = EINVAL;
+			return false;
+		}
+
+		struct iovec iov = { .iov_base = c->out, .iov_len = sizeof(c->out) - c->z.avail_out };
+		if (iov.iov_len && !writev_all(fd, &iov, 1))
+			return false;
+	} while (flush == Z_FINISH ? ret != Z_STREAM_END : !c->z.avail_out);
+
+	return true;
+}
+
+/* Completes the current member, making everything written so far decompressible. */
+static bool
+compress_finish(struct compressor* c, const int fd) {
+	if (!c->open)
+		return true;
+	if (!compress_deflate(c, fd, Z_FINISH))
+		return false;
+
+	deflateReset(&c->z);
+	c->open = false;
+	c->in = 0;
+	return true;
+}
+
+static bool
+compress_write(struct compressor* c, const int fd, const struct iovec* iov, const int cnt) {
+	for (int i = 0; i < cnt; ++i) {
+		const unsigned char* data = iov[i].iov_base;
+		size_t len = iov[i].iov_len;
+
+		while (len) {
+			const size_t part = MIN(len, compress_block - c->in);
+			c->z.next_in = (unsigned char*)data;
+			c->z.avail_in = part;
+			c->open = true;
+			if (!compress_deflate(c, fd, Z_NO_FLUSH))
+				return false;
+
+			data += part;
+			len -= part;
+			c->in += part;
+			if (c->in >= compress_block && !compress_finish(c, fd))
+				return false;
+		}
+	}
+
+	// Make the output readable without waiting for the member to be finished
+	if (fflg && c->open && !compress_deflate(c, fd, Z_SYNC_FLUSH))
+		return false;
+
+	return true;
+}
+
+/*
+ * With --writer-queue the typescript gets written by a thread of its own, so
+ * that a stalled disk (or -f) can't freeze the terminal. doio() hands it
+ * chunks through a lock-free single-producer/single-consumer queue. When the
+ * queue holds the configured amount of memory we either stop reading from the
+ * pty, just like without the thread, or append the data to a temporary spill
+ * file and only queue a small chunk telling the thread where to find it.
+ */
+struct chunk {
+	struct chunk* next;
+	size_t        len;
+	enum {
+		CHUNK_DATA,
+		CHUNK_SPILLED,  /* The data is in the spill file instead */
+		CHUNK_INDEX,    /* An index point, at elapsed */
+		CHUNK_ROTATE,   /* The end of the segment, at elapsed */
+	}             type;
+	long long     elapsed;
+	char          data[];
+};
+
+/* Smaller queues couldn't hold a chunk with a useful amount of data */
+static size_t
+writer_queue_min(void) {
+	return 2 * sizeof(struct chunk) + PIPE_BUF;
+}
+
+static struct writer {
+	pthread_t     thread;
+	int           fd;
+	struct chunk* head;          /* Consumer side, always the last chunk consumed */
+	struct chunk* tail;          /* Producer side */
+	int           wake_writer;   /* eventfd signalled when there's new data */
+	int           wake_main;     /* eventfd signalled when there's room again */
+	int           spillfd;
+	off_t         spill_written; /* Producer side */
+	off_t         spill_read;    /* Consumer side */
+	bool          waited;        /* Producer side, wake_main may have been signalled */
+
+	/* Shared between both threads, only accessed through __atomic builtins */
+	size_t        queued;
+	bool          writer_sleeping;
+	bool          main_waiting;
+	bool          done;
+	int           error;
+} writer = {
+	.fd = -1,
+	.wake_writer = -1,
+	.wake_main = -1,
+	.spillfd = -1,
+};
+
+static void
+wake(const int efd) {
+	const uint64_t one = 1;
+	while (write(efd, &one, sizeof(one)) == -1 && errno == EINTR)
+		;
+}
+
+/* Writes to the typescript, through the compressor when enabled. */
+static bool
+writer_output(struct writer* w, struct iovec* iov, const int cnt) {
+	if (zflg)
+		return compress_write(&compressor, w->fd, iov, cnt);
+	return writev_all(w->fd, iov, cnt);
+}
+
+/* Syncs the typescript, finishing the current gzip member first. */
+static int
+writer_sync(struct writer* w) {
+	if (zflg && !compress_finish(&compressor, w->fd))
+		return -1;
+	return syncer_sync(&typescript_sync, w->fd);
+}
+
+static size_t
+chunk_cost(const struct chunk* c) {
+	return sizeof(*c) + (c->type == CHUNK_DATA ? c->len : 0);
+}
+
+static bool
+writer_unspill(struct writer* w, size_t len) {
+	static char buf[BUFSIZE];
+
+	while (len) {
+		const ssize_t ret = pread(w->spillfd, buf, MIN(sizeof(buf), len), w->spill_read);
+		if (ret == -1 && errno == EINTR)
+			continue;
+		if (ret <= 0) {
+			if (ret == 0)
+				errno = EIO;
+			return false;
+		}
+
+		struct iovec iov = { .iov_base = buf, .iov_len = ret };
+		if (!writer_output(w, &iov, 1))
+			return false;
+
+#ifdef FALLOC_FL_PUNCH_HOLE
+		fallocate(w->spillfd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, w->spill_read, ret);
+#endif
+		w->spill_read += ret;
+		len -= ret;
+	}
+
+	return true;
+}
+
+static void*
+writer_main(void* arg) {
+	struct writer* const w = arg;
+	bool failed = false;
+
+	for (;;) {
+		struct chunk* const next = __atomic_load_n(&w->head->next, __ATOMIC_ACQUIRE);
+		if (!next) {
+			if (__atomic_load_n(&w->done, __ATOMIC_ACQUIRE)
+			 && !__atomic_load_n(&w->head->next, __ATOMIC_ACQUIRE))
+				break;
+
+			// Nothing to do but syncing, when due
+			const int timeout = failed ? -1 : syncer_timeout(&typescript_sync);
+			if (timeout == 0) {
+				if (writer_sync(w) == -1) {
+					failed = true;
+					__atomic_store_n(&w->error, errno, __ATOMIC_RELEASE);
+				}
+				continue;
+			}
+
+			// Announce we're going to sleep before checking one last time, so no wakeup can get lost
+			__atomic_store_n(&w->writer_sleeping, true, __ATOMIC_SEQ_CST);
+			if (!__atomic_load_n(&w->head->next, __ATOMIC_SEQ_CST)
+			 && !__atomic_load_n(&w->done, __ATOMIC_SEQ_CST)) {
+				struct pollfd pfd = { .fd = w->wake_writer, .events = POLLIN };
+				uint64_t cnt;
+				if (poll(&pfd, 1, timeout) > 0)
+					read(w->wake_writer, &cnt, sizeof(cnt));
+			}
+			__atomic_store_n(&w->writer_sleeping, false, __ATOMIC_SEQ_CST);
+			continue;
+		}
+
+		// Gather as many consecutive chunks as we can into a single write
+		struct iovec iov[MAX_IOV];
+		int cnt = 0;
+		size_t cost = 0, len = 0;
+		struct chunk* last = next;
+		if (next->type == CHUNK_INDEX || next->type == CHUNK_ROTATE) {
+			// Start a new gzip member here, so it can be decompressed from here on
+			cost = chunk_cost(next);
+			if (!failed && zflg && !compress_finish(&compressor, w->fd))
+				failed = true;
+			if (!failed && next->type == CHUNK_ROTATE)
+				rotation_switch(&rotation, &w->fd, next->elapsed);
+			else if (!failed)
+				index_add(&typescript_index, next->elapsed, w->fd);
+		} else if (next->type == CHUNK_SPILLED) {
+			cost = chunk_cost(next);
+			len = next->len;
+			if (!failed && !writer_unspill(w, len))
+				failed = true;
+		} else {
+			for (struct chunk* c = next; c && c->type == CHUNK_DATA && cnt < MAX_IOV; c = __atomic_load_n(&c->next, __ATOMIC_ACQUIRE)) {
+				iov[cnt].iov_base = c->data;
+				iov[cnt].iov_len = c->len;
+				++cnt;
+				cost += chunk_cost(c);
+				len += c->len;
+				last = c;
+			}
+
+			if (!failed && !writer_output(w, iov, cnt))
+				failed = true;
+		}
+
+		if (!failed) {
+			syncer_wrote(&typescript_sync, len);
+			if (syncer_timeout(&typescript_sync) == 0
+			 && writer_sync(w) == -1)
+				failed = true;
+		}
+
+		if (failed && !__atomic_load_n(&w->error, __ATOMIC_ACQUIRE))
+			__atomic_store_n(&w->error, errno, __ATOMIC_RELEASE);
+
+		while (w->head != last) {
+			struct chunk* const consumed = w->head;
+			w->head = consumed->next;
+			free(consumed);
+		}
+
+		__atomic_sub_fetch(&w->queued, cost, __ATOMIC_SEQ_CST);
+		if (__atomic_exchange_n(&w->main_waiting, false, __ATOMIC_SEQ_CST))
+			wake(w->wake_main);
+	}
+
+	if (!failed && zflg && !compress_finish(&compressor, w->fd))
+		failed = true;
+	if (!failed && typescript_sync.unsynced && syncer_sync(&typescript_sync, w->fd) == -1)
+		failed = true;
+	if (zflg)
+		deflateEnd(&compressor.z);
+	if (failed)
+		__atomic_store_n(&w->error, errno, __ATOMIC_RELEASE);
+
+	if (close(w->fd) == -1 && !failed)
+		__atomic_store_n(&w->error, errno, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+/* Returns the eventfd that gets signalled when the writer made room again. */
+static int
+writer_start(const int fd) {
+	struct writer* const w = &writer;
+
+	w->fd = fd;
+	w->head = w->tail = calloc(1, sizeof(*w->head));
+	w->wake_writer = eventfd(0, EFD_CLOEXEC);
+	w->wake_main = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (!w->head || w->wake_writer == -1 || w->wake_main == -1
+	 || (zflg && !compress_init(&compressor))) {
+		perror(_("writer queue"));
+		fail();
+	}
+
+	// The writer itself mustn't ever handle our signals
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	const int err = pthread_create(&w->thread, NULL, writer_main, w);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (err) {
+		errno = err;
+		perror("pthread_create");
+		fail();
+	}
+
+	return w->wake_main;
+}
+
+static void
+writer_enqueue(struct writer* w, struct chunk* c) {
+	c->next = NULL;
+	__atomic_add_fetch(&w->queued, chunk_cost(c), __ATOMIC_SEQ_CST);
+	__atomic_store_n(&w->tail->next, c, __ATOMIC_RELEASE);
+	w->tail = c;
+
+	if (__atomic_exchange_n(&w->writer_sleeping, false, __ATOMIC_SEQ_CST))
+		wake(w->wake_writer);
+}
+
+static ssize_t
+writer_spill(struct writer* w, const struct iovec* iov, const int cnt) {
+	if (w->spillfd == -1) {
+		const char* const tmpdir = getenv("TMPDIR");
+		char path[PATH_MAX];
+		snprintf(path, sizeof(path), "%s/script-spill-XXXXXX", tmpdir && *tmpdir ? tmpdir : "/tmp");
+		w->spillfd = mkostemp(path, O_CLOEXEC);
+		if (w->spillfd == -1)
+			return -1;
+		unlink(path);
+	}
+
+	struct chunk* const c = malloc(sizeof(*c));
+	if (!c)
+		return -1;
+
+	const ssize_t ret = pwritev(w->spillfd, iov, cnt, w->spill_written);
+	if (ret <= 0) {
+		free(c);
+		return ret;
+	}
+
+	w->spill_written += ret;
+	c->len = ret;
+	c->type = CHUNK_SPILLED;
+	writer_enqueue(w, c);
+	return ret;
+}
+
+/*
+ * Queues as much of the given data as is allowed, behaving like a
+ * non-blocking write(): on EAGAIN wait for the eventfd writer_start() returned.
+ */
+static ssize_t
+writer_push(const struct iovec* iov, const int cnt, const size_t len) {
+	struct writer* const w = &writer;
+
+	const int err = __atomic_load_n(&w->error, __ATOMIC_ACQUIRE);
+	if (err) {
+		errno = err;
+		return -1;
+	}
+
+	if (w->waited) {
+		uint64_t cnt;
+		read(w->wake_main, &cnt, sizeof(cnt));
+		w->waited = false;
+	}
+
+	// Announce we're waiting before checking for room, so no wakeup can get lost
+	__atomic_store_n(&w->main_waiting, true, __ATOMIC_SEQ_CST);
+	const size_t queued = __atomic_load_n(&w->queued, __ATOMIC_SEQ_CST);
+	if (queued && queued + sizeof(struct chunk) >= queue_size) {
+		w->waited = true;
+		errno = EAGAIN;
+		return -1;
+	}
+
+	// An empty queue always takes a chunk, so no queue size can stall the session
+	const size_t room = queued + sizeof(struct chunk) < queue_size ? queue_size - queued - sizeof(struct chunk) : len;
+	if (room >= len || queue_spill)
+		__atomic_store_n(&w->main_waiting, false, __ATOMIC_SEQ_CST);
+	else
+		// We'll be waiting for room for the remainder
+		w->waited = true;
+
+	if (room < len && queue_spill)
+		return writer_spill(w, iov, cnt);
+
+	const size_t size = MIN(len, room);
+	struct chunk* const c = malloc(sizeof(*c) + size);
+	if (!c)
+		return -1;
+
+	c->len = size;
+	c->type = CHUNK_DATA;
+	for (size_t done = 0; done < size; ++iov) {
+		const size_t part = MIN(iov->iov_len, size - done);
+		memcpy(c->data + done, iov->iov_base, part);
+		done += part;
+	}
+
+	writer_enqueue(w, c);
+	return size;
+}
+
+static void
+writer_index(const long long elapsed, const bool rotate) {
+	struct chunk* const c = malloc(sizeof(*c));
+	if (!c)
+		return;
+
+	c->len = 0;
+	c->type = rotate ? CHUNK_ROTATE : CHUNK_INDEX;
+	c->elapsed = elapsed;
+	writer_enqueue(&writer, c);
+}
+
+/* Tells the writer no more data is coming, it closes the typescript when done. */
+static void
+writer_close(void) {
+	__atomic_store_n(&writer.done, true, __ATOMIC_SEQ_CST);
+	if (__atomic_exchange_n(&writer.writer_sleeping, false, __ATOMIC_SEQ_CST))
+		wake(writer.wake_writer);
+}
+
+/* Waits for the writer to finish, returns the errno of a failed write, if any. */
+static int
+writer_join(void) {
+	pthread_join(writer.thread, NULL);
+	return __atomic_load_n(&writer.error, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * The file descriptors doio() multiplexes are registered once with an
+ * edge-triggered epoll instance. Because edges only get reported once we
+ * remember readiness ourselves and only forget about it when the kernel tells
+ * us (EAGAIN or a short read/write) that the descriptor got drained/filled.
+ */
+struct channel {
+	int      fd;
+	uint32_t events;    /* Interest that's always registered */
+	uint32_t out_event; /* Interest signalling writability, only armed when needed */
+	bool     pollable; /* epoll refuses regular files: these are always ready */
+	bool     readable;
+	bool     writable;
+	bool     out_armed;
+	void*    owner;     /* Whatever the channel belongs to, for the daemon */
+};
+
+static int epfd = -1;
+
+static void
+channel_add(struct channel* ch, const int fd, const uint32_t events) {
+	ch->fd = fd;
+	ch->events = events;
+	ch->out_event = EPOLLOUT;
+	ch->readable = true;
+	ch->writable = true;
+	ch->out_armed = false;
+
+	struct epoll_event ev = { .events = events | EPOLLET, .data.ptr = ch };
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == 0)
+		ch->pollable = true;
+	else if (errno == EPERM)
+		ch->pollable = false;
+	else {
+		perror("epoll_ctl(EPOLL_CTL_ADD)");
+		fail();
+	}
+}
+
+static void
+channel_del(struct channel* ch) {
+	if (ch->pollable)
+		epoll_ctl(epfd, EPOLL_CTL_DEL, ch->fd, NULL);
+	ch->pollable = false;
+}
+
+/* Only ask for write readiness while we've got data we failed to write. */
+static void
+channel_arm(struct channel* ch, const bool pending) {
+	const bool want_out = pending && !ch->writable;
+	if (!ch->pollable || want_out == ch->out_armed)
+		return;
+
+	struct epoll_event ev = { .events = ch->events | EPOLLET | (want_out ? ch->out_event : 0), .data.ptr = ch };
+	if (epoll_ctl(epfd, EPOLL_CTL_MOD, ch->fd, &ev) == -1) {
+		perror("epoll_ctl(EPOLL_CTL_MOD)");
+		fail();
+	}
+	ch->out_armed = want_out;
+}
+
+static void
+channel_drained(struct channel* ch) {
+	if (ch->pollable)
+		ch->readable = false;
+}
+
+static void
+channel_filled(struct channel* ch) {
+	if (ch->pollable)
+		ch->writable = false;
+}
+
+static int
+set_nonblock(const int fd) {
+	const int flags = fcntl(fd, F_GETFL);
+	if (flags != -1 && !(flags & O_NONBLOCK))
+		fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+	return flags;
+}
+
+static void
+restore_flags(const int fd, const int flags) {
+	if (flags != -1 && !(flags & O_NONBLOCK))
+		fcntl(fd, F_SETFL, flags);
+}
+
+/* The flags of stdin and stdout before doio() made them non-blocking, -1 once they're restored */
+static int stdio_flags[2] = { -1, -1 };
+
+static void
+restore_stdio(const int fd) {
+	restore_flags(fd, stdio_flags[fd]);
+	stdio_flags[fd] = -1;
+}
+
+/*
+ * Binds a unix socket at path only its owner can connect to. One left behind
+ * there gets replaced, but only once nothing is listening on it anymore.
+ */
+static int
+listen_socket(const char* path, const int type) {
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, _("%s: socket path too long\n"), path);
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+
+	const int fd = socket(AF_UNIX, type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd == -1) {
+		perror("socket");
+		return -1;
+	}
+
+	struct stat st;
+	if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+		const int probe = socket(AF_UNIX, type | SOCK_CLOEXEC, 0);
+		if (probe != -1 && connect(probe, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
+			fprintf(stderr, _("%s: already in use\n"), path);
+			close(probe);
+			close(fd);
+			return -1;
+		}
+		if (probe != -1 && errno == ECONNREFUSED)
+			unlink(path);
+		if (probe != -1)
+			close(probe);
+	}
+	const mode_t mask = umask(077);
+	const int ret = bind(fd, (struct sockaddr*)&addr, sizeof(addr));
+	umask(mask);
+	if (ret == -1 || listen(fd, SOMAXCONN) == -1) {
+		perror(path);
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/*
+ * --share: the pty output also goes into a ring that gets overwritten instead
+ * of waited for, which any number of viewers (scriptreplay --attach) read at
+ * their own pace. A viewer that falls a whole ring behind skips ahead to the
+ * live output, so none of them can hold up the recording or each other.
+ */
+#define SHARE_RING_SIZE (4 * BUFSIZE)
+#define MAX_VIEWERS 32
+
+struct viewer {
+	struct channel ch;
+	size_t         pos;
+	bool           open;
+};
+
+static struct share {
+	struct channel listen_ch;
+	struct ring    ring;
+	struct viewer  viewers[MAX_VIEWERS];
+	bool           open;
+} share;
+
+static void
+share_open(void) {
+	const int fd = listen_socket(share_socket, SOCK_STREAM);
+	if (fd == -1)
+		fail();
+	ring_init(&share.ring, SHARE_RING_SIZE);
+	channel_add(&share.listen_ch, fd, EPOLLIN);
+	share.open = true;
+}
+
+static void
+share_put(const void* data, size_t len) {
+	struct ring* const r = &share.ring;
+	if (len > r->size) {
+		data = (const char*)data + len - r->size;
+		len = r->size;
+	}
+	// Make room by forgetting the oldest output, whoever didn't get it yet
+	if (ring_pending(r) + len > r->size)
+		r->tail = r->head + len - r->size;
+	ring_put(r, data, len);
+}
+
+/* New viewers start with what's left in the ring, for some context. */
+static void
+share_accept(void) {
+	int fd;
+	while ((fd = accept4(share.listen_ch.fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+		struct viewer* v = share.viewers;
+		while (v < share.viewers + MAX_VIEWERS && v->open)
+			++v;
+		if (v == share.viewers + MAX_VIEWERS) {
+			close(fd);
+			continue;
+		}
+		channel_add(&v->ch, fd, 0);
+		v->pos = share.ring.tail;
+		v->open = true;
+	}
+	channel_drained(&share.listen_ch);
+}
+
+static bool
+share_busy(void) {
+	for (const struct viewer* v = share.viewers; v < share.viewers + MAX_VIEWERS; ++v)
+		if (v->open && v->ch.writable && v->pos != share.ring.head)
+			return true;
+	return share.listen_ch.readable;
+}
+
+static void
+share_arm(void) {
+	for (struct viewer* v = share.viewers; v < share.viewers + MAX_VIEWERS; ++v)
+		if (v->open)
+			channel_arm(&v->ch, v->pos != share.ring.head);
+}
+
+static void
+share_drop(struct viewer* v) {
+	channel_del(&v->ch);
+	close(v->ch.fd);
+	v->open = false;
+}
+
+static void
+share_write(void) {
+	struct ring* const r = &share.ring;
+	for (struct viewer* v = share.viewers; v < share.viewers + MAX_VIEWERS; ++v) {
+		if (!v->open || !v->ch.writable || v->pos == r->head)
+			continue;
+
+		// Overwritten before it got to see it, resync with the live output
+		if (ring_pending_from(r, v->pos) > ring_pending(r))
+			v->pos = r->head;
+
+		struct iovec iov[2];
+		const ssize_t ret = writev(v->ch.fd, iov, ring_data_from(r, v->pos, iov, SIZE_MAX));
+		if (ret == -1) {
+			if (errno == EAGAIN)
+				channel_filled(&v->ch);
+			else if (errno != EINTR)
+				share_drop(v);
+			continue;
+		}
+		if (ret < ring_pending_from(r, v->pos))
+			channel_filled(&v->ch);
+		v->pos += ret;
+	}
+}
+
+static void
+share_close(void) {
+	for (struct viewer* v = share.viewers; v < share.viewers + MAX_VIEWERS; ++v)
+		if (v->open)
+			share_drop(v);
+	channel_del(&share.listen_ch);
+	close(share.listen_ch.fd);
+	unlink(share_socket);
+	share.open = false;
+}
+
+/*
+ * Instrumentation of doio(), reported on SIGUSR1 and once it's done. The
+ * counters are a few increments per system call and always kept; the clock
+ * is only consulted for latencies and full buffers with --stats.
+ */
+#define STATS_BUCKETS 32
+
+enum {
+	STATS_STDIN,
+	STATS_PTY_WRITE,
+	STATS_PTY_READ,
+	STATS_STDOUT,
+	STATS_SCRIPT,
+	STATS_CHANNELS,
+};
+
+static const char* const stats_channel[STATS_CHANNELS] = {
+	"stdin", "pty_write", "pty_read", "stdout", "typescript",
+};
+
+/* Bucket n counts the samples below 2^n microseconds */
+struct histogram {
+	unsigned long count;
+	long long     sum;
+	long long     max;
+	unsigned long buckets[STATS_BUCKETS];
+};
+
+/* Either direction of the session: its buffer and the age of the oldest byte waiting in it */
+struct stats_path {
+	long long        full_since;  /* -1 when the buffer isn't full */
+	long long        full_ns;
+	unsigned long    full_count;
+	long long        oldest;      /* -1 when nothing's waiting */
+	struct histogram latency;
+};
+
+static struct stats {
+	unsigned long     calls[STATS_CHANNELS];
+	unsigned long     bytes[STATS_CHANNELS];
+	unsigned long     partial[STATS_CHANNELS]; /* Reads that drained or writes that filled the channel */
+	unsigned long     again[STATS_CHANNELS];
+	unsigned long     wakeups, events, timeouts, interrupts;
+	struct stats_path input, output;
+	long long         started;
+} stats = {
+	.input  = { .full_since = -1, .oldest = -1 },
+	.output = { .full_since = -1, .oldest = -1 },
+};
+
+static long long
+stats_now(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+static void
+stats_io(const int channel, const ssize_t ret, const size_t wanted) {
+	++stats.calls[channel];
+	if (ret > 0)
+		stats.bytes[channel] += ret;
+	if (ret >= 0 && ret < wanted)
+		++stats.partial[channel];
+	else if (ret == -1 && errno == EAGAIN)
+		++stats.again[channel];
+}
+
+/* Data arrived in a buffer that had had 'pending' bytes waiting. */
+static void
+stats_arrived(struct stats_path* p, const size_t pending) {
+	if (stats_enabled && !pending)
+		p->oldest = stats_now();
+}
+
+/* Data left a buffer, 'pending' bytes are still waiting. */
+static void
+stats_departed(struct stats_path* p, const size_t pending) {
+	if (!stats_enabled || p->oldest < 0)
+		return;
+
+	// The remainder isn't newer than what it arrived with, its age stays an upper bound
+	const long long now = stats_now();
+	const long long ns = now - p->oldest;
+	const unsigned long long us = ns / 1000;
+	unsigned bucket = us ? 64 - __builtin_clzll(us) : 0;
+	if (bucket >= STATS_BUCKETS)
+		bucket = STATS_BUCKETS - 1;
+	++p->latency.buckets[bucket];
+	++p->latency.count;
+	p->latency.sum += ns;
+	if (ns > p->latency.max)
+		p->latency.max = ns;
+	if (!pending)
+		p->oldest = -1;
+}
+
+static void
+stats_full(struct stats_path* p, const bool full) {
+	if (full == (p->full_since >= 0))
+		return;
+
+	const long long now = stats_now();
+	if (full) {
+		p->full_since = now;
+		++p->full_count;
+	} else {
+		p->full_ns += now - p->full_since;
+		p->full_since = -1;
+	}
+}
+
+/* The upper bound of the bucket holding the given fraction of the samples, in microseconds. */
+static unsigned long long
+histogram_percentile(const struct histogram* h, const double fraction) {
+	unsigned long seen = 0;
+	for (unsigned i = 0; i < STATS_BUCKETS; ++i) {
+		seen += h->buckets[i];
+		if (seen && seen >= fraction * h->count)
+			return 1ULL << i;
+	}
+	return 0;
+}
+
+static void
+stats_report_path(FILE* f, const char* name, const struct stats_path* p, const long long now) {
+	const struct histogram* const h = &p->latency;
+	const long long full_ns = p->full_ns + (p->full_since >= 0 ? now - p->full_since : 0);
+
+	fprintf(f, "%s_full: count=%lu seconds=%lld.%06lld\n", name, p->full_count,
+		full_ns / 1000000000, full_ns % 1000000000 / 1000);
+	fprintf(f, "%s_latency_us: count=%lu mean=%lld p50<%llu p99<%llu max=%lld buckets=",
+		name, h->count, h->count ? h->sum / (long long)h->count / 1000 : 0,
+		histogram_percentile(h, 0.5), histogram_percentile(h, 0.99), h->max / 1000);
+	unsigned last = 0;
+	for (unsigned i = 0; i < STATS_BUCKETS; ++i)
+		if (h->buckets[i])
+			last = i;
+	for (unsigned i = 0; i <= last; ++i)
+		fprintf(f, i ? ",%lu" : "%lu", h->buckets[i]);
+	fputc('\n', f);
+}
+
+static void
+stats_report(FILE* f) {
+	const long long now = stats_now();
+	const long long running = now - stats.started;
+
+	fprintf(f, "seconds: %lld.%06lld\n", running / 1000000000, running % 1000000000 / 1000);
+	fprintf(f, "wakeups: %lu events=%lu timeouts=%lu interrupts=%lu\n",
+		stats.wakeups, stats.events, stats.timeouts, stats.interrupts);
+	for (unsigned i = 0; i < STATS_CHANNELS; ++i)
+		fprintf(f, "%s: bytes=%lu calls=%lu partial=%lu again=%lu\n", stats_channel[i],
+			stats.bytes[i], stats.calls[i], stats.partial[i], stats.again[i]);
+	if (stats_enabled) {
+		stats_report_path(f, "stdin_to_pty", &stats.input, now);
+		stats_report_path(f, "pty_to_stdout", &stats.output, now);
+	}
+}
+
+/* Replaces the stats file with a fresh report, or writes it to stderr without one. */
+static void
+stats_dump(void) {
+	if (!stats_file) {
+		stats_report(stderr);
+		return;
+	}
+
+	char tmp[PATH_MAX];
+	snprintf(tmp, sizeof(tmp), "%s.tmp", stats_file);
+	FILE* const f = fopen(tmp, "w");
+	if (!f) {
+		perror(tmp);
+		return;
+	}
+	stats_report(f);
+	if (fclose(f) == EOF || rename(tmp, stats_file) == -1) {
+		perror(stats_file);
+		unlink(tmp);
+	}
+}
+
+static int
+doio(const struct termios* origtty, const int pty) {
+	bool stdin_open  = true,
+	     stdout_open = true,
+	     script_open = true,
+	     ptyin_open  = true,
+	     ptyout_open = true;
+	struct ring ptyoutbuf,
+	            ptyinbuf;
+	struct typescript ts;
+	size_t stdout_pos;
+	static const size_t delay_spec_size  = sizeof("\x1B_D;9223372036.854775807\x1B\\") - 1;
+	static const size_t resize_spec_size = sizeof("\x1B[8;65535;65535t") - 1;
+	static const size_t segment_spec_size = sizeof(SEGMENT_HEADER_FMT) + 64;
+
+	int scriptfd = open(fname, O_WRONLY | O_CREAT | (aflg ? O_APPEND : (nflg ? O_EXCL : O_TRUNC)) | sync_flags(), 0666);
+	if (scriptfd == -1) {
+		perror(fname);
+		fail();
+	}
+
+	if (indexing())
+		index_open(&typescript_index, scriptfd, fname);
+	const bool index_enabled = typescript_index.fd != -1;
+
+	struct stat script_st;
+	if (rotating() && (fstat(scriptfd, &script_st) == -1 || !S_ISREG(script_st.st_mode))) {
+		fprintf(stderr, _("%s isn't a regular file, not rotating\n"), fname);
+		rotate_interval = -1;
+		rotate_size = 0;
+	}
+	const bool rotate_enabled = rotating();
+	if (rotate_enabled)
+		rotation_preopen(&rotation);
+
+	ring_init(&ptyoutbuf, BUFSIZE);
+	ring_init(&ptyinbuf, BUFSIZE);
+	stdout_pos = ptyinbuf.head;
+	ts_init(&ts, &ptyinbuf);
+
+	// Delays are measured on a clock that doesn't jump, only the messages show the wall clock
+	struct timespec last_read;
+	clock_gettime(delay_clock, &last_read);
+	long long delay_pending = 0;  /* Nanoseconds not yet written as a delay-command */
+	long long elapsed = 0;        /* Nanoseconds written as delay-commands */
+	unsigned rotation_segment = 0;
+
+	// Keyframes are snapshots of what the session's output leaves on this screen
+	struct vt screen;
+	bool keyframes = false;
+	long long keyframe_next = keyframe_interval * 1000000000LL;  /* Elapsed time at which the next one is due */
+	if (keyframe_interval >= 0) {
+		struct winsize win;
+		if (ioctl(pty, TIOCGWINSZ, &win) == -1 || !win.ws_row || !win.ws_col) {
+			win.ws_row = 24;
+			win.ws_col = 80;
+		}
+		keyframes = vt_init(&screen, win.ws_row, win.ws_col, 0);
+		if (!keyframes)
+			perror(_("keyframes"));
+	}
+	{
+		char tbuf[256];
+		const time_t started = time(NULL);
+		const size_t header = ts.own.head;
+		if (strftime(tbuf, sizeof(tbuf), "%Y-%m-%d %H:%M:%S %Z\n", gmtime(&started)))
+			ts_printf(&ts, _("Script started on %s\r\n"), tbuf);
+		else
+			ts_printf(&ts, "%s", _("Script started\r\n"));
+
+		// Past its first line scriptreplay shows the message like output
+		struct iovec iov[2];
+		const int cnt = keyframes ? ring_iov(&ts.own, header, ts.own.head - header, iov) : 0;
+		bool skipped = false;
+		for (int i = 0; i < cnt; ++i) {
+			const char* data = iov[i].iov_base;
+			size_t len = iov[i].iov_len;
+			if (!skipped) {
+				const char* const nl = memchr(data, '\n', len);
+				if (!nl)
+					continue;
+				skipped = true;
+				len -= nl + 1 - data;
+				data = nl + 1;
+			}
+			vt_write(&screen, data, len);
+		}
+	}
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd == -1) {
+		perror("epoll_create1");
+		fail();
+	}
+
+	// Signals only get delivered while we're waiting for events, so they can't get lost between checking and waiting
+	sigset_t waitmask, blockmask;
+	sigemptyset(&blockmask);
+	sigaddset(&blockmask, SIGCHLD);
+	sigaddset(&blockmask, SIGWINCH);
+	sigaddset(&blockmask, SIGUSR1);
+	sigprocmask(SIG_BLOCK, &blockmask, &waitmask);
+	sigdelset(&waitmask, SIGCHLD);
+	sigdelset(&waitmask, SIGWINCH);
+	sigdelset(&waitmask, SIGUSR1);
+
+	stdio_flags[STDIN_FILENO]  = set_nonblock(STDIN_FILENO);
+	stdio_flags[STDOUT_FILENO] = set_nonblock(STDOUT_FILENO);
+	set_nonblock(pty);
+
+	struct channel stdin_ch, stdout_ch, pty_ch, script_ch;
+	channel_add(&stdin_ch,  STDIN_FILENO,  EPOLLIN);
+	channel_add(&stdout_ch, STDOUT_FILENO, 0);
+	channel_add(&pty_ch,    pty,           EPOLLIN);
+	if (queue_size)
+	{
+		// Our side of the typescript is the writer's queue, we wait for it to make room
+		channel_add(&script_ch, writer_start(scriptfd), 0);
+		script_ch.out_event = EPOLLIN;
+	}
+	else
+	{
+		set_nonblock(scriptfd);
+		channel_add(&script_ch, scriptfd, 0);
+	}
+
+	if (tflg)
+		timing_start(&timing);
+
+	if (share_socket)
+		share_open();
+
+	fixtty(origtty);
+	int exitcode = EX_OK;
+	bool pty_drained = false;
+	stats.started = stats_now();
+
+	while (stdin_open || (ptyout_open && ring_pending(&ptyoutbuf))
+	    || ptyin_open || (stdout_open && ring_pending_from(&ptyinbuf, stdout_pos)) || (script_open && ts_pending(&ts)))
+	{
+		channel_arm(&pty_ch,    ptyout_open && ring_pending(&ptyoutbuf));
+		channel_arm(&stdout_ch, stdout_open && ring_pending_from(&ptyinbuf, stdout_pos));
+		channel_arm(&script_ch, script_open && ts_pending(&ts));
+		if (share.open)
+			share_arm();
+
+		// Reading takes room in the typescript for a delay command, a segment header and what redaction held back
+		const size_t read_room = delay_spec_size + (rotate_enabled ? segment_spec_size : 0) + (redaction ? redact_held(redaction) : 0);
+
+		if (stats_enabled)
+		{
+			stats_full(&stats.input, stdin_open && ring_pending(&ptyoutbuf) == ptyoutbuf.size);
+			stats_full(&stats.output, ptyin_open && !(ring_pending(&ptyinbuf) < ptyinbuf.size && (!script_open || ts_room(&ts, read_room, READ_SEGMENTS))));
+		}
+
+		// Only block when none of the channels we know to be ready can make progress
+		const bool busy = (stdin_open && stdin_ch.readable && ring_pending(&ptyoutbuf) < ptyoutbuf.size)
+		               || (ptyin_open && pty_ch.readable && ring_pending(&ptyinbuf) < ptyinbuf.size && (!script_open || ts_room(&ts, read_room, READ_SEGMENTS)))
+		               || (ptyout_open && ring_pending(&ptyoutbuf) && pty_ch.writable)
+		               || (stdout_open && ring_pending_from(&ptyinbuf, stdout_pos) && stdout_ch.writable)
+		               || (script_open && ts_pending(&ts) && script_ch.writable)
+		               || (share.open && share_busy());
+
+		const int linger_timeout = busy ? 0 : (die && ptyin_open) ? CHILD_LINGER_MS : -1;
+		int timeout = linger_timeout;
+		if (!queue_size && script_open)
+		{
+			// Wake up when a group commit is due
+			const int sync_timeout = syncer_timeout(&typescript_sync);
+			if (sync_timeout >= 0 && (timeout < 0 || sync_timeout < timeout))
+				timeout = sync_timeout;
+		}
+		// Likewise when the timing data is due
+		const int timing_due = timing_timeout(&timing);
+		if (timing_due >= 0 && (timeout < 0 || timing_due < timeout))
+			timeout = timing_due;
+
+		struct epoll_event events[4];
+		const int nevents = epoll_pwait(epfd, events, sizeof(events) / sizeof(events[0]), timeout, &waitmask);
+		++stats.wakeups;
+		if (nevents > 0)
+			stats.events += nevents;
+		else if (nevents == 0)
+			++stats.timeouts;
+		else if (errno == EINTR)
+			++stats.interrupts;
+		if (nevents == -1)
+		{
+			if (errno != EINTR)
+			{
+				perror("epoll_wait");
+				exitcode = EX_OSERR;
+				goto restoretty;
+			}
+
+			// The signal may have pre-empted the report of the child's last output
+			pty_ch.readable = true;
+		}
+		else if (nevents == 0 && linger_timeout > 0 && timeout == linger_timeout && !pty_ch.readable)
+		{
+			// The child's gone and its output stopped trickling in
+			pty_drained = true;
+		}
+
+		for (int i = 0; i < nevents; ++i)
+		{
+			struct channel* const ch = events[i].data.ptr;
+			if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+				ch->readable = true;
+			if (events[i].events & (ch->out_event | EPOLLHUP | EPOLLERR))
+				ch->writable = true;
+		}
+
+		if (stats_requested)
+		{
+			__sync_fetch_and_sub(&stats_requested, 1);
+			stats_dump();
+		}
+
+		// Process resizes ASAP
+		if (ts_room(&ts, resize_spec_size, 1) && resized)
+		{
+			__sync_fetch_and_sub(&resized, 1);
+
+			struct winsize win;
+			if (ioctl(STDIN_FILENO, TIOCGWINSZ, &win) == -1)
+			{
+				switch (errno)
+				{
+					case EINTR:
+						break;
+					case EBADF:
+						if (!stdin_open)
+							break;
+						/* fall through */
+					default:
+						perror("ioctl(stdin, TIOCGWINSZ /* get window size */)");
+						exitcode = EX_IOERR;
+						goto restoretty;
+				}
+			}
+			else
+			{
+				// Notify PTY clients
+				ioctl(pty, TIOCSWINSZ, &win);
+
+				ts_printf(&ts, "\x1B[8;%hu;%hut", win.ws_row, win.ws_col);
+				if (keyframes)
+					vt_resize(&screen, win.ws_row, win.ws_col);
+				if (share.open) {
+					char spec[32];
+					share_put(spec, snprintf(spec, sizeof(spec), "\x1B[8;%hu;%hut", win.ws_row, win.ws_col));
+				}
+			}
+		}
+
+		// Send data down the pseudo terminal first
+		if (ptyout_open && ring_pending(&ptyoutbuf) && pty_ch.writable)
+		{
+			struct iovec iov[2];
+			ssize_t ret = writev(pty, iov, ring_data(&ptyoutbuf, iov, SIZE_MAX));
+			stats_io(STATS_PTY_WRITE, ret, ring_pending(&ptyoutbuf));
+			if (ret == -1)
+			{
+				switch (errno)
+				{
+					case EAGAIN:
+						channel_filled(&pty_ch);
+						/* fall through */
+					case EINTR:
+						break;
+					case ECONNRESET:
+					case EPIPE:
+						ptyout_open = false;
+						break;
+					default:
+						perror("write(pty)");
+						exitcode = EX_IOERR;
+						goto restoretty;
+				}
+			}
+			else
+			{
+				if (ret < ring_pending(&ptyoutbuf))
+					channel_filled(&pty_ch);
+				ring_consume(&ptyoutbuf, ret);
+				stats_departed(&stats.input, ring_pending(&ptyoutbuf));
+			}
+		}
+
+		// Send data down stdout next
+		if (stdout_open && ring_pending_from(&ptyinbuf, stdout_pos) && stdout_ch.writable)
+		{
+			struct iovec iov[2];
+			ssize_t ret = writev(STDOUT_FILENO, iov, ring_data_from(&ptyinbuf, stdout_pos, iov, SIZE_MAX));
+			stats_io(STATS_STDOUT, ret, ring_pending_from(&ptyinbuf, stdout_pos));
+			if (ret == -1)
+			{
+				switch (errno)
+				{
+					case EAGAIN:
+						channel_filled(&stdout_ch);
+						/* fall through */
+					case EINTR:
+						break;
+					case ECONNRESET:
+					case EPIPE:
+						channel_del(&stdout_ch);
+						restore_stdio(STDOUT_FILENO);
+						close(STDOUT_FILENO);
+						stdout_open = false;
+						break;
+					default:
+						perror("write");
+						exitcode = EX_IOERR;
+						goto restoretty;
+				}
+			}
+			else
+			{
+				if (ret < ring_pending_from(&ptyinbuf, stdout_pos))
+					channel_filled(&stdout_ch);
+				stdout_pos += ret;
+				ring_release(&ptyinbuf, stdout_pos, script_open ? ts.shared_pos : ptyinbuf.head);
+				stats_departed(&stats.output, ring_pending_from(&ptyinbuf, stdout_pos));
+			}
+		}
+
+		// Send data down typescript next
+		if (script_open && ts_pending(&ts) && script_ch.writable)
+		{
+			bool rotate;
+			for (long long elapsed; (elapsed = ts_index(&ts, &rotate)) >= 0;)
+			{
+				if (queue_size)
+					writer_index(elapsed, rotate);
+				else if (!rotate)
+					index_add(&typescript_index, elapsed, scriptfd);
+				else if (rotation_switch(&rotation, &scriptfd, elapsed))
+				{
+					set_nonblock(scriptfd);
+					script_ch.fd = scriptfd;
+				}
+			}
+
+			struct iovec iov[MAX_IOV];
+			size_t to_write;
+			const int cnt = ts_data(&ts, iov, &to_write);
+			ssize_t ret = queue_size ? writer_push(iov, cnt, to_write) : writev(scriptfd, iov, cnt);
+			stats_io(STATS_SCRIPT, ret, to_write);
+			if (ret == -1)
+			{
+				switch (errno)
+				{
+					case EAGAIN:
+						channel_filled(&script_ch);
+						/* fall through */
+					case EINTR:
+						break;
+					case ECONNRESET:
+					case EPIPE:
+						channel_del(&script_ch);
+						if (queue_size)
+							writer_close();
+						else
+							close(scriptfd);
+						script_open = false;
+						ring_release(&ptyinbuf, stdout_pos, ptyinbuf.head);
+						break;
+					default:
+						perror("write");
+						exitcode = EX_IOERR;
+						goto restoretty;
+				}
+			}
+			else
+			{
+				if (ret < to_write)
+					channel_filled(&script_ch);
+				ts_consume(&ts, ret);
+				if (!queue_size)
+					syncer_wrote(&typescript_sync, ret);
+				ring_release(&ptyinbuf, stdout_open ? stdout_pos : ptyinbuf.head, ts.shared_pos);
+			}
+		}
+
+		// The viewers get what they can take
+		if (share.open)
+		{
+			if (share.listen_ch.readable)
+				share_accept();
+			share_write();
+		}
+
+		if (timing.len && timing_timeout(&timing) == 0)
+			timing_flush(&timing, false);
+
+		// Commit what we wrote to the typescript when it's due
+		if (!queue_size && script_open && syncer_timeout(&typescript_sync) == 0
+		 && syncer_sync(&typescript_sync, scriptfd) == -1)
+		{
+			perror("fdatasync");
+			exitcode = EX_IOERR;
+			goto restoretty;
+		}
+
+		// Fetch data from the pseudo terminal first
+		if (ptyin_open && pty_ch.readable && ring_pending(&ptyinbuf) < ptyinbuf.size && (!script_open || ts_room(&ts, read_room, READ_SEGMENTS)))
+		{
+			// Redacted output gets copied into the typescript's own buffer
+			const size_t to_read = redaction && script_open
+				? MIN(ptyinbuf.size - ring_pending(&ptyinbuf), ts.own.size - ring_pending(&ts.own) - read_room)
+				: ptyinbuf.size - ring_pending(&ptyinbuf);
+			struct iovec iov[2];
+			ssize_t ret = readv(pty, iov, ring_space(&ptyinbuf, iov, to_read));
+			stats_io(STATS_PTY_READ, ret, to_read);
+			if (ret == -1)
+			{
+				switch (errno)
+				{
+					case EIO:
+						ptyin_open = false;
 						break;
+					case EAGAIN:
+						channel_drained(&pty_ch);
+						/* fall through */
 					case EINTR:
 						break;
 					default:
@@ -478,52 +2740,176 @@ doio(const struct termios* origtty, const int pty) {
 			}
 			else
 			{
-				const int usec_compensation = (newtime.tv_usec > oldtime.tv_usec) ? 0 : 1;
-				const struct timeval diff = {
-					.tv_sec  = newtime.tv_sec  - oldtime.tv_sec  - usec_compensation,
-					.tv_usec = newtime.tv_usec - oldtime.tv_usec + usec_compensation * 1000000L,
-				};
-				oldtime = newtime;
+				if (ret < to_read)
+					channel_drained(&pty_ch);
+
+				// Only look at the clock when there's output to timestamp
+				struct timespec now;
+				clock_gettime(delay_clock, &now);
+				const long long diff = (now.tv_sec - last_read.tv_sec) * 1000000000LL + (now.tv_nsec - last_read.tv_nsec);
+				last_read = now;
+
+				// What gets recorded has secrets replaced, with what may be the start of one held back
+				const bool redacting = redaction && script_open;
+				const char* recorded = NULL;
+				size_t recorded_len = ret;
+				if (redacting)
+				{
+					struct iovec iov[2];
+					recorded_len = redact_feed(redaction, iov, ring_iov(&ptyinbuf, ptyinbuf.head, ret, iov), &recorded);
+					if (recorded_len == (size_t)-1)
+					{
+						perror("redact");
+						exitcode = EX_OSERR;
+						goto restoretty;
+					}
+				}
+
+				if (rotate_enabled && script_open && rotation_due(&rotation, elapsed) && ts_mark(&ts, typescript_index.elapsed, true))
+				{
+					// The new segment starts with a line telling where it belongs
+					char tbuf[256];
+					const time_t started = time(NULL);
+					if (!strftime(tbuf, sizeof(tbuf), "%Y-%m-%d %H:%M:%S %Z", gmtime(&started)))
+						*tbuf = '\0';
+					ts_printf(&ts, SEGMENT_HEADER_FMT, tbuf, ++rotation_segment,
+						elapsed / 1000000000, elapsed % 1000000000 / 1000);
+					rotation.since = 0;
+					rotation.started = elapsed;
+					// Every segment starts with a keyframe of its own
+					keyframe_next = elapsed;
+					// Like the segment, its index starts from scratch
+					typescript_index.elapsed = typescript_index.last = 0;
+					typescript_index.since = 0;
+				}
+
+				// Merge delays below the resolution into the next delay-command, instead of writing one per read
+				delay_pending += diff;
+				const bool delay_due = delay_pending >= delay_resolution * 1000000LL;
+				// What doesn't fit the format's resolution is carried over to the next one
+				const long long delay_written = nsec_delays ? delay_pending : delay_pending / 1000 * 1000;
+
+				// Index points get a keyframe, for which output mustn't be halfway a sequence
+				const bool keyframe_due = keyframes && script_open && vt_settled(&screen)
+				                       && (elapsed >= keyframe_next || (index_enabled && index_due(&typescript_index)));
+
+				if (index_enabled && script_open)
+				{
+					if ((keyframes ? keyframe_due : index_due(&typescript_index)) && ts_mark(&ts, typescript_index.elapsed, false))
+					{
+						typescript_index.last = typescript_index.elapsed;
+						typescript_index.since = 0;
+					}
+					if (delay_due)
+						typescript_index.elapsed += (delay_written + 500) / 1000;
+					typescript_index.since += recorded_len;
+				}
+
+				// The screen as it is before this output, right where the index point starts
+				int keyframe_len = 0;
+				if (keyframe_due)
+				{
+					keyframe_len = ts_keyframe(&ts, &screen, redacting ? delay_spec_size + recorded_len : 0);
+					if (keyframe_len >= 0)
+						keyframe_next = elapsed + keyframe_interval * 1000000000LL;
+					else
+					{
+						// Try again in a while, instead of on every read for as long as the typescript is backed up
+						keyframe_len = 0;
+						keyframe_next = elapsed + 1000000000LL;
+					}
+				}
 
 				// Use Application Program-Control code to add delay-command scriptreplay can use
-				int len = snprintf(scriptbuf + scriptpending, sizeof(scriptbuf) - scriptpending,
-						"\x1B_D;%lld.%06ld\x1B\\", (long long)diff.tv_sec, (long)diff.tv_usec);
-				if (len >= 0 && len < sizeof(scriptbuf) - scriptpending)
-					scriptpending += len;
-				else
-					len = 0;
+				int len = 0;
+				if (script_open && delay_due)
+				{
+					if (compact_delays)
+						len = ts_printf(&ts, "\x1B_d;%llx\x1B\\", delay_written / 1000);
+					else if (nsec_delays)
+						len = ts_printf(&ts, "\x1B_D;%lld.%09lld\x1B\\", delay_written / 1000000000, delay_written % 1000000000);
+					else
+						len = ts_printf(&ts, "\x1B_D;%lld.%06lld\x1B\\", delay_written / 1000000000, delay_written % 1000000000 / 1000);
+					if (len < 0)
+						len = 0;
+				}
+				if (delay_due)
+				{
+					delay_pending -= delay_written;
+					elapsed += delay_written;
+				}
+				len += keyframe_len;
+				rotation.since += recorded_len + len;
+
+				if (tflg)
+					timing_add(&timing, diff, recorded_len + len);
+
+				if (keyframes && redacting)
+					vt_write(&screen, recorded, recorded_len);
+				else if (keyframes)
+				{
+					struct iovec iov[2];
+					const int cnt = ring_iov(&ptyinbuf, ptyinbuf.head, ret, iov);
+					for (int i = 0; i < cnt; ++i)
+						vt_write(&screen, iov[i].iov_base, iov[i].iov_len);
+				}
 
-				if (tflg) {
-					fprintf(stderr, "%03lld.%06ld %zu\n", (long long)diff.tv_sec, (long)diff.tv_usec, ret + len);
+				if (share.open)
+				{
+					struct iovec iov[2];
+					const int cnt = ring_iov(&ptyinbuf, ptyinbuf.head, ret, iov);
+					for (int i = 0; i < cnt; ++i)
+						share_put(iov[i].iov_base, iov[i].iov_len);
 				}
 
-				// Make sure the data is available in the scriptbuf as well
-				memcpy(scriptbuf + scriptpending, stdoutbuf + stdoutpending, ret);
-				stdoutpending += ret;
-				scriptpending += ret;
+				// Hand the same data to both stdout and the typescript
+				if (stdout_open)
+					stats_arrived(&stats.output, ring_pending_from(&ptyinbuf, stdout_pos));
+				ring_produce(&ptyinbuf, ret);
+				if (redacting)
+					ts_put(&ts, recorded, recorded_len);
+				else if (script_open)
+					ts_share(&ts, ret);
+				if (!script_open || redacting)
+					ring_release(&ptyinbuf, stdout_pos, ptyinbuf.head);
+			}
+
+			// What's held back can't become a secret anymore
+			if (!ptyin_open && redaction && script_open)
+			{
+				const char* recorded;
+				const size_t recorded_len = redact_flush(redaction, &recorded);
+				ts_put(&ts, recorded, recorded_len);
+				rotation.since += recorded_len;
+				if (tflg && recorded_len)
+					timing_add(&timing, 0, recorded_len);
 			}
 
 			if (!ptyin_open && !qflg)
 			{
 				char tbuf[256];
-				int len;
-				if (strftime(tbuf, sizeof(tbuf), "%Y-%m-%d %H:%M:%S %Z\n", gmtime(&newtime.tv_sec)))
-					len = snprintf(scriptbuf + scriptpending, sizeof(scriptbuf) - scriptpending, _("\r\nScript done on %s\r\n"), tbuf);
+				const time_t done = time(NULL);
+				if (strftime(tbuf, sizeof(tbuf), "%Y-%m-%d %H:%M:%S %Z\n", gmtime(&done)))
+					ts_printf(&ts, _("\r\nScript done on %s\r\n"), tbuf);
 				else
-					len = snprintf(scriptbuf + scriptpending, sizeof(scriptbuf) - scriptpending, "%s", _("\r\nScript done\r\n"));
-				if (len >= 0 && len < sizeof(scriptbuf) - scriptpending)
-					scriptpending += len;
+					ts_printf(&ts, "%s", _("\r\nScript done\r\n"));
 			}
 		}
 
 		// Fetch data from stdin next
-		if (ptyoutpending < sizeof(ptyoutbuf) && FD_ISSET(STDIN_FILENO, &rfds))
+		if (stdin_open && stdin_ch.readable && ring_pending(&ptyoutbuf) < ptyoutbuf.size)
 		{
-			ssize_t ret = read(STDIN_FILENO, ptyoutbuf + ptyoutpending, sizeof(ptyoutbuf) - ptyoutpending);
+			const size_t to_read = ptyoutbuf.size - ring_pending(&ptyoutbuf);
+			struct iovec iov[2];
+			ssize_t ret = readv(STDIN_FILENO, iov, ring_space(&ptyoutbuf, iov, to_read));
+			stats_io(STATS_STDIN, ret, to_read);
 			if (ret == -1)
 			{
 				switch (errno)
 				{
+					case EAGAIN:
+						channel_drained(&stdin_ch);
+						/* fall through */
 					case EINTR:
 						break;
 					default:
@@ -534,12 +2920,17 @@ doio(const struct termios* origtty, const int pty) {
 			}
 			else if (ret == 0)
 			{
+				channel_del(&stdin_ch);
+				restore_stdio(STDIN_FILENO);
 				close(STDIN_FILENO);
 				stdin_open = false;
 			}
 			else
 			{
-				ptyoutpending += ret;
+				if (ret < to_read)
+					channel_drained(&stdin_ch);
+				stats_arrived(&stats.input, ring_pending(&ptyoutbuf));
+				ring_produce(&ptyoutbuf, ret);
 			}
 		}
 
@@ -547,25 +2938,48 @@ doio(const struct termios* origtty, const int pty) {
 		for (;;)
 		{
 			// Close our output channels when the other input channels are closed (i.e. their won't be any new data to send
-			if (stdout_open && !stdoutpending && !ptyin_open)
+			if (stdout_open && !ring_pending_from(&ptyinbuf, stdout_pos) && !ptyin_open)
 			{
 				if (!stdin_open)
 					tcsetattr(STDOUT_FILENO, TCSADRAIN, origtty);
+				channel_del(&stdout_ch);
+				restore_stdio(STDOUT_FILENO);
 				close(STDOUT_FILENO);
 				stdout_open = false;
 				continue;
 			}
-			if (script_open && !scriptpending && !ptyin_open)
+			if (script_open && !ts_pending(&ts) && !ptyin_open)
 			{
-				close(scriptfd);
+				if (!queue_size && typescript_sync.unsynced && syncer_sync(&typescript_sync, scriptfd) == -1)
+				{
+					perror("fdatasync");
+					exitcode = EX_IOERR;
+					goto restoretty;
+				}
+				// The last index point marks the end of the session
+				if (index_enabled)
+				{
+					if (queue_size)
+						writer_index(typescript_index.elapsed, false);
+					else
+						index_add(&typescript_index, typescript_index.elapsed, scriptfd);
+				}
+				channel_del(&script_ch);
+				if (queue_size)
+					writer_close();
+				else
+					close(scriptfd);
 				script_open = false;
 				continue;
 			}
-			if (ptyout_open && !ptyoutpending && !stdin_open)
+			if (ptyout_open && !ring_pending(&ptyoutbuf) && !stdin_open)
 			{
 				ptyout_open = false;
 				if (!ptyin_open)
+				{
+					channel_del(&pty_ch);
 					close(pty);
+				}
 				continue;
 			}
 
@@ -574,15 +2988,20 @@ doio(const struct termios* origtty, const int pty) {
 			{
 				if (!stdout_open)
 					tcsetattr(STDIN_FILENO, TCSADRAIN, origtty);
+				channel_del(&stdin_ch);
+				restore_stdio(STDIN_FILENO);
 				close(STDIN_FILENO);
 				stdin_open = false;
 				continue;
 			}
-			if (ptyin_open && (!stdout_open || die))
+			if (ptyin_open && (!stdout_open || pty_drained))
 			{
 				ptyin_open = false;
 				if (!ptyout_open)
+				{
+					channel_del(&pty_ch);
 					close(pty);
+				}
 				continue;
 			}
 
@@ -600,12 +3019,871 @@ doio(const struct termios* origtty, const int pty) {
 	}
 
 restoretty:
+	timing_flush(&timing, true);
+	if (share.open)
+	{
+		share_write();
+		share_close();
+	}
+	if (queue_size)
+	{
+		writer_close();
+		const int err = writer_join();
+		if (err && err != EPIPE && err != ECONNRESET)
+		{
+			errno = err;
+			perror(fname);
+			exitcode = EX_IOERR;
+		}
+	}
+
+	restore_stdio(STDIN_FILENO);
+	restore_stdio(STDOUT_FILENO);
+
 	// Restore terminal settings
 	if      (stdin_open)
 		tcsetattr(STDIN_FILENO, TCSADRAIN, origtty);
 	else if (stdout_open)
 		tcsetattr(STDOUT_FILENO, TCSADRAIN, origtty);
 
+	if (typescript_index.fd != -1)
+		close(typescript_index.fd);
+	rotation_end(&rotation);
+	if (keyframes)
+		vt_free(&screen);
+
+	if (group_commit() && !qflg)
+		fprintf(stderr, _("%lu fdatasync() calls on %s\n"), typescript_sync.count, fname);
+
+	if (stats_enabled)
+		stats_dump();
+
+	return exitcode;
+}
+
+/*
+ * Daemon mode: a single process records any number of sessions from one
+ * epoll loop. Clients (script --connect) hand it their standard input and
+ * output, for each of them it runs a shell on a pty of its own. Instead of
+ * a pair of rings per session the data in flight lives in blocks from a
+ * pool shared by all sessions, so idle sessions don't hold any buffers.
+ */
+#define POOL_BLOCK (16UL << 10)
+/* How much may wait in either direction of a session, like BUFSIZE does for doio() */
+#define SESSION_BACKLOG (4 * POOL_BLOCK)
+#define SESSION_REQUEST_MAX (3 * PATH_MAX + 65536)
+
+struct block {
+	struct block* next;
+	size_t        start;
+	size_t        end;
+	char          data[POOL_BLOCK];
+};
+
+static struct pool {
+	struct block* free;
+	size_t        allocated;
+	size_t        limit;
+	bool          starved;   /* A session ran out of blocks, retry them once some are back */
+} pool;
+
+/* Takes a block, with force even when that goes over the limit. */
+static struct block*
+pool_get(const bool force) {
+	struct block* b = pool.free;
+	if (b)
+		pool.free = b->next;
+	else if ((force || pool.allocated + sizeof(*b) <= pool.limit) && (b = malloc(sizeof(*b))) != NULL)
+		pool.allocated += sizeof(*b);
+	else
+		return NULL;
+
+	b->next = NULL;
+	b->start = b->end = 0;
+	return b;
+}
+
+static void
+pool_put(struct block* b) {
+	b->next = pool.free;
+	pool.free = b;
+}
+
+struct queue {
+	struct block* head;
+	struct block* tail;
+	size_t        len;
+};
+
+/* Where to put len bytes in one piece: the tail when it has room, otherwise a fresh block not queued yet. */
+static struct block*
+queue_room(const struct queue* q, const size_t len) {
+	if (q->tail && POOL_BLOCK - q->tail->end >= len)
+		return q->tail;
+	return pool_get(false);
+}
+
+/* Where to put more data. */
+static struct block*
+queue_space(const struct queue* q) {
+	return queue_room(q, 1);
+}
+
+static void
+queue_produce(struct queue* q, struct block* b, const size_t len) {
+	if (b != q->tail) {
+		if (!len) {
+			pool_put(b);
+			return;
+		}
+		if (q->tail)
+			q->tail->next = b;
+		else
+			q->head = b;
+		q->tail = b;
+	}
+	b->end += len;
+	q->len += len;
+}
+
+static int
+queue_data(const struct queue* q, struct iovec iov[MAX_IOV]) {
+	int cnt = 0;
+	for (const struct block* b = q->head; b && cnt < MAX_IOV; b = b->next)
+		iov[cnt++] = (struct iovec){ .iov_base = (char*)b->data + b->start, .iov_len = b->end - b->start };
+	return cnt;
+}
+
+static void
+queue_consume(struct queue* q, size_t len) {
+	q->len -= len;
+	while (q->head && (len || q->head->start == q->head->end)) {
+		struct block* const b = q->head;
+		const size_t n = MIN(len, b->end - b->start);
+		b->start += n;
+		len -= n;
+		if (b->start < b->end)
+			break;
+		q->head = b->next;
+		if (!q->head)
+			q->tail = NULL;
+		pool_put(b);
+	}
+}
+
+static void
+queue_clear(struct queue* q) {
+	queue_consume(q, q->len);
+}
+
+struct session {
+	struct session* next;
+	pid_t           child;
+	int             status;       /* Exit code for the client, -1 until the child's been reaped */
+	int             in_flags;
+	int             out_flags;
+	bool            client_open;
+	bool            in_open;
+	bool            out_open;
+	bool            pty_open;
+	bool            script_open;
+	bool            pty_output;   /* Output came in since the last time we lingered */
+	bool            quiet;
+	bool            starved;
+	bool            done;
+	bool            started;      /* Its request came in, until then it's only the control channel */
+	struct channel  control, in, out, pty, script;
+	struct queue    to_pty, to_out, to_script;
+	struct timespec last_read;
+	long long       delay_pending;
+};
+
+static struct session* sessions;
+static struct session* requests;    /* Connections still to send their request */
+static unsigned sessions_lingering; /* Children gone, with the pty still open */
+
+static void
+session_reply(struct session* s, const char* fmt, ...) {
+	char msg[256];
+	va_list ap;
+
+	va_start(ap, fmt);
+	const int len = vsnprintf(msg, sizeof(msg), fmt, ap);
+	va_end(ap);
+	if (s->client_open && len > 0)
+		send(s->control.fd, msg, MIN((size_t)len, sizeof(msg) - 1), MSG_NOSIGNAL | MSG_DONTWAIT);
+}
+
+/* Gives up on a session after an error of its own, leaving the others be. */
+static void
+session_abort(struct session* s) {
+	if (s->pty_open) {
+		channel_del(&s->pty);
+		s->pty_open = false;
+		if (s->status != -1)
+			--sessions_lingering;
+	}
+	if (s->status == -1)
+		kill(-s->child, SIGHUP);
+	restore_flags(s->in.fd, s->in_flags);
+	restore_flags(s->out.fd, s->out_flags);
+	s->done = true;
+}
+
+/*
+ * Queues what the session adds to the typescript itself. That's little, so
+ * it doesn't wait for the pool: it may take it a block over its limit.
+ */
+static void
+session_script(struct session* s, const char* data, size_t len) {
+	while (s->script_open && len) {
+		struct block* b = queue_space(&s->to_script);
+		if (!b && !(b = pool_get(true))) {
+			session_reply(s, "E%s", strerror(ENOMEM));
+			session_abort(s);
+			return;
+		}
+		const size_t n = MIN(len, POOL_BLOCK - b->end);
+		memcpy(b->data + b->end, data, n);
+		queue_produce(&s->to_script, b, n);
+		data += n;
+		len -= n;
+	}
+}
+
+static void
+session_printf(struct session* s, const char* fmt, ...) {
+	char msg[512];
+	va_list ap;
+
+	va_start(ap, fmt);
+	const int len = vsnprintf(msg, sizeof(msg), fmt, ap);
+	va_end(ap);
+	if (len > 0)
+		session_script(s, msg, MIN((size_t)len, sizeof(msg) - 1));
+}
+
+/* Room a delay command takes in front of the output it precedes */
+#define SESSION_DELAY_MAX 64
+
+/*
+ * Timestamps output just read from the pty, like doio() does, and records it
+ * in rec, a block with room for it and its delay command.
+ */
+static void
+session_record(struct session* s, struct block* rec, const void* data, const size_t len) {
+	struct timespec now;
+	clock_gettime(delay_clock, &now);
+	s->delay_pending += (now.tv_sec - s->last_read.tv_sec) * 1000000000LL + (now.tv_nsec - s->last_read.tv_nsec);
+	s->last_read = now;
+
+	char* const delay = rec->data + rec->end;
+	int delay_len = 0;
+	if (s->delay_pending >= delay_resolution * 1000000LL) {
+		const long long delay_written = nsec_delays ? s->delay_pending : s->delay_pending / 1000 * 1000;
+		if (compact_delays)
+			delay_len = snprintf(delay, SESSION_DELAY_MAX, "\x1B_d;%llx\x1B\\", delay_written / 1000);
+		else if (nsec_delays)
+			delay_len = snprintf(delay, SESSION_DELAY_MAX, "\x1B_D;%lld.%09lld\x1B\\", delay_written / 1000000000, delay_written % 1000000000);
+		else
+			delay_len = snprintf(delay, SESSION_DELAY_MAX, "\x1B_D;%lld.%06lld\x1B\\", delay_written / 1000000000, delay_written % 1000000000 / 1000);
+		s->delay_pending -= delay_written;
+	}
+
+	memcpy(delay + delay_len, data, len);
+	queue_produce(&s->to_script, rec, delay_len + len);
+}
+
+static void
+session_resize(struct session* s) {
+	struct winsize win;
+	if (ioctl(s->in.fd, TIOCGWINSZ, &win) == -1)
+		return;
+	ioctl(s->pty.fd, TIOCSWINSZ, &win);
+	session_printf(s, "\x1B[8;%hu;%hut", win.ws_row, win.ws_col);
+}
+
+static void
+session_hangup(struct session* s) {
+	channel_del(&s->pty);
+	s->pty_open = false;
+	if (s->status != -1)
+		--sessions_lingering;
+
+	if (!s->quiet) {
+		char tbuf[256];
+		const time_t done = time(NULL);
+		if (strftime(tbuf, sizeof(tbuf), "%Y-%m-%d %H:%M:%S %Z\n", gmtime(&done)))
+			session_printf(s, _("\r\nScript done on %s\r\n"), tbuf);
+		else
+			session_printf(s, "%s", _("\r\nScript done\r\n"));
+	}
+}
+
+/* Moves data around until every direction either waits for its descriptors or for room. */
+static void
+session_service(struct session* s) {
+	for (bool progress = true; progress && !s->done;) {
+		progress = false;
+
+		if (s->to_pty.len && s->pty.writable) {
+			struct iovec iov[MAX_IOV];
+			const ssize_t ret = writev(s->pty.fd, iov, queue_data(&s->to_pty, iov));
+			if (ret > 0) {
+				if (ret < s->to_pty.len)
+					channel_filled(&s->pty);
+				queue_consume(&s->to_pty, ret);
+				progress = true;
+			} else if (ret == -1 && errno == EAGAIN)
+				channel_filled(&s->pty);
+			else if (ret == -1 && errno != EINTR)
+				queue_clear(&s->to_pty);
+		}
+
+		if (s->to_out.len && s->out.writable) {
+			struct iovec iov[MAX_IOV];
+			const ssize_t ret = writev(s->out.fd, iov, queue_data(&s->to_out, iov));
+			if (ret > 0) {
+				if (ret < s->to_out.len)
+					channel_filled(&s->out);
+				queue_consume(&s->to_out, ret);
+				progress = true;
+			} else if (ret == -1 && errno == EAGAIN)
+				channel_filled(&s->out);
+			else if (ret == -1 && errno != EINTR) {
+				// Keep recording what the client can't see anymore
+				channel_del(&s->out);
+				s->out_open = false;
+				queue_clear(&s->to_out);
+			}
+		}
+
+		if (s->to_script.len && s->script.writable) {
+			struct iovec iov[MAX_IOV];
+			const ssize_t ret = writev(s->script.fd, iov, queue_data(&s->to_script, iov));
+			if (ret > 0) {
+				if (ret < s->to_script.len)
+					channel_filled(&s->script);
+				queue_consume(&s->to_script, ret);
+				progress = true;
+			} else if (ret == -1 && errno == EAGAIN)
+				channel_filled(&s->script);
+			else if (ret == -1 && errno != EINTR) {
+				session_reply(s, "Ewrite: %s", strerror(errno));
+				session_abort(s);
+				break;
+			}
+		}
+
+		if (s->pty_open && s->pty.readable && (!s->out_open || s->to_out.len < SESSION_BACKLOG)
+		 && (!s->script_open || s->to_script.len < SESSION_BACKLOG)) {
+			struct block* const b = queue_space(&s->to_out);
+			// The typescript takes the output in one piece, after its delay command
+			struct block* const rec = b && s->script_open ? queue_room(&s->to_script, SESSION_DELAY_MAX + 1) : NULL;
+			if (!b || (s->script_open && !rec)) {
+				if (b)
+					queue_produce(&s->to_out, b, 0);
+				s->starved = pool.starved = true;
+				break;
+			}
+			const size_t room = MIN(POOL_BLOCK - b->end, rec ? POOL_BLOCK - rec->end - SESSION_DELAY_MAX : POOL_BLOCK);
+			const ssize_t ret = read(s->pty.fd, b->data + b->end, room);
+			if (ret > 0) {
+				if (ret < room)
+					channel_drained(&s->pty);
+				if (rec)
+					session_record(s, rec, b->data + b->end, ret);
+				queue_produce(&s->to_out, b, s->out_open ? ret : 0);
+				s->pty_output = true;
+				progress = true;
+			} else {
+				queue_produce(&s->to_out, b, 0);
+				if (rec)
+					queue_produce(&s->to_script, rec, 0);
+				if (ret == -1 && errno == EAGAIN)
+					channel_drained(&s->pty);
+				else if (ret == 0 || errno != EINTR)
+					session_hangup(s);
+			}
+		}
+
+		if (s->in_open && s->in.readable && s->to_pty.len < SESSION_BACKLOG) {
+			struct block* const b = queue_space(&s->to_pty);
+			if (!b) {
+				s->starved = pool.starved = true;
+				break;
+			}
+			const ssize_t ret = read(s->in.fd, b->data + b->end, POOL_BLOCK - b->end);
+			if (ret > 0) {
+				if (ret < POOL_BLOCK - b->end)
+					channel_drained(&s->in);
+				queue_produce(&s->to_pty, b, ret);
+				progress = true;
+			} else {
+				queue_produce(&s->to_pty, b, 0);
+				if (ret == -1 && errno == EAGAIN)
+					channel_drained(&s->in);
+				else if (ret == 0 || errno != EINTR) {
+					channel_del(&s->in);
+					s->in_open = false;
+				}
+			}
+		}
+	}
+
+	if (s->pty_open)
+		channel_arm(&s->pty, s->to_pty.len);
+	if (s->out_open)
+		channel_arm(&s->out, s->to_out.len);
+	if (s->script_open)
+		channel_arm(&s->script, s->to_script.len);
+
+	if (!s->done && !s->pty_open && s->status != -1 && (!s->out_open || !s->to_out.len) && !s->to_script.len) {
+		s->done = true;
+		// The client takes its terminal back as soon as it hears from us
+		restore_flags(s->in.fd, s->in_flags);
+		restore_flags(s->out.fd, s->out_flags);
+		session_reply(s, "X%d", s->status);
+	}
+}
+
+static void
+session_free(struct session* s) {
+	channel_del(&s->control);
+	channel_del(&s->in);
+	channel_del(&s->out);
+	channel_del(&s->pty);
+	channel_del(&s->script);
+	queue_clear(&s->to_pty);
+	queue_clear(&s->to_out);
+	queue_clear(&s->to_script);
+	close(s->in.fd);
+	close(s->out.fd);
+	close(s->pty.fd);
+	close(s->control.fd);
+	if (s->script_open && close(s->script.fd) == -1)
+		perror("close");
+	free(s);
+}
+
+/* Forgets a connection whose request didn't make it to a session. */
+static void
+request_drop(struct session* s) {
+	channel_del(&s->control);
+	close(s->control.fd);
+	free(s);
+}
+
+/*
+ * A client's request: flags, working directory, typescript and command, with
+ * its stdin and stdout attached. Until it came in there's nothing to do.
+ */
+static void
+session_start(struct session* s) {
+	static char request[SESSION_REQUEST_MAX];
+	const int control = s->control.fd;
+	union {
+		struct cmsghdr hdr;
+		char           buf[CMSG_SPACE(2 * sizeof(int))];
+	} cmsg;
+	struct iovec iov = { .iov_base = request, .iov_len = sizeof(request) - 1 };
+	struct msghdr msg = {
+		.msg_iov = &iov, .msg_iovlen = 1,
+		.msg_control = cmsg.buf, .msg_controllen = sizeof(cmsg.buf),
+	};
+
+	const ssize_t len = recvmsg(control, &msg, MSG_CMSG_CLOEXEC | MSG_DONTWAIT);
+	if (len == -1 && (errno == EAGAIN || errno == EINTR))
+		return;
+	for (struct session** p = &requests; *p; p = &(*p)->next)
+		if (*p == s) {
+			*p = s->next;
+			break;
+		}
+	struct cmsghdr* const c = len > 0 ? CMSG_FIRSTHDR(&msg) : NULL;
+	if (!c || c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS || c->cmsg_len != CMSG_LEN(2 * sizeof(int))) {
+		request_drop(s);
+		return;
+	}
+	int fds[2];
+	memcpy(fds, CMSG_DATA(c), sizeof(fds));
+	request[len] = '\0';
+
+	const char* field[4];
+	unsigned fields = 0;
+	for (const char* p = request; fields < 4 && p <= request + len; p += strlen(p) + 1)
+		field[fields++] = p;
+	const char* const flags = field[0];
+	const char* const cwd = field[1];
+	const char* const file = field[2];
+	const char* const command = field[3];
+
+	s->client_open = true;
+	if (fields != 4) {
+		session_reply(s, "Ebad request");
+		close(fds[0]);
+		close(fds[1]);
+		request_drop(s);
+		return;
+	}
+	s->status = -1;
+	s->quiet = strchr(flags, 'q');
+
+	// Nothing may block the loop all sessions share, only regular files can't
+	const int script = open(file, O_WRONLY | O_CREAT | O_CLOEXEC | O_NOCTTY | O_NONBLOCK | (strchr(flags, 'a') ? O_APPEND : (strchr(flags, 'n') ? O_EXCL : O_TRUNC)), 0666);
+	struct stat st;
+	const int pty = script != -1 && fstat(script, &st) == 0 && S_ISREG(st.st_mode) ? open_master() : -1;
+	if (pty == -1) {
+		if (script == -1 || !S_ISREG(st.st_mode))
+			session_reply(s, "E%s: %s", file, script == -1 ? strerror(errno) : _("not a regular file"));
+		else
+			session_reply(s, "E%s: %s", "/dev/ptmx", strerror(errno));
+		if (script != -1)
+			close(script);
+		close(fds[0]);
+		close(fds[1]);
+		request_drop(s);
+		return;
+	}
+	fcntl(pty, F_SETFD, FD_CLOEXEC);
+	const char* const pts = ptsname(pty);
+
+	struct termios tty;
+	if (tcgetattr(fds[0], &tty) == -1)
+		tcgetattr(pty, &tty);
+	struct winsize win = { 0 };
+	if (ioctl(fds[0], TIOCGWINSZ, &win) == 0)
+		ioctl(pty, TIOCSWINSZ, &win);
+
+	s->child = pts ? fork() : -1;
+	if (s->child == 0) {
+		sigset_t none;
+		sigemptyset(&none);
+		sigprocmask(SIG_SETMASK, &none, NULL);
+		signal(SIGPIPE, SIG_DFL);
+		// Our own session, so fail() can't take the daemon down
+		setsid();
+		if (chdir(cwd) == -1) {
+			perror(cwd);
+			_exit(EX_OSERR);
+		}
+		cflg = *command ? command : NULL;
+		doshell(pts, &tty);
+	}
+	if (s->child == -1) {
+		session_reply(s, "E%s", strerror(errno));
+		close(pty);
+		close(script);
+		close(fds[0]);
+		close(fds[1]);
+		request_drop(s);
+		return;
+	}
+
+	s->in_flags = set_nonblock(fds[0]);
+	s->out_flags = set_nonblock(fds[1]);
+	set_nonblock(pty);
+	s->in_open = s->out_open = s->pty_open = s->script_open = true;
+	s->in.owner = s->out.owner = s->pty.owner = s->script.owner = s;
+	channel_add(&s->in,      fds[0],  EPOLLIN);
+	channel_add(&s->out,     fds[1],  0);
+	channel_add(&s->pty,     pty,     EPOLLIN);
+	channel_add(&s->script,  script,  0);
+
+	clock_gettime(delay_clock, &s->last_read);
+	char tbuf[256];
+	const time_t started = time(NULL);
+	if (strftime(tbuf, sizeof(tbuf), "%Y-%m-%d %H:%M:%S %Z\n", gmtime(&started)))
+		session_printf(s, _("Script started on %s\r\n"), tbuf);
+	else
+		session_printf(s, "%s", _("Script started\r\n"));
+	// The size it starts out with, for replaying, like doio() records it
+	session_printf(s, "\x1B[8;%hu;%hut", win.ws_row, win.ws_col);
+
+	// The client may make its terminal raw now we copied its settings
+	session_reply(s, "S");
+	s->started = true;
+	s->next = sessions;
+	sessions = s;
+	session_service(s);
+}
+
+/* Window size changes (a 'w' each) and the client going away. */
+static void
+session_control(struct session* s) {
+	char buf[64];
+	for (;;) {
+		const ssize_t ret = recv(s->control.fd, buf, sizeof(buf), MSG_DONTWAIT);
+		if (ret > 0) {
+			if (memchr(buf, 'w', ret))
+				session_resize(s);
+			continue;
+		}
+		if (ret == -1 && errno == EINTR)
+			continue;
+		if (ret == -1 && errno == EAGAIN)
+			return;
+
+		// Like a terminal hanging up
+		channel_del(&s->control);
+		s->client_open = false;
+		kill(-s->child, SIGHUP);
+		return;
+	}
+}
+
+static int
+daemon_main(const char* path) {
+	pool.limit = pool_size;
+
+	// Whoever can connect can run commands as us, which is why only we can
+	const int listener = listen_socket(path, SOCK_SEQPACKET);
+	if (listener == -1)
+		return EX_CANTCREAT;
+
+	sigset_t chld;
+	sigemptyset(&chld);
+	sigaddset(&chld, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &chld, NULL);
+	const int sigfd = signalfd(-1, &chld, SFD_NONBLOCK | SFD_CLOEXEC);
+	signal(SIGPIPE, SIG_IGN);
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd == -1 || sigfd == -1) {
+		perror(epfd == -1 ? "epoll_create1" : "signalfd");
+		return EX_OSERR;
+	}
+
+	struct channel listen_ch = { .owner = NULL }, signal_ch = { .owner = NULL };
+	channel_add(&listen_ch, listener, EPOLLIN);
+	channel_add(&signal_ch, sigfd, EPOLLIN);
+
+	if (!qflg)
+		printf(_("Script daemon started, socket is %s\n"), path);
+	fflush(stdout);
+
+	long long lingered = 0;
+	for (;;) {
+		struct epoll_event events[64];
+		const int nevents = epoll_wait(epfd, events, sizeof(events) / sizeof(events[0]), sessions_lingering ? CHILD_LINGER_MS : -1);
+		if (nevents == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait");
+			return EX_OSERR;
+		}
+
+		for (int i = 0; i < nevents; ++i) {
+			struct channel* const ch = events[i].data.ptr;
+			if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+				ch->readable = true;
+			if (events[i].events & (ch->out_event | EPOLLHUP | EPOLLERR))
+				ch->writable = true;
+
+			if (ch == &listen_ch) {
+				int control;
+				while ((control = accept4(listener, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK)) != -1) {
+					// Its request gets read once it came in, a client that's slow to send it holds up no one
+					struct session* const s = calloc(1, sizeof(*s));
+					if (!s) {
+						close(control);
+						continue;
+					}
+					s->control.owner = s;
+					channel_add(&s->control, control, EPOLLIN);
+					s->next = requests;
+					requests = s;
+					session_start(s);
+				}
+			} else if (ch == &signal_ch) {
+				struct signalfd_siginfo si;
+				while (read(sigfd, &si, sizeof(si)) == sizeof(si))
+					;
+				int status;
+				pid_t pid;
+				while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+					for (struct session* s = sessions; s; s = s->next)
+						if (s->child == pid) {
+							s->status = WIFSIGNALED(status) ? WTERMSIG(status) + 0x80 : WEXITSTATUS(status);
+							if (s->pty_open) {
+								// Its last output may not have been reported yet, like in doio()
+								++sessions_lingering;
+								s->pty_output = true;
+								s->pty.readable = true;
+							}
+							session_service(s);
+						}
+			} else {
+				struct session* const s = ch->owner;
+				if (!s->started)
+					session_start(s);
+				else {
+					if (ch == &s->control)
+						session_control(s);
+					session_service(s);
+				}
+			}
+		}
+
+		// Hang up on the children that are gone once their output stopped trickling in, busy or not
+		if (sessions_lingering) {
+			struct timespec now;
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			const long long now_ms = now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+			if (!lingered)
+				lingered = now_ms;
+			if (nevents == 0 || now_ms - lingered >= CHILD_LINGER_MS) {
+				lingered = now_ms;
+				for (struct session* s = sessions; s; s = s->next)
+					if (s->status != -1 && s->pty_open) {
+						if (s->pty_output) {
+							s->pty_output = false;
+							s->pty.readable = true;
+						} else
+							session_hangup(s);
+						session_service(s);
+					}
+			}
+		} else
+			lingered = 0;
+
+		// Blocks came back, give the sessions that ran out another go
+		if (pool.starved && pool.free) {
+			pool.starved = false;
+			for (struct session* s = sessions; s; s = s->next)
+				if (s->starved) {
+					s->starved = false;
+					session_service(s);
+				}
+		}
+
+		// Only now nothing refers to them anymore
+		for (struct session** s = &sessions; *s;) {
+			if ((*s)->done) {
+				struct session* const gone = *s;
+				*s = gone->next;
+				session_free(gone);
+			} else
+				s = &(*s)->next;
+		}
+	}
+}
+
+static volatile bool client_resized;
+
+static void
+client_resize(int dummy __attribute__ ((__unused__))) {
+	client_resized = true;
+}
+
+/* Has the daemon at path record our session, returns the exit code for main(). */
+static int
+client_main(const char* path) {
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, _("%s: socket path too long\n"), path);
+		return EX_USAGE;
+	}
+	strcpy(addr.sun_path, path);
+
+	const int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (sock == -1 || connect(sock, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+		perror(path);
+		return EX_UNAVAILABLE;
+	}
+
+	// The daemon runs elsewhere, tell it exactly where we are
+	static char request[SESSION_REQUEST_MAX];
+	char cwd[PATH_MAX], file[2 * PATH_MAX];
+	if (!getcwd(cwd, sizeof(cwd))) {
+		perror("getcwd");
+		return EX_OSERR;
+	}
+	if (*fname == '/')
+		snprintf(file, sizeof(file), "%s", fname);
+	else
+		snprintf(file, sizeof(file), "%s/%s", cwd, fname);
+	const int len = snprintf(request, sizeof(request), "%s%s%s%c%s%c%s%c%s",
+		aflg ? "a" : "", nflg ? "n" : "", qflg ? "q" : "", '\0', cwd, '\0', file, '\0', cflg ? cflg : "");
+	if (len < 0 || len >= sizeof(request)) {
+		fprintf(stderr, _("%s: command too long\n"), progname);
+		return EX_USAGE;
+	}
+
+	const int fds[2] = { STDIN_FILENO, STDOUT_FILENO };
+	union {
+		struct cmsghdr hdr;
+		char           buf[CMSG_SPACE(sizeof(fds))];
+	} cmsg;
+	struct iovec iov = { .iov_base = request, .iov_len = len };
+	struct msghdr msg = {
+		.msg_iov = &iov, .msg_iovlen = 1,
+		.msg_control = cmsg.buf, .msg_controllen = sizeof(cmsg.buf),
+	};
+	struct cmsghdr* const c = CMSG_FIRSTHDR(&msg);
+	c->cmsg_level = SOL_SOCKET;
+	c->cmsg_type = SCM_RIGHTS;
+	c->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(c), fds, sizeof(fds));
+	if (sendmsg(sock, &msg, MSG_NOSIGNAL) == -1) {
+		perror(path);
+		return EX_UNAVAILABLE;
+	}
+
+	if (!qflg)
+		printf(_("Script started, file is %s\n"), fname);
+	fflush(stdout);
+
+	struct termios origtty;
+	const bool tty = tcgetattr(STDIN_FILENO, &origtty) == 0;
+
+	// Only notice resizes while waiting, so they can't get lost in between
+	sigset_t waitmask, blockmask;
+	sigemptyset(&blockmask);
+	sigaddset(&blockmask, SIGWINCH);
+	sigprocmask(SIG_BLOCK, &blockmask, &waitmask);
+	sigdelset(&waitmask, SIGWINCH);
+	struct sigaction sa = { .sa_handler = client_resize };
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGWINCH, &sa, NULL);
+
+	int exitcode = EX_UNAVAILABLE;
+	for (;;) {
+		struct pollfd pfd = { .fd = sock, .events = POLLIN };
+		if (ppoll(&pfd, 1, NULL, &waitmask) == -1) {
+			if (errno != EINTR)
+				break;
+			if (client_resized) {
+				client_resized = false;
+				send(sock, "w", 1, MSG_NOSIGNAL);
+			}
+			continue;
+		}
+
+		char reply[256];
+		const ssize_t ret = recv(sock, reply, sizeof(reply) - 1, 0);
+		if (ret == -1 && errno == EINTR)
+			continue;
+		if (ret <= 0) {
+			fprintf(stderr, _("%s: daemon went away\r\n"), progname);
+			break;
+		}
+		reply[ret] = '\0';
+		if (*reply == 'S') {
+			if (tty)
+				fixtty(&origtty);
+			continue;
+		}
+		if (*reply == 'X')
+			exitcode = eflg ? atoi(reply + 1) : EX_OK;
+		else
+			fprintf(stderr, "%s: %s\r\n", progname, reply + 1);
+		break;
+	}
+
+	if (tty)
+		tcsetattr(STDIN_FILENO, TCSADRAIN, &origtty);
+	close(sock);
 	return exitcode;
 }
 
@@ -621,12 +3899,40 @@ finish(int dummy __attribute__ ((__unused__))) {
 		}
 }
 
+static void
+request_stats(int dummy __attribute__ ((__unused__))) {
+	__sync_fetch_and_add(&stats_requested, 1);
+}
+
 static void
 resize(int dummy __attribute__ ((__unused__))) {
 	/* transmit window change information to the child */
 	__sync_fetch_and_add(&resized, 1);
 }
 
+/* The program to run on the pty: the shell, or with --exec the command itself. */
+static const char*
+shellargs(const char* argv[4]) {
+	if (exec_argv)
+		return exec_argv[0];
+
+	const char* shell = getenv("SHELL");
+	if (shell == NULL)
+		shell = _PATH_BSHELL;
+
+	const char* shname = strrchr(shell, '/');
+	if (shname)
+		shname++;
+	else
+		shname = shell;
+
+	argv[0] = shname;
+	argv[1] = cflg ? "-c" : "-i";
+	argv[2] = cflg;
+	argv[3] = NULL;
+	return shell;
+}
+
 static int
 doshell(const char* pts, const struct termios* origtty) {
 	const int slave = getslave(pts, origtty);
@@ -640,25 +3946,72 @@ doshell(const char* pts, const struct termios* origtty) {
 	 && slave != STDERR_FILENO)
 		close(slave);
 
-	const char* shell = getenv("SHELL");
-	if (shell == NULL)
-		shell = _PATH_BSHELL;
-
-	const char* shname = strrchr(shell, '/');
-	if (shname)
-		shname++;
-	else
-		shname = shell;
-
-	if (cflg)
-		execl(shell, shname, "-c", cflg, NULL);
+	const char* argv[4];
+	const char* const shell = shellargs(argv);
+	if (exec_argv)
+		execvp(shell, exec_argv);
 	else
-		execl(shell, shname, "-i", NULL);
+		execv(shell, (char* const*)argv);
 
 	perror(shell);
 	fail();
 }
 
+/*
+ * Starts the shell on the pty without copying our address space: posix_spawn()
+ * shares it with the child until the exec, as vfork() does. The child becomes
+ * a session leader, so opening the pty as its stdin makes that its controlling
+ * terminal without needing TIOCSCTTY. Returns the child's pid, or 0 in a
+ * forked child that has to run doshell() instead. That's the fallback when
+ * spawning isn't available or fails, which leaves reporting why to doshell().
+ */
+static pid_t
+spawnshell(const char* pts, const struct termios* origtty, const sigset_t* mask) {
+	pid_t pid;
+
+#if defined(POSIX_SPAWN_SETSID) && !SOLARIS
+	// Copy tty-settings from parent terminal to client terminal
+	const int slave = open(pts, O_RDWR | O_NOCTTY | O_CLOEXEC);
+	if (slave == -1) {
+		perror(pts);
+		fail();
+	}
+	tcsetattr(slave, TCSANOW, origtty);
+
+	posix_spawn_file_actions_t actions;
+	posix_spawnattr_t attr;
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, pts, O_RDWR, 0);
+	posix_spawn_file_actions_adddup2(&actions, STDIN_FILENO, STDOUT_FILENO);
+	posix_spawn_file_actions_adddup2(&actions, STDIN_FILENO, STDERR_FILENO);
+	posix_spawn_file_actions_addclose(&actions, master);
+	posix_spawnattr_init(&attr);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSID | POSIX_SPAWN_SETSIGMASK);
+	posix_spawnattr_setsigmask(&attr, mask);
+
+	const char* argv[4];
+	const char* const shell = shellargs(argv);
+	const int ret = exec_argv
+		? posix_spawnp(&pid, shell, &actions, &attr, exec_argv, environ)
+		: posix_spawn(&pid, shell, &actions, &attr, (char* const*)argv, environ);
+	posix_spawnattr_destroy(&attr);
+	posix_spawn_file_actions_destroy(&actions);
+	close(slave);
+	if (ret == 0)
+		return pid;
+#else
+	(void)origtty;
+	(void)mask;
+#endif
+
+	pid = fork();
+	if (pid == -1) {
+		perror("fork");
+		fail();
+	}
+	return pid;
+}
+
 static void
 fixtty(const struct termios* origtty) {
 	struct termios rtt = *origtty;
@@ -676,6 +4029,9 @@ fixtty(const struct termios* origtty) {
 
 static void
 fail() {
+	// Not leaving them non-blocking for whoever shares them, like the shell we got started from
+	restore_stdio(STDIN_FILENO);
+	restore_stdio(STDOUT_FILENO);
 	kill(0, SIGTERM);
 	/* Shut up the compiler which thinks we'll get here (and thus return
 	 * from a noreturn function). */
@@ -683,12 +4039,23 @@ fail() {
 		pause();
 }
 
+/* Opens the master side of a new pty, returns -1 with errno set on failure. */
+static int
+open_master(void) {
+	const int fd = open("/dev/ptmx", O_RDWR);
+	if (fd != -1 && (grantpt(fd) == -1 || unlockpt(fd) == -1)) {
+		const int err = errno;
+		close(fd);
+		errno = err;
+		return -1;
+	}
+	return fd;
+}
+
 static void
 getmaster() {
-	master = open("/dev/ptmx", O_RDWR);
-	if (master == -1
-	 || grantpt(master) == -1
-	 || unlockpt(master) == -1) {
+	master = open_master();
+	if (master == -1) {
 		fprintf(stderr, _("opening a pty using /dev/ptmx failed\n"));
 		fail();
 	}
@@ -0,0 +1,640 @@
+/*
+ * Throughput and latency benchmarks for script and scriptreplay.
+ *
+ * This file is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ *
+ * Runs script on a pseudo terminal of its own, recording a synthetic flood
+ * of output, and measures throughput and the CPU time spent per MB. It then
+ * measures how long keystrokes take to be echoed through script, how long
+ * script takes to start and stop around a command, and how fast scriptreplay
+ * parses typescripts dense with delay commands. Every result is printed as
+ * a line of JSON, for tracking regressions.
+ */
+
+#define _XOPEN_SOURCE 700
+#define _DEFAULT_SOURCE
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <termios.h>
+#include <unistd.h>
+
+#define _(Text) (Text)
+
+#define MIN(a,b) ((a) < (b) ? (a) : (b))
+
+#define MB (1024. * 1024.)
+
+static const char* program_invocation_short_name;
+
+static const char* script_path = "./script";
+static const char* scriptreplay_path = "./scriptreplay";
+static const char* script_options = "";
+static char tmpdir[256];
+
+static void __attribute__((__noreturn__))
+usage(int rc)
+{
+	printf(_("%s [--script=<path>] [--scriptreplay=<path>] [--script-options=<options>]\n"
+	         "    [--chunks=<size>,...] [--rate=<bytes per second>] [--bytes=<size>]\n"
+	         "    [--echoes=<count>] [--launches=<count>] [--markers=<bytes between delay commands>,...]\n"),
+			program_invocation_short_name);
+	exit(rc);
+}
+
+static void __attribute__((__noreturn__)) err(int eval, const char* fmt, ...)
+{
+	int err = errno;
+
+	if (fmt)
+	{
+		va_list ap;
+		va_start(ap, fmt);
+		vfprintf(stderr, fmt, ap);
+		va_end(ap);
+		fputs(": ", stderr);
+	}
+
+	fprintf(stderr, "%s\n", strerror(err));
+	exit(eval);
+}
+
+static void __attribute__((__noreturn__)) errx(int eval, const char* fmt, ...)
+{
+	if (fmt)
+	{
+		va_list ap;
+		va_start(ap, fmt);
+		vfprintf(stderr, fmt, ap);
+		va_end(ap);
+		fputs("\n", stderr);
+	}
+
+	exit(eval);
+}
+
+static size_t
+getsize(const char* s)
+{
+	char* end;
+
+	errno = 0;
+	unsigned long long size = strtoull(s, &end, 10);
+	switch (*end)
+	{
+		case 'G':
+			size <<= 10;
+			/* fall through */
+		case 'M':
+			size <<= 10;
+			/* fall through */
+		case 'k':
+		case 'K':
+			size <<= 10;
+			++end;
+	}
+
+	if (errno || end == s || (*end && *end != ','))
+		errx(EXIT_FAILURE, _("invalid size '%s'"), s);
+	return size;
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double
+cpu_time(const int who)
+{
+	struct rusage ru;
+	getrusage(who, &ru);
+	return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6
+	     + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+static bool
+write_all(const int fd, const void* data, size_t len)
+{
+	while (len)
+	{
+		const ssize_t ret = write(fd, data, len);
+		if (ret == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		data = (const char*)data + ret;
+		len -= ret;
+	}
+	return true;
+}
+
+/*
+ * The flood generator, run by script: writes total bytes of text in chunks
+ * of the given size, at most rate bytes per second when that's not 0. Its
+ * own CPU time goes to cpu_file, to be told apart from script's.
+ */
+static int
+flood(const size_t chunk, const size_t rate, const size_t total, const char* cpu_file)
+{
+	char* const buf = malloc(chunk);
+	if (!buf)
+		err(EXIT_FAILURE, NULL);
+	for (size_t i = 0; i < chunk; ++i)
+		buf[i] = (i % 64 == 63) ? '\n' : 'a' + i % 26;
+
+	struct timespec deadline;
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	for (size_t done = 0; done < total;)
+	{
+		const size_t len = MIN(chunk, total - done);
+		if (!write_all(STDOUT_FILENO, buf, len))
+			err(EXIT_FAILURE, _("write"));
+		done += len;
+
+		if (rate)
+		{
+			const long long ns = len * 1000000000LL / rate;
+			deadline.tv_sec += ns / 1000000000;
+			deadline.tv_nsec += ns % 1000000000;
+			if (deadline.tv_nsec >= 1000000000L)
+			{
+				deadline.tv_nsec -= 1000000000L;
+				++deadline.tv_sec;
+			}
+			while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR)
+				;
+		}
+	}
+
+	FILE* const f = fopen(cpu_file, "w");
+	if (f)
+	{
+		fprintf(f, "%.6f\n", cpu_time(RUSAGE_SELF));
+		fclose(f);
+	}
+	return EXIT_SUCCESS;
+}
+
+/* Starts the shell command line on a new pseudo terminal, returns its master side. */
+static int
+spawn_pty(const char* cmdline, pid_t* pid)
+{
+	const int master = posix_openpt(O_RDWR | O_NOCTTY);
+	if (master == -1 || grantpt(master) == -1 || unlockpt(master) == -1)
+		err(EXIT_FAILURE, _("opening a pty failed"));
+	const char* const pts = ptsname(master);
+	if (!pts)
+		err(EXIT_FAILURE, "ptsname");
+
+	*pid = fork();
+	if (*pid == -1)
+		err(EXIT_FAILURE, "fork");
+	if (*pid == 0)
+	{
+		setsid();
+		const int slave = open(pts, O_RDWR);
+		if (slave == -1)
+			err(EXIT_FAILURE, "%s", pts);
+		ioctl(slave, TIOCSCTTY, 0);
+		dup2(slave, STDIN_FILENO);
+		dup2(slave, STDOUT_FILENO);
+		dup2(slave, STDERR_FILENO);
+		if (slave > STDERR_FILENO)
+			close(slave);
+		close(master);
+		execl("/bin/sh", "sh", "-c", cmdline, NULL);
+		_exit(127);
+	}
+
+	return master;
+}
+
+/* Starts script with command on a new pseudo terminal, returns its master side. */
+static int
+spawn_script(const char* command, const char* typescript, pid_t* pid)
+{
+	char cmdline[5 * PATH_MAX];
+	snprintf(cmdline, sizeof(cmdline), "exec %s -q %s -c '%s' '%s'", script_path, script_options, command, typescript);
+	return spawn_pty(cmdline, pid);
+}
+
+/* Reads everything script writes, until it closes the terminal. Returns the amount of bytes. */
+static size_t
+drain(const int master)
+{
+	static char buf[65536];
+	size_t total = 0;
+
+	for (;;)
+	{
+		const ssize_t ret = read(master, buf, sizeof(buf));
+		if (ret == -1 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return total;
+		total += ret;
+	}
+}
+
+static void
+bench_record(const char* self, const size_t chunk, const size_t rate, const size_t total)
+{
+	char command[3 * PATH_MAX], typescript[PATH_MAX], cpu_file[PATH_MAX];
+	pid_t pid;
+	int status;
+
+	snprintf(typescript, sizeof(typescript), "%s/typescript", tmpdir);
+	snprintf(cpu_file, sizeof(cpu_file), "%s/flood-cpu", tmpdir);
+	snprintf(command, sizeof(command), "%s flood %zu %zu %zu %s", self, chunk, rate, total, cpu_file);
+
+	const double cpu_before = cpu_time(RUSAGE_CHILDREN);
+	const double start = now();
+	const int master = spawn_script(command, typescript, &pid);
+	const size_t received = drain(master);
+	waitpid(pid, &status, 0);
+	const double seconds = now() - start;
+	const double cpu = cpu_time(RUSAGE_CHILDREN) - cpu_before;
+	close(master);
+
+	double flood_cpu = 0;
+	FILE* const f = fopen(cpu_file, "r");
+	if (!f || fscanf(f, "%lf", &flood_cpu) != 1)
+		errx(EXIT_FAILURE, _("record benchmark failed, script exited with status %d"), WEXITSTATUS(status));
+	fclose(f);
+
+	struct stat st;
+	if (stat(typescript, &st) == -1)
+		err(EXIT_FAILURE, "%s", typescript);
+	unlink(typescript);
+	unlink(cpu_file);
+
+	printf("{\"benchmark\":\"record\",\"chunk\":%zu,\"rate\":%zu,\"bytes\":%zu,\"received\":%zu,"
+	       "\"typescript_bytes\":%lld,\"seconds\":%.6f,\"mb_per_s\":%.3f,\"cpu_s_per_mb\":%.6f}\n",
+	       chunk, rate, total, received, (long long)st.st_size, seconds,
+	       total / MB / seconds, (cpu - flood_cpu) / (total / MB));
+	fflush(stdout);
+}
+
+static int
+cmp_double(const void* a, const void* b)
+{
+	const double x = *(const double*)a, y = *(const double*)b;
+	return (x > y) - (x < y);
+}
+
+/* Waits for the given byte to come back from script, draining what comes before it. */
+static bool
+await_echo(const int master, const char c, const int timeout)
+{
+	char buf[256];
+
+	for (;;)
+	{
+		struct pollfd pfd = { .fd = master, .events = POLLIN };
+		if (poll(&pfd, 1, timeout) <= 0)
+			return false;
+		const ssize_t ret = read(master, buf, sizeof(buf));
+		if (ret <= 0)
+			return false;
+		if (memchr(buf, c, ret))
+			return true;
+	}
+}
+
+/*
+ * Measures the time from typing a key to its echo showing up, which covers
+ * a round trip through doio(): stdin to the pty and the pty back to stdout.
+ */
+static void
+bench_echo(const size_t count)
+{
+	char typescript[PATH_MAX];
+	pid_t pid;
+	int status;
+
+	snprintf(typescript, sizeof(typescript), "%s/typescript", tmpdir);
+	const int master = spawn_script("cat >/dev/null", typescript, &pid);
+
+	// Typing before script put its terminal in raw mode would be echoed by that instead
+	struct termios tio;
+	bool raw = false;
+	for (int i = 0; i < 1000 && !raw; ++i)
+	{
+		raw = tcgetattr(master, &tio) == 0 && !(tio.c_lflag & ICANON);
+		if (!raw)
+			usleep(1000);
+	}
+
+	// Wait for cat to be there
+	bool ready = false;
+	for (int i = 0; i < 100 && raw && !ready; ++i)
+		ready = write_all(master, "\n", 1) && await_echo(master, '\n', 100);
+	if (!ready)
+		errx(EXIT_FAILURE, _("echo benchmark failed, script isn't echoing"));
+
+	double* const samples = calloc(count, sizeof(*samples));
+	if (!samples)
+		err(EXIT_FAILURE, NULL);
+	double sum = 0;
+	for (size_t i = 0; i < count; ++i)
+	{
+		const double start = now();
+		if (!write_all(master, "x", 1) || !await_echo(master, 'x', 1000))
+			errx(EXIT_FAILURE, _("echo benchmark failed, no echo"));
+		samples[i] = now() - start;
+		sum += samples[i];
+
+		// Keep the line short
+		if (i % 64 == 63 && (!write_all(master, "\n", 1) || !await_echo(master, '\n', 1000)))
+			errx(EXIT_FAILURE, _("echo benchmark failed, no echo"));
+	}
+
+	write_all(master, "\n\x04", 2);
+	drain(master);
+	waitpid(pid, &status, 0);
+	close(master);
+	unlink(typescript);
+
+	qsort(samples, count, sizeof(*samples), cmp_double);
+	printf("{\"benchmark\":\"echo\",\"samples\":%zu,\"mean_us\":%.1f,\"p50_us\":%.1f,\"p99_us\":%.1f,\"max_us\":%.1f}\n",
+	       count, sum / count * 1e6, samples[count / 2] * 1e6,
+	       samples[MIN(count - 1, count * 99 / 100)] * 1e6, samples[count - 1] * 1e6);
+	fflush(stdout);
+	free(samples);
+}
+
+/*
+ * Measures how long it takes script to run a command that does nothing, in
+ * the ways a wrapper might: through the shell with -c or directly with
+ * --exec. The same command run without script is the baseline, so the
+ * overhead is what script itself adds to every invocation.
+ */
+static void
+bench_startup(const size_t count)
+{
+	static const char* const modes[] = { "baseline", "shell", "exec" };
+	char typescript[PATH_MAX], cmdline[4 * PATH_MAX];
+	double mean[3];
+	pid_t pid;
+	int status;
+
+	snprintf(typescript, sizeof(typescript), "%s/typescript", tmpdir);
+	double* const samples = calloc(count, sizeof(*samples));
+	if (!samples)
+		err(EXIT_FAILURE, NULL);
+
+	for (size_t mode = 0; mode < 3; ++mode)
+	{
+		if (mode == 0)
+			snprintf(cmdline, sizeof(cmdline), "exec true");
+		else if (mode == 1)
+			snprintf(cmdline, sizeof(cmdline), "exec %s -q %s -c true '%s'", script_path, script_options, typescript);
+		else
+			snprintf(cmdline, sizeof(cmdline), "exec %s -q %s --exec -- '%s' true", script_path, script_options, typescript);
+
+		double sum = 0;
+		for (size_t i = 0; i < count; ++i)
+		{
+			const double start = now();
+			const int master = spawn_pty(cmdline, &pid);
+			drain(master);
+			waitpid(pid, &status, 0);
+			samples[i] = now() - start;
+			sum += samples[i];
+			close(master);
+			if (!WIFEXITED(status) || WEXITSTATUS(status))
+				errx(EXIT_FAILURE, _("startup benchmark failed, %s exited with status %d"), modes[mode], WEXITSTATUS(status));
+		}
+		unlink(typescript);
+
+		mean[mode] = sum / count;
+		qsort(samples, count, sizeof(*samples), cmp_double);
+		printf("{\"benchmark\":\"startup\",\"mode\":\"%s\",\"launches\":%zu,\"mean_us\":%.1f,\"p50_us\":%.1f,\"p99_us\":%.1f,\"overhead_us\":%.1f}\n",
+		       modes[mode], count, mean[mode] * 1e6, samples[count / 2] * 1e6,
+		       samples[MIN(count - 1, count * 99 / 100)] * 1e6, (mean[mode] - mean[0]) * 1e6);
+		fflush(stdout);
+	}
+	free(samples);
+}
+
+/* Writes a typescript of total bytes, with a zero delay command every marker bytes of output. */
+static void
+generate_typescript(const char* path, const size_t marker, const size_t total)
+{
+	static const char delay[] = "\x1B_D;0.000000\x1B\\";
+	static char buf[65536];
+	size_t len = 0, written = 0, since = 0;
+
+	const int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd == -1)
+		err(EXIT_FAILURE, "%s", path);
+
+	len = snprintf(buf, sizeof(buf), "Script started on benchmark\r\n");
+	while (written + len < total)
+	{
+		if (len + sizeof(delay) >= sizeof(buf))
+		{
+			if (!write_all(fd, buf, len))
+				err(EXIT_FAILURE, "%s", path);
+			written += len;
+			len = 0;
+		}
+
+		if (since == marker)
+		{
+			memcpy(buf + len, delay, sizeof(delay) - 1);
+			len += sizeof(delay) - 1;
+			since = 0;
+		}
+		else
+		{
+			const size_t pos = written + len;
+			buf[len++] = pos % 64 == 63 ? '\n' : 'a' + pos % 26;
+			++since;
+		}
+	}
+
+	if (!write_all(fd, buf, len))
+		err(EXIT_FAILURE, "%s", path);
+	close(fd);
+}
+
+/* Times scriptreplay on the given typescript, reading it as a file or through a pipe. */
+static void
+bench_replay(const size_t marker, const size_t total, const bool pipe_input)
+{
+	char typescript[PATH_MAX];
+	int status;
+
+	snprintf(typescript, sizeof(typescript), "%s/replay", tmpdir);
+	generate_typescript(typescript, marker, total);
+
+	const double cpu_before = cpu_time(RUSAGE_CHILDREN);
+	const double start = now();
+	const pid_t pid = fork();
+	if (pid == -1)
+		err(EXIT_FAILURE, "fork");
+	if (pid == 0)
+	{
+		const int null = open("/dev/null", O_WRONLY);
+		dup2(null, STDOUT_FILENO);
+		if (pipe_input)
+		{
+			// Let cat feed it, so scriptreplay can't map it
+			char cmdline[3 * PATH_MAX];
+			snprintf(cmdline, sizeof(cmdline), "cat '%s' | exec %s", typescript, scriptreplay_path);
+			execl("/bin/sh", "sh", "-c", cmdline, NULL);
+		}
+		else
+		{
+			execl(scriptreplay_path, scriptreplay_path, typescript, "1e9", NULL);
+		}
+		_exit(127);
+	}
+	waitpid(pid, &status, 0);
+	const double seconds = now() - start;
+	const double cpu = cpu_time(RUSAGE_CHILDREN) - cpu_before;
+	unlink(typescript);
+
+	if (!WIFEXITED(status) || WEXITSTATUS(status))
+		errx(EXIT_FAILURE, _("replay benchmark failed, scriptreplay exited with status %d"), WEXITSTATUS(status));
+
+	printf("{\"benchmark\":\"replay\",\"input\":\"%s\",\"marker_every\":%zu,\"bytes\":%zu,"
+	       "\"seconds\":%.6f,\"mb_per_s\":%.3f,\"cpu_s_per_mb\":%.6f}\n",
+	       pipe_input ? "pipe" : "file", marker, total, seconds,
+	       total / MB / seconds, cpu / (total / MB));
+	fflush(stdout);
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char* chunks = "64,4096,65536";
+	const char* markers = "16,256";
+	size_t rate = 0;
+	size_t total = 64UL << 20;
+	size_t echoes = 200;
+	size_t launches = 200;
+	int c;
+	enum {
+		OPT_SCRIPT = CHAR_MAX + 1,
+		OPT_SCRIPTREPLAY,
+		OPT_SCRIPT_OPTIONS,
+		OPT_CHUNKS,
+		OPT_RATE,
+		OPT_BYTES,
+		OPT_ECHOES,
+		OPT_LAUNCHES,
+		OPT_MARKERS,
+	};
+	static const struct option longopts[] = {
+		{ "script",         required_argument, NULL, OPT_SCRIPT },
+		{ "scriptreplay",   required_argument, NULL, OPT_SCRIPTREPLAY },
+		{ "script-options", required_argument, NULL, OPT_SCRIPT_OPTIONS },
+		{ "chunks",         required_argument, NULL, OPT_CHUNKS },
+		{ "rate",           required_argument, NULL, OPT_RATE },
+		{ "bytes",          required_argument, NULL, OPT_BYTES },
+		{ "echoes",         required_argument, NULL, OPT_ECHOES },
+		{ "launches",       required_argument, NULL, OPT_LAUNCHES },
+		{ "markers",        required_argument, NULL, OPT_MARKERS },
+		{ NULL,             0,                 NULL, 0 }
+	};
+
+	program_invocation_short_name = argv[0];
+
+	if (argc == 6 && !strcmp(argv[1], "flood"))
+		return flood(getsize(argv[2]), getsize(argv[3]), getsize(argv[4]), argv[5]);
+
+	while ((c = getopt_long(argc, argv, "", longopts, NULL)) != -1)
+		switch (c)
+		{
+			case OPT_SCRIPT:
+				script_path = optarg;
+				break;
+			case OPT_SCRIPTREPLAY:
+				scriptreplay_path = optarg;
+				break;
+			case OPT_SCRIPT_OPTIONS:
+				script_options = optarg;
+				break;
+			case OPT_CHUNKS:
+				chunks = optarg;
+				break;
+			case OPT_RATE:
+				rate = getsize(optarg);
+				break;
+			case OPT_BYTES:
+				total = getsize(optarg);
+				break;
+			case OPT_ECHOES:
+				echoes = getsize(optarg);
+				break;
+			case OPT_LAUNCHES:
+				launches = getsize(optarg);
+				break;
+			case OPT_MARKERS:
+				markers = optarg;
+				break;
+			default:
+				usage(EXIT_FAILURE);
+		}
+	if (optind != argc || !total || !echoes || !launches)
+		usage(EXIT_FAILURE);
+
+	char self[PATH_MAX];
+	const ssize_t len = readlink("/proc/self/exe", self, sizeof(self) - 1);
+	if (len == -1)
+		err(EXIT_FAILURE, _("cannot find myself"));
+	self[len] = '\0';
+
+	const char* const base = getenv("TMPDIR");
+	snprintf(tmpdir, sizeof(tmpdir), "%s/scriptbench-XXXXXX", base && *base ? base : "/tmp");
+	if (!mkdtemp(tmpdir))
+		err(EXIT_FAILURE, _("cannot create %s"), tmpdir);
+
+	// Neither the terminal going away nor script killing its process group should stop us
+	signal(SIGHUP, SIG_IGN);
+	signal(SIGTERM, SIG_IGN);
+
+	for (const char* p = chunks; p; p = strchr(p, ','), p = p ? p + 1 : NULL)
+		bench_record(self, getsize(p), rate, total);
+	bench_echo(echoes);
+	bench_startup(launches);
+	for (const char* p = markers; p; p = strchr(p, ','), p = p ? p + 1 : NULL)
+	{
+		bench_replay(getsize(p), total, false);
+		bench_replay(getsize(p), total, true);
+	}
+
+	rmdir(tmpdir);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,1432 @@
+/*
+ * Converts typescripts with the delay commands script adds into other formats,
+ * many typescripts, and large ones in parts, at the same time.
+ *
+ * This file is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <locale.h>
+#include <zlib.h>
+
+#include "apc.h"
+
+#define _(Text) (Text)
+
+/* Amount of typescript a worker takes on at a time, large ones get split up in parts of at least this size */
+#define CHUNK_SIZE (4UL << 20)
+
+/* Screen size of asciicasts, when neither --size nor the typescript says */
+#define CAST_ROWS 24
+#define CAST_COLS 80
+
+#define MIN(a,b) ((a) < (b) ? (a) : (b))
+
+static const char* output_dir;	/* For --output-dir, next to the typescripts otherwise */
+static unsigned cast_rows, cast_cols;	/* For --size */
+
+struct file;
+
+/* What --verify finds wrong with a typescript, the first of them */
+enum problem
+{
+	PROBLEM_NONE,
+	PROBLEM_CUT_OFF,	/* Ends in the middle of a command */
+	PROBLEM_COMPRESSION_CUT_OFF,	/* Ends in the middle of a gzip member */
+	PROBLEM_UNTERMINATED,	/* A command without the ESC \ ending it */
+	PROBLEM_DELAY,	/* A delay command that isn't a number */
+	PROBLEM_KEYFRAME,	/* A keyframe that doesn't decompress */
+};
+
+static const char* const problem_names[] = {
+	"none",
+	"cut_off_command",
+	"cut_off_compression",
+	"unterminated_command",
+	"malformed_delay",
+	"malformed_keyframe",
+};
+
+/*
+ * A part of a typescript, starting at a delay command unless it's the first,
+ * that gets converted by a single worker. Its output is kept in memory until
+ * the parts before it are written.
+ */
+struct chunk
+{
+	struct file*  file;
+	struct chunk* next;	/* In the queue */
+	const char*   data;	/* The typescript from start to end, while it's read */
+	char*         inflated;	/* What data points to for a compressed typescript */
+	size_t        start, end;	/* In the typescript */
+	bool          last;	/* The typescript ends with it */
+	bool          done;	/* Converted, waiting for the chunks before it to be written */
+	long long     elapsed;	/* Microseconds of delay in it */
+	long long     time;	/* Microseconds into the session it starts, and then the time converting reached */
+	unsigned      rows, cols;	/* The first screen size in it, if any */
+	FILE*         out[2];
+	char*         buf[2];
+	size_t        len[2];
+
+	/* Converting */
+	bool          record;	/* A timing record is being collected */
+	long long     delay;	/* Its delay in microseconds */
+	size_t        pending;	/* And its amount of bytes */
+	bool          event;	/* An asciicast output event is open */
+	unsigned char utf8[4];	/* The start of a character split up by a delay */
+	unsigned      utf8_len;
+
+	/* Verifying */
+	size_t        commands;	/* Bytes of delay commands and keyframes */
+	unsigned long delays, keyframes, resizes;
+	bool          output;
+	long long     idle;	/* Microseconds without output, since the last of it */
+	long long     lead;	/* Before the first of it */
+	long long     longest;	/* Between any other */
+	enum problem  problem;
+	size_t        problem_at;
+};
+
+/*
+ * A typescript being converted. Chunks get read one after the other, by a
+ * single worker at a time, and only so far ahead of the first chunk that
+ * isn't written yet.
+ */
+struct file
+{
+	const char*   name;
+	struct file*  next;	/* In the queue */
+	char*         data;	/* Mapped typescript, NULL when it's inflated a chunk at a time */
+	size_t        mapped;	/* Size of the mapping */
+	gzFile        gz;	/* Compressed typescript */
+	bool          rewind;	/* Which can be read again for the next pass, instead of keeping its chunks */
+	char*         carry;	/* Inflated past the end of the last chunk */
+	size_t        carry_len, carry_size;
+	bool          at_end;	/* Nothing after the carry */
+	size_t        len;	/* Of the typescript, as far as it's been read */
+	char*         header;	/* The first line, which scriptreplay doesn't show */
+	size_t        header_len;
+	struct chunk** chunks;
+	unsigned      count;
+	unsigned      read;	/* Chunks read in the current pass */
+	unsigned      pending;	/* Of those, yet to be done with it */
+	unsigned      written;	/* Chunks whose output is written */
+	unsigned      live;	/* Chunks read whose data or output is still around */
+	bool          ended;	/* All chunks are known */
+	bool          reading;	/* A worker reads the next chunk */
+	bool          writing;	/* A worker writes output */
+	bool          failed;
+	FILE*         out[2];
+	char*         path[2];
+	bool          scanned;	/* The chunks know when they start */
+	bool          truncated;	/* The compressed typescript got cut off */
+	off_t         truncated_at;	/* Where, in the compressed file */
+	long long     duration;
+	unsigned      rows, cols;
+};
+
+/* What a pass over a chunk does with the parts of the typescript */
+struct pass
+{
+	void (*text)(struct chunk* c, const char* data, size_t len);
+	void (*delay)(struct chunk* c, long long usec);
+	void (*keyframe)(struct chunk* c, const char* payload, size_t len);
+	void (*resize)(struct chunk* c, unsigned rows, unsigned cols);	/* NULL to leave resizes in the text */
+	void (*malformed)(struct chunk* c, size_t offset, enum problem problem);
+	void (*finish)(struct chunk* c);
+};
+
+static const struct format
+{
+	const char* name;
+	const char* suffix[2];	/* Of the files written, the second one NULL when there's one */
+	bool        scan;	/* Chunks need to know when they start, taking a pass of their own */
+	struct pass convert;
+	void (*begin)(const struct file* file, FILE* out[2]);
+	void (*end)(const struct file* file, FILE* out[2]);
+	bool (*report)(const struct file* file);	/* Instead of writing files, returns false for failure */
+} *format;
+
+/* Typescripts waiting for a worker, and their chunks */
+static struct queue
+{
+	pthread_mutex_t lock;
+	pthread_cond_t  changed;
+	struct chunk*   head;
+	struct chunk**  tail;
+	struct file*    files;	/* Being converted */
+	char**          names;
+	int             count;
+	unsigned        busy;	/* Workers doing something with the queue unlocked */
+	unsigned        ahead;	/* Chunks of a typescript read at most, from the first not written on */
+	bool            failed;
+} queue = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, &queue.head };
+
+void __attribute__((__noreturn__))
+usage(int rc)
+{
+	printf(_("%s [--format=strip|split|asciicast] [--jobs=<n>] [--output-dir=<dir>] [--size=<cols>x<rows>] <typescript>...\n"
+	         "%s --verify [--jobs=<n>] <typescript>...\n"),
+			program_invocation_short_name, program_invocation_short_name);
+	exit(rc);
+}
+
+static void __attribute__((__noreturn__)) err(int eval, const char* fmt, ...)
+{
+	int err = errno;
+
+	if (fmt)
+	{
+		va_list ap;
+		va_start(ap, fmt);
+		vfprintf(stderr, fmt, ap);
+		va_end(ap);
+		fputs(": ", stderr);
+	}
+
+	fprintf(stderr, "%s\n", strerror(err));
+	exit(eval);
+}
+
+static void __attribute__((__noreturn__)) errx(int eval, const char* fmt, ...)
+{
+	if (fmt)
+	{
+		va_list ap;
+		va_start(ap, fmt);
+		vfprintf(stderr, fmt, ap);
+		va_end(ap);
+		fputs("\n", stderr);
+	}
+
+	exit(eval);
+}
+
+/* err() for what only fails a single typescript */
+static void
+warn(const char* fmt, ...)
+{
+	int err = errno;
+	va_list ap;
+
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fprintf(stderr, ": %s\n", strerror(err));
+}
+
+static void
+warnx(const char* fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fputs("\n", stderr);
+}
+
+/* Matches the resize at data[0] as script records them, ESC [ 8 ; rows ; cols t, returns its length or 0. */
+static size_t
+resize_match(const char* data, const size_t len, unsigned* rows, unsigned* cols)
+{
+	unsigned v[2] = { 0, 0 };
+	size_t i = sizeof("\x1B[8;") - 1;
+
+	if (len < i || memcmp(data, "\x1B[8;", i))
+		return 0;
+	for (int n = 0; n < 2; ++n)
+	{
+		const size_t digits = i;
+		while (i < len && data[i] >= '0' && data[i] <= '9' && v[n] < 100000)
+			v[n] = v[n] * 10 + (data[i++] - '0');
+		if (i == digits || i == len || data[i] != (n ? 't' : ';'))
+			return 0;
+		++i;
+	}
+	if (!v[0] || !v[1])
+		return 0;
+
+	*rows = v[0];
+	*cols = v[1];
+	return i;
+}
+
+/*
+ * Goes through a chunk the same way scriptreplay does, from ESC to ESC, for
+ * the pass to do with what's text and what's a command. What scriptreplay
+ * takes as text while it looks like one of our commands is malformed.
+ */
+static void
+chunk_walk(struct chunk* c, const struct pass* pass)
+{
+	const char* const data = c->data;
+	const size_t end = c->end - c->start;
+	size_t out = 0, pos = 0;
+
+	while (pos < end)
+	{
+		const char* const esc = memchr(data + pos, 0x1B, end - pos);
+		if (!esc)
+			break;
+
+		char type;
+		const char* payload;
+		size_t payload_len;
+		double delay;
+		unsigned rows, cols;
+		size_t n;
+		pos = esc - data;
+		size_t len = apc_match(esc, end - pos, &type, &payload, &payload_len);
+		if (!len)
+		{
+			// Cut off, so it's no command of ours. Past the end of the chunk it goes on into the next one's delay command.
+			if (pass->malformed && c->last)
+				pass->malformed(c, c->start + pos, PROBLEM_CUT_OFF);
+			else if (pass->malformed && end - pos >= sizeof(KEYFRAME_PREFIX) - 1)
+				pass->malformed(c, c->start + pos, PROBLEM_UNTERMINATED);
+			len = end - pos;
+		}
+		else if (type == 'K' || (type && delay_parse(payload, payload_len, type == 'd', &delay)))
+		{
+			if (pos > out && pass->text)
+				pass->text(c, data + out, pos - out);
+			if (type != 'K' && pass->delay)
+				pass->delay(c, (long long)(delay * 1e6 + 0.5));
+			else if (type == 'K' && pass->keyframe)
+				pass->keyframe(c, payload, payload_len);
+			c->commands += len;
+			out = pos + len;
+		}
+		else if (pass->malformed && (type || len >= sizeof(KEYFRAME_PREFIX) - 1))
+		{
+			pass->malformed(c, c->start + pos, type ? PROBLEM_DELAY : PROBLEM_UNTERMINATED);
+		}
+		else if (!type && pass->resize && (n = resize_match(esc, end - pos, &rows, &cols)))
+		{
+			if (pos > out && pass->text)
+				pass->text(c, data + out, pos - out);
+			pass->resize(c, rows, cols);
+			len = n;
+			out = pos + len;
+		}
+		pos += len;
+	}
+	if (end > out && pass->text)
+		pass->text(c, data + out, end - out);
+	if (pass->finish)
+		pass->finish(c);
+}
+
+static void
+scan_delay(struct chunk* c, const long long usec)
+{
+	c->elapsed += usec;
+}
+
+static void
+scan_resize(struct chunk* c, const unsigned rows, const unsigned cols)
+{
+	if (c->rows)
+		return;
+	c->rows = rows;
+	c->cols = cols;
+}
+
+/* Keyframes start with the size of the screen they redraw */
+static void
+scan_keyframe(struct chunk* c, const char* payload, const size_t len)
+{
+	if (c->rows)
+		return;
+
+	size_t size;
+	char* const raw = keyframe_decode(payload, len, &size);
+	unsigned rows, cols;
+	if (raw && resize_match(raw, size, &rows, &cols))
+		scan_resize(c, rows, cols);
+	free(raw);
+}
+
+/* Finds out when the chunks start, and the size of the screen */
+static const struct pass scan = {
+	.delay    = scan_delay,
+	.keyframe = scan_keyframe,
+	.resize   = scan_resize,
+};
+
+static void
+strip_text(struct chunk* c, const char* data, const size_t len)
+{
+	fwrite(data, 1, len, c->out[0]);
+}
+
+static void
+strip_begin(const struct file* file, FILE* out[2])
+{
+	fwrite(file->header, 1, file->header_len, out[0]);
+}
+
+/* Adds a record like script -t writes them: the delay before output, and the amount of it. */
+static void
+split_record(struct chunk* c)
+{
+	fprintf(c->out[0], "%03lld.%06lld %zu\n", c->delay / 1000000, c->delay % 1000000, c->pending);
+	c->delay = 0;
+	c->pending = 0;
+}
+
+static void
+split_text(struct chunk* c, const char* data, const size_t len)
+{
+	// Output ahead of the first delay
+	c->record = true;
+	fwrite(data, 1, len, c->out[1]);
+	c->pending += len;
+}
+
+/* Delays without output in between become a single record */
+static void
+split_delay(struct chunk* c, const long long usec)
+{
+	if (c->record && c->pending)
+		split_record(c);
+	c->record = true;
+	c->delay += usec;
+}
+
+static void
+split_finish(struct chunk* c)
+{
+	if (c->record && (c->pending || c->delay))
+		split_record(c);
+}
+
+static void
+split_begin(const struct file* file, FILE* out[2])
+{
+	fwrite(file->header, 1, file->header_len, out[1]);
+}
+
+/* scriptreplay shows the output of a record after the delay of the next one, this gets the last of it shown */
+static void
+split_end(const struct file* file, FILE* out[2])
+{
+	fputs("000.000000 0\n", out[0]);
+}
+
+/* Returns the length of the UTF-8 character at s, 0 when it's cut off and -1 when it's malformed. */
+static int
+utf8_length(const unsigned char* s, const size_t len)
+{
+	unsigned char lo = 0x80, hi = 0xBF;	/* What the second byte can be */
+	int n;
+
+	if (s[0] >= 0xC2 && s[0] <= 0xDF)
+	{
+		n = 2;
+	}
+	else if (s[0] >= 0xE0 && s[0] <= 0xEF)
+	{
+		n = 3;
+		if (s[0] == 0xE0)
+			lo = 0xA0;
+		else if (s[0] == 0xED)
+			hi = 0x9F;
+	}
+	else if (s[0] >= 0xF0 && s[0] <= 0xF4)
+	{
+		n = 4;
+		if (s[0] == 0xF0)
+			lo = 0x90;
+		else if (s[0] == 0xF4)
+			hi = 0x8F;
+	}
+	else
+	{
+		return -1;
+	}
+
+	for (int i = 1; i < n; ++i)
+	{
+		if ((size_t)i == len)
+			return 0;
+		if (s[i] < lo || s[i] > hi)
+			return -1;
+		lo = 0x80;
+		hi = 0xBF;
+	}
+	return n;
+}
+
+static void
+cast_open(struct chunk* c)
+{
+	if (c->event)
+		return;
+	fprintf(c->out[0], "[%lld.%06lld, \"o\", \"", c->time / 1000000, c->time % 1000000);
+	c->event = true;
+}
+
+static void
+cast_close(struct chunk* c)
+{
+	if (!c->event)
+		return;
+	fputs("\"]\n", c->out[0]);
+	c->event = false;
+}
+
+/*
+ * Adds output to the event at the current time as a JSON string. What isn't
+ * UTF-8 becomes U+FFFD, except for a character the next delay cuts off, which
+ * is finished in the next event.
+ */
+static void
+cast_text(struct chunk* c, const char* data, size_t len)
+{
+	FILE* const f = c->out[0];
+	const unsigned char* s = (const unsigned char*)data;
+
+	cast_open(c);
+	while (c->utf8_len && len)
+	{
+		c->utf8[c->utf8_len++] = *s++;
+		--len;
+		const int n = utf8_length(c->utf8, c->utf8_len);
+		if (n > 0)
+		{
+			fwrite(c->utf8, 1, n, f);
+			c->utf8_len = 0;
+		}
+		else if (n < 0)
+		{
+			// What came before was fine, the byte just added may start a character of its own
+			fputs("\\ufffd", f);
+			c->utf8_len = 0;
+			--s;
+			++len;
+		}
+	}
+
+	while (len)
+	{
+		size_t run = 0;
+		int n;
+		while (run < len)
+		{
+			if (s[run] >= 0x20 && s[run] < 0x80 && s[run] != '"' && s[run] != '\\')
+				++run;
+			else if (s[run] >= 0x80 && (n = utf8_length(s + run, len - run)) > 0)
+				run += n;
+			else
+				break;
+		}
+		fwrite(s, 1, run, f);
+		s += run;
+		len -= run;
+		if (!len)
+			break;
+
+		switch (*s)
+		{
+			case '"':  fputs("\\\"", f); break;
+			case '\\': fputs("\\\\", f); break;
+			case '\b': fputs("\\b", f); break;
+			case '\f': fputs("\\f", f); break;
+			case '\n': fputs("\\n", f); break;
+			case '\r': fputs("\\r", f); break;
+			case '\t': fputs("\\t", f); break;
+			default:
+				if (*s < 0x20)
+				{
+					fprintf(f, "\\u%04x", *s);
+				}
+				else if (!utf8_length(s, len))
+				{
+					memcpy(c->utf8, s, len);
+					c->utf8_len = len;
+					return;
+				}
+				else
+				{
+					fputs("\\ufffd", f);
+				}
+		}
+		++s;
+		--len;
+	}
+}
+
+static void
+cast_delay(struct chunk* c, const long long usec)
+{
+	cast_close(c);
+	c->time += usec;
+}
+
+static void
+cast_resize(struct chunk* c, const unsigned rows, const unsigned cols)
+{
+	cast_close(c);
+	fprintf(c->out[0], "[%lld.%06lld, \"r\", \"%ux%u\"]\n", c->time / 1000000, c->time % 1000000, cols, rows);
+}
+
+/* A character cut off at the end is one that never got finished */
+static void
+cast_finish(struct chunk* c)
+{
+	if (c->utf8_len)
+	{
+		c->utf8_len = 0;
+		cast_open(c);
+		fputs("\\ufffd", c->out[0]);
+	}
+	cast_close(c);
+}
+
+/* When the session started, from the first line of its typescript */
+static bool
+header_time(const struct file* file, long long* timestamp)
+{
+	char line[256];
+	const size_t len = MIN(file->header_len, sizeof(line) - 1);
+	struct tm tm;
+
+	memcpy(line, file->header, len);
+	line[len] = '\0';
+	memset(&tm, 0, sizeof(tm));
+	const char* const p = strstr(line, " on ");
+	if (!p || !strptime(p + 4, "%Y-%m-%d %H:%M:%S", &tm))
+		return false;
+	*timestamp = timegm(&tm);
+	return true;
+}
+
+static void
+cast_begin(const struct file* file, FILE* out[2])
+{
+	long long timestamp;
+
+	fprintf(out[0], "{\"version\": 2, \"width\": %u, \"height\": %u, \"duration\": %lld.%06lld",
+		cast_cols ? cast_cols : file->cols ? file->cols : CAST_COLS,
+		cast_rows ? cast_rows : file->rows ? file->rows : CAST_ROWS,
+		file->duration / 1000000, file->duration % 1000000);
+	if (header_time(file, &timestamp))
+		fprintf(out[0], ", \"timestamp\": %lld", timestamp);
+	fputs("}\n", out[0]);
+}
+
+static void
+verify_text(struct chunk* c, const char* data, const size_t len)
+{
+	if (!c->output)
+		c->lead = c->idle;
+	else if (c->idle > c->longest)
+		c->longest = c->idle;
+	c->output = true;
+	c->idle = 0;
+}
+
+static void
+verify_malformed(struct chunk* c, const size_t offset, const enum problem problem)
+{
+	if (c->problem)
+		return;
+	c->problem = problem;
+	c->problem_at = offset;
+}
+
+static void
+verify_delay(struct chunk* c, const long long usec)
+{
+	++c->delays;
+	c->elapsed += usec;
+	c->idle += usec;
+}
+
+static void
+verify_keyframe(struct chunk* c, const char* payload, const size_t len)
+{
+	size_t size;
+	char* const raw = keyframe_decode(payload, len, &size);
+	if (!raw)
+		verify_malformed(c, c->start + (payload - (sizeof(KEYFRAME_PREFIX) - 1) - c->data), PROBLEM_KEYFRAME);
+	free(raw);
+	++c->keyframes;
+}
+
+static void
+verify_resize(struct chunk* c, const unsigned rows, const unsigned cols)
+{
+	++c->resizes;
+}
+
+/*
+ * Writes a line about a typescript to stdout: whether it's intact, where the
+ * first problem is, and what's in it. Returns false when it isn't intact.
+ */
+static bool
+verify_report(const struct file* file)
+{
+	enum problem problem = PROBLEM_NONE;
+	size_t problem_at = 0, commands = 0;
+	unsigned long delays = 0, keyframes = 0, resizes = 0;
+	long long elapsed = 0, idle = 0, longest = 0;
+
+	for (unsigned i = 0; i < file->count; ++i)
+	{
+		const struct chunk* const c = file->chunks[i];
+		if (!problem && c->problem)
+		{
+			problem = c->problem;
+			problem_at = c->problem_at;
+		}
+		commands += c->commands;
+		delays += c->delays;
+		keyframes += c->keyframes;
+		resizes += c->resizes;
+		elapsed += c->elapsed;
+
+		// Idle time goes on from one chunk into the next, up to its first output
+		if (c->output)
+		{
+			if (idle + c->lead > longest)
+				longest = idle + c->lead;
+			if (c->longest > longest)
+				longest = c->longest;
+			idle = c->idle;
+		}
+		else
+		{
+			idle += c->idle;
+		}
+	}
+	if (idle > longest)
+		longest = idle;
+	if (!problem && file->truncated)
+	{
+		problem = PROBLEM_COMPRESSION_CUT_OFF;
+		problem_at = file->len;
+	}
+
+	// Offsets are into the typescript after decompressing, a cut off compression also says where in the file
+	char status[128] = "ok";
+	if (problem == PROBLEM_COMPRESSION_CUT_OFF)
+		snprintf(status, sizeof(status), "truncated offset=%zu compressed_offset=%lld problem=%s",
+			problem_at, (long long)file->truncated_at, problem_names[problem]);
+	else if (problem)
+		snprintf(status, sizeof(status), "%s offset=%zu problem=%s",
+			problem == PROBLEM_CUT_OFF ? "truncated" : "corrupt", problem_at, problem_names[problem]);
+	printf("%s: %s seconds=%lld.%06lld bytes=%zu output=%zu delays=%lu keyframes=%lu resizes=%lu longest_idle=%lld.%06lld\n",
+		file->name, status, elapsed / 1000000, elapsed % 1000000, file->len, file->len - file->header_len - commands,
+		delays, keyframes, resizes, longest / 1000000, longest % 1000000);
+	return !problem;
+}
+
+/* --verify, checking the typescript the way scriptreplay reads it */
+static const struct format verify = {
+	"verify", { NULL, NULL }, false,
+	{ .text = verify_text, .delay = verify_delay, .keyframe = verify_keyframe, .resize = verify_resize,
+	  .malformed = verify_malformed },
+	NULL, NULL, verify_report,
+};
+
+static const struct format formats[] = {
+	// Plain typescript, as script writes it without delay commands
+	{ "strip", { ".txt", NULL }, false,
+	  { .text = strip_text },
+	  strip_begin, NULL },
+	// A timing file and typescript as written by script -t, for scriptreplay to play together
+	{ "split", { ".timing", ".typescript" }, false,
+	  { .text = split_text, .delay = split_delay, .finish = split_finish },
+	  split_begin, split_end },
+	// Version 2 of the asciinema format
+	{ "asciicast", { ".cast", NULL }, true,
+	  { .text = cast_text, .delay = cast_delay, .resize = cast_resize, .finish = cast_finish },
+	  cast_begin, NULL },
+};
+
+/*
+ * Finds where the chunk after from can start: at a delay command following a
+ * complete character. As every ESC that doesn't end a command starts one
+ * anew, the typescript on either side converts the same as it does whole.
+ * Returns len when there's no such place in data.
+ */
+static size_t
+chunk_boundary(const char* data, const size_t len, size_t from)
+{
+	while (from < len)
+	{
+		const char* const esc = memchr(data + from, 0x1B, len - from);
+		if (!esc)
+			break;
+
+		char type;
+		const char* payload;
+		size_t payload_len;
+		double delay;
+		from = esc - data;
+		if (apc_match(esc, len - from, &type, &payload, &payload_len)
+		 && (type == 'D' || type == 'd') && delay_parse(payload, payload_len, type == 'd', &delay)
+		 && (unsigned char)data[from - 1] < 0x80)
+			return from;
+		++from;
+	}
+	return len;
+}
+
+/* Inflates up to len bytes of a compressed typescript, returns how many or -1 when it can't be read */
+static ssize_t
+file_inflate(struct file* file, char* buf, const size_t len)
+{
+	size_t done = 0;
+	while (done < len)
+	{
+		const int ret = gzread(file->gz, buf + done, MIN(len - done, INT_MAX));
+		if (ret > 0)
+		{
+			done += ret;
+			continue;
+		}
+
+		// An incomplete last member is what a crash leaves behind, convert what we have
+		int errnum;
+		gzerror(file->gz, &errnum);
+		file->truncated = errnum == Z_BUF_ERROR;
+		if (file->truncated)
+			file->truncated_at = gzoffset(file->gz);
+		if (errnum == Z_OK || errnum == Z_BUF_ERROR)
+			break;
+
+		if (errnum == Z_ERRNO)
+			warn(_("Failed to read from %s"), file->name);
+		else
+			warnx(_("%s: corrupt compressed data"), file->name);
+		return -1;
+	}
+	return done;
+}
+
+/* Inflates more of a compressed typescript after the carry, returns false when it can't be read */
+static bool
+file_fill(struct file* file)
+{
+	if (file->carry_len == file->carry_size)
+	{
+		file->carry_size = file->carry_size ? file->carry_size * 2 : CHUNK_SIZE + (1 << 16);
+		if (!(file->carry = realloc(file->carry, file->carry_size)))
+			err(EXIT_FAILURE, NULL);
+	}
+
+	const size_t room = file->carry_size - file->carry_len;
+	const ssize_t len = file_inflate(file, file->carry + file->carry_len, room);
+	if (len == -1)
+		return false;
+	file->carry_len += len;
+	file->at_end = (size_t)len < room;
+	return true;
+}
+
+/*
+ * Opens a typescript and reads its first line. Uncompressed ones get mapped,
+ * compressed ones get inflated a chunk at a time. Returns NULL when it can't
+ * be read.
+ */
+static struct file*
+file_open(const char* name)
+{
+	struct file* const file = calloc(1, sizeof(*file));
+	if (!file)
+		err(EXIT_FAILURE, NULL);
+	file->name = name;
+
+	const int fd = open(name, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+	{
+		warn(_("cannot open typescript %s"), name);
+		free(file);
+		return NULL;
+	}
+
+	struct stat st;
+	unsigned char magic[2];
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 && (size_t)st.st_size == st.st_size
+	 && (pread(fd, magic, sizeof(magic), 0) != sizeof(magic) || magic[0] != 0x1f || magic[1] != 0x8b))
+	{
+		void* const map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map != MAP_FAILED)
+		{
+			file->data = map;
+			file->len = file->mapped = st.st_size;
+		}
+	}
+
+	if (file->mapped)
+	{
+		close(fd);
+		const char* const nl = memchr(file->data, '\n', file->len);
+		file->header = file->data;
+		file->header_len = nl ? (size_t)(nl + 1 - file->data) : file->len;
+	}
+	else
+	{
+		// zlib takes what isn't compressed as it is
+		file->rewind = lseek(fd, 0, SEEK_CUR) != (off_t)-1;
+		file->gz = gzdopen(fd, "rb");
+		if (!file->gz)
+			err(EXIT_FAILURE, NULL);
+		gzbuffer(file->gz, 1 << 17);
+
+		const char* nl = NULL;
+		while (!nl && !file->at_end)
+		{
+			const size_t from = file->carry_len;
+			if (!file_fill(file))
+			{
+				gzclose(file->gz);
+				free(file->carry);
+				free(file);
+				return NULL;
+			}
+			nl = memchr(file->carry + from, '\n', file->carry_len - from);
+		}
+
+		file->header_len = nl ? (size_t)(nl + 1 - file->carry) : file->carry_len;
+		if (!(file->header = malloc(file->header_len + 1)))
+			err(EXIT_FAILURE, NULL);
+		memcpy(file->header, file->carry, file->header_len);
+		file->carry_len -= file->header_len;
+		memmove(file->carry, file->carry + file->header_len, file->carry_len);
+		file->len = file->header_len;
+	}
+
+	return file;
+}
+
+/* Lets go of the typescript a chunk got read from */
+static void
+chunk_release(struct chunk* c)
+{
+	if (!c->inflated)
+		return;
+	free(c->inflated);
+	c->inflated = NULL;
+	c->data = NULL;
+}
+
+static void
+file_close(struct file* file)
+{
+	for (unsigned i = 0; i < file->count; ++i)
+	{
+		struct chunk* const c = file->chunks[i];
+		for (int k = 0; k < 2; ++k)
+			free(c->buf[k]);
+		chunk_release(c);
+		free(c);
+	}
+	free(file->chunks);
+	for (int k = 0; k < 2; ++k)
+		free(file->path[k]);
+	if (file->mapped)
+	{
+		munmap(file->data, file->mapped);
+	}
+	else
+	{
+		gzclose(file->gz);
+		free(file->header);
+		free(file->carry);
+	}
+	free(file);
+}
+
+/*
+ * Reads the next chunk of a typescript for the current pass. The first pass
+ * finds where chunks end, later ones read them again, unless they were kept.
+ * Returns NULL when the typescript can't be read.
+ */
+static struct chunk*
+file_read(struct file* file)
+{
+	if (file->read < file->count)
+	{
+		struct chunk* const c = file->chunks[file->read];
+		if (c->data)
+			return c;
+
+		const size_t len = c->end - c->start;
+		if ((!file->read && (gzrewind(file->gz) == -1 || gzseek(file->gz, file->header_len, SEEK_SET) == -1))
+		 || !(c->inflated = malloc(len ? len : 1)))
+		{
+			warn(_("Failed to read from %s"), file->name);
+			return NULL;
+		}
+
+		const ssize_t done = file_inflate(file, c->inflated, len);
+		if (done != (ssize_t)len)
+		{
+			if (done != -1)
+				warnx(_("%s: changed while converting"), file->name);
+			chunk_release(c);
+			return NULL;
+		}
+		c->data = c->inflated;
+		return c;
+	}
+
+	struct chunk* const c = calloc(1, sizeof(*c));
+	if (!c)
+		err(EXIT_FAILURE, NULL);
+	c->file = file;
+	c->start = file->count ? file->chunks[file->count - 1]->end : file->header_len;
+
+	// Every chunk but the last is at least CHUNK_SIZE long
+	if (file->mapped)
+	{
+		const size_t len = file->len - c->start;
+		c->data = file->data + c->start;
+		c->end = c->start + (len > CHUNK_SIZE ? chunk_boundary(c->data, len, CHUNK_SIZE) : len);
+		c->last = c->end == file->len;
+		return c;
+	}
+
+	size_t from = CHUNK_SIZE, end;
+	for (;;)
+	{
+		end = file->carry_len;
+		if (end > CHUNK_SIZE && (end = chunk_boundary(file->carry, file->carry_len, from)) < file->carry_len)
+			break;
+		if (file->at_end)
+			break;
+		// Looking again at a delay command reading cut off
+		if (file->carry_len > from + DELAY_MAX)
+			from = file->carry_len - DELAY_MAX;
+		if (!file_fill(file))
+		{
+			free(c);
+			return NULL;
+		}
+	}
+
+	// What's left over starts the next chunk
+	const size_t rest = file->carry_len - end;
+	c->data = c->inflated = file->carry;
+	c->end = c->start + end;
+	c->last = file->at_end && !rest;
+	file->len = c->end;
+	file->carry = NULL;
+	file->carry_len = file->carry_size = 0;
+	if (rest)
+	{
+		file->carry_size = rest > CHUNK_SIZE ? rest : CHUNK_SIZE + (1 << 16);
+		if (!(file->carry = malloc(file->carry_size)))
+			err(EXIT_FAILURE, NULL);
+		memcpy(file->carry, c->inflated + end, rest);
+		file->carry_len = rest;
+	}
+	return c;
+}
+
+/* Names the output of a typescript, leaving off the .gz of a compressed one */
+static char*
+output_path(const char* name, const char* suffix)
+{
+	const char* base = output_dir ? strrchr(name, '/') : NULL;
+	base = base ? base + 1 : name;
+	size_t len = strlen(base);
+	if (len > 3 && !strcmp(base + len - 3, ".gz"))
+		len -= 3;
+
+	char* path;
+	if (asprintf(&path, "%s%s%.*s%s", output_dir ? output_dir : "", output_dir ? "/" : "", (int)len, base, suffix) == -1)
+		err(EXIT_FAILURE, NULL);
+	return path;
+}
+
+/* Creates the files a typescript gets converted into, returns false on failure. */
+static bool
+file_begin(struct file* file)
+{
+	for (int k = 0; k < 2 && format->suffix[k]; ++k)
+	{
+		char* const path = output_path(file->name, format->suffix[k]);
+		if (!(file->out[k] = fopen(path, "w")))
+		{
+			warn(_("cannot create %s"), path);
+			free(path);
+			return false;
+		}
+		file->path[k] = path;
+	}
+
+	if (format->begin)
+		format->begin(file, file->out);
+	return true;
+}
+
+/* Writes what a chunk got converted into, after the chunks before it, and lets go of it */
+static void
+chunk_write(struct chunk* c)
+{
+	for (int k = 0; k < 2; ++k)
+	{
+		if (c->file->out[k])
+			fwrite(c->buf[k], 1, c->len[k], c->file->out[k]);
+		free(c->buf[k]);
+		c->buf[k] = NULL;
+	}
+	chunk_release(c);
+}
+
+/* Finishes what a typescript got converted into, returns false on failure. */
+static bool
+file_end(struct file* file)
+{
+	bool ok = !file->failed;
+
+	if (ok && format->report)
+		return format->report(file);
+
+	if (ok && format->end)
+		format->end(file, file->out);
+	for (int k = 0; k < 2; ++k)
+	{
+		if (file->out[k] && (ferror(file->out[k]) | fclose(file->out[k])))
+		{
+			warn(_("Failed to write to %s"), file->path[k]);
+			ok = false;
+		}
+		file->out[k] = NULL;
+	}
+
+	// Rather than leaving part of it behind
+	for (int k = 0; k < 2 && !ok; ++k)
+		if (file->path[k])
+			unlink(file->path[k]);
+	return ok;
+}
+
+/*
+ * Called with the queue locked whenever a chunk of a typescript is done or
+ * it can't be read any further. Scanned chunks get to know when they start,
+ * once all of them are, and get read again to convert them. Converted ones
+ * get their output written, in order, by one worker at a time. After the
+ * last one, the typescript is finished.
+ */
+static void
+file_progress(struct file* file)
+{
+	if (file->writing)
+		return;
+	file->writing = true;
+
+	if (format->scan && !file->scanned)
+	{
+		if (file->ended && !file->pending && !file->failed)
+		{
+			for (unsigned i = 0; i < file->count; ++i)
+			{
+				struct chunk* const c = file->chunks[i];
+				c->time = file->duration;
+				file->duration += c->elapsed;
+				if (!file->rows && c->rows)
+				{
+					file->rows = c->rows;
+					file->cols = c->cols;
+				}
+			}
+			file->scanned = true;
+			file->read = 0;
+		}
+	}
+	else
+	{
+		while (file->written < file->read && file->chunks[file->written]->done)
+		{
+			struct chunk* const c = file->chunks[file->written];
+			const bool begin = !file->written && !file->failed;
+			pthread_mutex_unlock(&queue.lock);
+			const bool ok = !begin || file_begin(file);
+			chunk_write(c);
+			pthread_mutex_lock(&queue.lock);
+			if (!ok)
+				file->failed = file->ended = true;
+			++file->written;
+			--file->live;
+		}
+	}
+	file->writing = false;
+
+	if (!file->ended || file->pending
+	 || (!file->failed && ((format->scan && !file->scanned) || file->written < file->count)))
+		return;
+
+	struct file** p = &queue.files;
+	while (*p != file)
+		p = &(*p)->next;
+	*p = file->next;
+
+	pthread_mutex_unlock(&queue.lock);
+	const bool ok = file_end(file);
+	file_close(file);
+	pthread_mutex_lock(&queue.lock);
+	if (!ok)
+		queue.failed = true;
+}
+
+static void
+chunk_run(struct chunk* c)
+{
+	if (format->scan && !c->file->scanned)
+	{
+		chunk_walk(c, &scan);
+		return;
+	}
+
+	for (int k = 0; k < 2 && format->suffix[k]; ++k)
+		if (!(c->out[k] = open_memstream(&c->buf[k], &c->len[k])))
+			err(EXIT_FAILURE, NULL);
+	chunk_walk(c, &format->convert);
+	for (int k = 0; k < 2 && c->out[k]; ++k)
+		if (fclose(c->out[k]) == EOF)
+			err(EXIT_FAILURE, NULL);
+}
+
+/* Called with the queue locked once a worker is done with a chunk */
+static void
+chunk_done(struct chunk* c)
+{
+	struct file* const file = c->file;
+
+	--file->pending;
+	if (format->scan && !file->scanned)
+	{
+		// Read again for converting, unless it can't be
+		if (file->rewind)
+			chunk_release(c);
+		--file->live;
+	}
+	else
+	{
+		c->done = true;
+	}
+	file_progress(file);
+}
+
+/* A typescript with a chunk to read next, with the queue locked. Returns NULL when there's none. */
+static struct file*
+file_readable(const bool ahead)
+{
+	for (struct file* file = queue.files; file; file = file->next)
+		if ((file->read < file->count || !file->ended) && (!ahead || (!file->reading && file->live < queue.ahead)))
+			return file;
+	return NULL;
+}
+
+/*
+ * Takes on chunks from the queue, or when there are none reads the next
+ * chunk of a typescript. Only once all are read does the next typescript get
+ * started, so that typescripts get finished before others get started.
+ */
+static void*
+worker(void* arg)
+{
+	(void)arg;
+
+	pthread_mutex_lock(&queue.lock);
+	for (;;)
+	{
+		struct chunk* c = queue.head;
+		struct file* file;
+		if (c)
+		{
+			queue.head = c->next;
+			if (!queue.head)
+				queue.tail = &queue.head;
+			++queue.busy;
+			pthread_mutex_unlock(&queue.lock);
+			chunk_run(c);
+			pthread_mutex_lock(&queue.lock);
+			chunk_done(c);
+			--queue.busy;
+		}
+		else if ((file = file_readable(true)))
+		{
+			file->reading = true;
+			++queue.busy;
+			pthread_mutex_unlock(&queue.lock);
+			c = file_read(file);
+			pthread_mutex_lock(&queue.lock);
+			file->reading = false;
+			if (!c || file->failed)
+			{
+				if (c)
+					chunk_release(c);
+				if (c && file->read == file->count)
+					free(c);
+				file->failed = file->ended = true;
+				queue.failed = true;
+				file_progress(file);
+			}
+			else
+			{
+				if (file->read == file->count)
+				{
+					struct chunk** const chunks = realloc(file->chunks, (file->count + 1) * sizeof(*chunks));
+					if (!chunks)
+						err(EXIT_FAILURE, NULL);
+					file->chunks = chunks;
+					file->chunks[file->count++] = c;
+					file->ended = c->last;
+				}
+				++file->read;
+				++file->pending;
+				++file->live;
+				c->next = NULL;
+				*queue.tail = c;
+				queue.tail = &c->next;
+			}
+			--queue.busy;
+		}
+		else if (queue.count && !file_readable(false))
+		{
+			const char* const name = *queue.names++;
+			--queue.count;
+			++queue.busy;
+			pthread_mutex_unlock(&queue.lock);
+			file = file_open(name);
+			pthread_mutex_lock(&queue.lock);
+			if (file)
+			{
+				file->next = queue.files;
+				queue.files = file;
+			}
+			else
+			{
+				queue.failed = true;
+			}
+			--queue.busy;
+		}
+		else if (queue.busy)
+		{
+			pthread_cond_wait(&queue.changed, &queue.lock);
+			continue;
+		}
+		else
+		{
+			break;
+		}
+		pthread_cond_broadcast(&queue.changed);
+	}
+	pthread_cond_broadcast(&queue.changed);
+	pthread_mutex_unlock(&queue.lock);
+	return NULL;
+}
+
+int
+main(int argc, char *argv[])
+{
+	long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	int c;
+	enum { OPT_FORMAT = CHAR_MAX + 1, OPT_VERIFY, OPT_JOBS, OPT_OUTPUT_DIR, OPT_SIZE };
+	static const struct option longopts[] = {
+		{ "format", required_argument, NULL, OPT_FORMAT },
+		{ "verify", no_argument,       NULL, OPT_VERIFY },
+		{ "jobs", required_argument, NULL, OPT_JOBS },
+		{ "output-dir", required_argument, NULL, OPT_OUTPUT_DIR },
+		{ "size", required_argument, NULL, OPT_SIZE },
+		{ NULL,    0,                 NULL, 0 }
+	};
+
+	// Delays get read and written with a decimal point
+	setlocale(LC_ALL, "");
+	setlocale(LC_NUMERIC, "C");
+
+	format = &formats[0];
+	while ((c = getopt_long(argc, argv, "", longopts, NULL)) != -1)
+		switch (c)
+		{
+			case OPT_FORMAT:
+				for (format = formats; format < formats + sizeof(formats) / sizeof(*formats); ++format)
+					if (!strcmp(optarg, format->name))
+						break;
+				if (format == formats + sizeof(formats) / sizeof(*formats))
+					errx(EXIT_FAILURE, _("unknown format '%s'"), optarg);
+				break;
+			case OPT_VERIFY:
+				format = &verify;
+				break;
+			case OPT_JOBS:
+			{
+				char* end;
+				errno = 0;
+				jobs = strtol(optarg, &end, 10);
+				if (errno || end == optarg || *end || jobs < 1)
+					errx(EXIT_FAILURE, _("expected a number of jobs, but got '%s'"), optarg);
+				break;
+			}
+			case OPT_OUTPUT_DIR:
+				output_dir = optarg;
+				break;
+			case OPT_SIZE:
+			{
+				char extra;
+				if (sscanf(optarg, "%ux%u%c", &cast_cols, &cast_rows, &extra) != 2 || !cast_cols || !cast_rows)
+					errx(EXIT_FAILURE, _("expected <cols>x<rows>, but got '%s'"), optarg);
+				break;
+			}
+			default:
+				usage(EXIT_FAILURE);
+		}
+	if (optind == argc)
+		usage(EXIT_FAILURE);
+	if (jobs < 1)
+		jobs = 1;
+	queue.ahead = jobs < UINT_MAX / 2 ? 2 * jobs : UINT_MAX;
+
+	queue.names = argv + optind;
+	queue.count = argc - optind;
+
+	// This thread is one of the workers
+	pthread_t* const threads = calloc(jobs, sizeof(*threads));
+	if (!threads)
+		err(EXIT_FAILURE, NULL);
+	for (long i = 1; i < jobs; ++i)
+	{
+		errno = pthread_create(&threads[i], NULL, worker, NULL);
+		if (errno)
+			err(EXIT_FAILURE, _("failed to start a worker"));
+	}
+	worker(NULL);
+	for (long i = 1; i < jobs; ++i)
+		pthread_join(threads[i], NULL);
+	free(threads);
+
+	exit(queue.failed ? EXIT_FAILURE : EXIT_SUCCESS);
+}
@@ -17,6 +17,7 @@
  */
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdlib.h>
@@ -25,29 +26,71 @@
 #include <time.h>
 #include <limits.h>
 #include <math.h>
-#include <sys/select.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/inotify.h>
 #include <fcntl.h>
+#include <getopt.h>
+#include <glob.h>
 #include <unistd.h>
 #include <locale.h>
+#include <zlib.h>
+
+#include "apc.h"
+#include "vt.h"
 
 #define _(Text) (Text)
 
 #define SCRIPT_MIN_DELAY 0.0001		/* from original sripreplay.pl */
 
+/* Index records as written by script --index-interval/--index-size */
+#define INDEX_RECORD_FMT "%012lld.%06lld %020lld\n"
+#define INDEX_RECORD_SIZE 41
+/* How far apart to put index points when building the index ourselves */
+#define INDEX_INTERVAL 10000000LL	/* microseconds */
+#define INDEX_SIZE (1 << 20)
+
+/* Timing records as written by script --binary-timing, after a header record */
+#define TIMING_MAGIC "\0script timing\0\0"
+#define TIMING_RECORD_SIZE 16
+
+/* Screen size for --render until the typescript records one */
+#define RENDER_ROWS 24
+#define RENDER_COLS 80
+
 #define MAX(a,b) ((a) < (b) ? (b) : (a))
 #define MIN(a,b) ((a) < (b) ? (a) : (b))
 
 static const char* program_invocation_short_name;
 
+static double skip;	/* Recorded time to fast forward through, for --start */
+static double max_idle = -1;	/* Longest single wait, for --max-idle */
+static double min_frame;	/* Shortest wait, shorter ones get merged, for --min-frame */
+static int follow_fd = -1;	/* inotify instance watching the typescript, for --follow */
+static bool follow_closed;	/* The typescript's writer closed it */
+static struct vt* render;	/* Screen output goes to instead of stdout, for --render */
+static bool render_keyframe;	/* --render jumped ahead to a keyframe, which is yet to come */
+static struct vt* catchup;	/* Screen fast forwarding to --start builds up, to start playing from */
+static bool catchup_seeded;	/* It started at the beginning or from a keyframe, so it's the whole screen */
+
 void __attribute__((__noreturn__))
 usage(int rc)
 {
-	printf(_("%s <timingfile> [<typescript> [<divisor>]]\n"),
-			program_invocation_short_name);
+	printf(_("%s [--start=<time>] [--max-idle=<time>] [--min-frame=<time>] [--stats] <timingfile> [<typescript> [<divisor>]]\n"
+	         "%s --segments [--divisor=<divisor>] [--start=<time>] [--max-idle=<time>] [--min-frame=<time>] [--stats] <typescript>...\n"
+	         "%s --attach=<socket>\n"
+	         "%s --follow <typescript>\n"
+	         "%s --render[=<time>,...] [--scrollback=<lines>] [--segments] <timingfile> [<typescript>] | <typescript>...\n"),
+			program_invocation_short_name, program_invocation_short_name, program_invocation_short_name,
+			program_invocation_short_name, program_invocation_short_name);
 	exit(rc);
 }
 
-static void err(int eval, const char* fmt, ...)
+static void __attribute__((__noreturn__)) err(int eval, const char* fmt, ...)
 {
 	int err = errno;
 
@@ -64,7 +107,7 @@ static void err(int eval, const char* fmt, ...)
 	exit(eval);
 }
 
-static void errx(int eval, const char* fmt, ...)
+static void __attribute__((__noreturn__)) errx(int eval, const char* fmt, ...)
 {
 	if (fmt)
 	{
@@ -100,145 +143,1171 @@ getnum(const char *s)
 	return d;
 }
 
-static void
-delay_for(double delay)
+/* Parses seconds, optionally preceded by minutes and hours: [[hh:]mm:]ss[.fff] */
+static double
+gettime(const char *s)
 {
-	if (delay < SCRIPT_MIN_DELAY)
-		return;
-#ifdef HAVE_NANOSLEEP
-	struct timespec ts, remainder;
-	ts.tv_sec = (time_t) delay;
-	ts.tv_nsec = (delay - ts.tv_sec) * 1.0e9;
-
-	while (-1 == nanosleep(&ts, &remainder)) {
-		if (EINTR == errno)
-			ts = remainder;
-		else
+	double t = 0;
+	const char* p = s;
+
+	for (int part = 0; part < 3; ++part)
+	{
+		char *end;
+		errno = 0;
+		const double d = strtod(p, &end);
+		if (errno || end == p || d < 0)
 			break;
+
+		t = t * 60 + d;
+		if (!*end)
+			return t;
+		if (*end != ':')
+			break;
+		p = end + 1;
 	}
-#else
-	struct timeval tv;
-	tv.tv_sec = (long) delay;
-	tv.tv_usec = (delay - tv.tv_sec) * 1.0e6;
-	select(0, NULL, NULL, NULL, &tv);
-#endif
+
+	errx(EXIT_FAILURE, _("expected a time, but got '%s'"), s);
 }
 
+/*
+ * Output that's due gets collected here and only written once we have to
+ * sleep, so that when playback falls behind the backlog goes out in a single
+ * write instead of one per delay command. Spans of a mapped typescript are
+ * referenced in place, everything else gets copied.
+ */
+static struct output {
+	struct iovec iov[64];
+	int          cnt;
+	size_t       copied;
+	char         copy[65536];
+} output;
+
 static void
-bufflush(char* buf, size_t* outpending, size_t processing)
+output_flush(void)
 {
-	while (*outpending)
+	struct iovec* iov = output.iov;
+	int cnt = output.cnt;
+
+	while (cnt)
 	{
-		const ssize_t written = write(STDOUT_FILENO, buf, *outpending);
+		ssize_t written = writev(STDOUT_FILENO, iov, cnt);
 		if (written == -1)
 		{
-			switch (errno)
+			if (errno == EINTR)
+				continue;
+			err(EXIT_FAILURE, _("Failed to write to stdout"));
+		}
+
+		while (cnt && (size_t)written >= iov->iov_len)
+		{
+			written -= iov->iov_len;
+			++iov;
+			--cnt;
+		}
+		if (cnt)
+		{
+			iov->iov_base = (char*)iov->iov_base + written;
+			iov->iov_len -= written;
+		}
+	}
+
+	output.cnt = 0;
+	output.copied = 0;
+}
+
+/* Queues data for output, copying it unless it stays valid until the next flush. */
+static void
+output_add(const char* data, const size_t len, const bool stable)
+{
+	if (render)
+	{
+		vt_write(render, data, len);
+		return;
+	}
+
+	// Fast forwarding to --start
+	if (skip > 0)
+	{
+		if (catchup)
+			vt_write(catchup, data, len);
+		return;
+	}
+	if (!len)
+		return;
+
+	if (!stable && len > sizeof(output.copy) - output.copied)
+	{
+		output_flush();
+		if (len > sizeof(output.copy))
+		{
+			output.iov[output.cnt].iov_base = (void*)data;
+			output.iov[output.cnt++].iov_len = len;
+			output_flush();
+			return;
+		}
+	}
+
+	if (!stable)
+	{
+		memcpy(output.copy + output.copied, data, len);
+		data = output.copy + output.copied;
+		output.copied += len;
+	}
+
+	struct iovec* const last = output.cnt ? &output.iov[output.cnt - 1] : NULL;
+	if (last && (const char*)last->iov_base + last->iov_len == data)
+	{
+		last->iov_len += len;
+		return;
+	}
+
+	output.iov[output.cnt].iov_base = (void*)data;
+	output.iov[output.cnt++].iov_len = len;
+	if (output.cnt == sizeof(output.iov) / sizeof(output.iov[0]))
+		output_flush();
+}
+
+/*
+ * Delays are scheduled against absolute deadlines, the sum of all delays so
+ * far, instead of sleeping for each of them in turn. Time spent writing and
+ * oversleeping then doesn't add up over the session: whenever we're late the
+ * next deadline is simply closer, or already passed in which case we don't
+ * sleep at all.
+ */
+static struct schedule {
+	struct timespec deadline;
+	double          worst_lag;
+	double          total_lag;
+	unsigned long   deadlines;
+	unsigned long   late;
+} schedule;
+
+static double
+timespec_diff(const struct timespec* a, const struct timespec* b)
+{
+	return (a->tv_sec - b->tv_sec) + (a->tv_nsec - b->tv_nsec) / 1e9;
+}
+
+static void
+schedule_start(void)
+{
+	clock_gettime(CLOCK_MONOTONIC, &schedule.deadline);
+}
+
+static void
+schedule_wait(const double delay)
+{
+	const time_t sec = (time_t)delay;
+	schedule.deadline.tv_sec += sec;
+	schedule.deadline.tv_nsec += (long)((delay - sec) * 1e9);
+	if (schedule.deadline.tv_nsec >= 1000000000L)
+	{
+		schedule.deadline.tv_nsec -= 1000000000L;
+		++schedule.deadline.tv_sec;
+	}
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (timespec_diff(&schedule.deadline, &now) >= SCRIPT_MIN_DELAY)
+	{
+		// What's due before the deadline has to be shown before sleeping
+		output_flush();
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &schedule.deadline, NULL) == EINTR)
+			;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+	}
+
+	const double lag = timespec_diff(&now, &schedule.deadline);
+	++schedule.deadlines;
+	if (lag > 0)
+	{
+		schedule.total_lag += lag;
+		schedule.worst_lag = MAX(schedule.worst_lag, lag);
+		if (lag >= SCRIPT_MIN_DELAY)
+			++schedule.late;
+	}
+}
+
+/*
+ * With --render the recorded time only decides which screens get shown: at
+ * each of the requested times, the screen as it was then.
+ */
+static struct render_times {
+	double*       at;
+	size_t        count;
+	size_t        next;
+	double        elapsed;
+	bool          scrollback;
+} render_times;
+
+static void
+render_show(const double at)
+{
+	if (render_times.count)
+		printf("-- %.6f --\n", at);
+	vt_dump(render, stdout, render_times.scrollback);
+}
+
+static void
+render_delay(const double delay)
+{
+	render_times.elapsed += delay;
+	for (; render_times.next < render_times.count
+	    && render_times.at[render_times.next] < render_times.elapsed; ++render_times.next)
+		render_show(render_times.at[render_times.next]);
+
+	// With the last screen asked for shown, the rest of the typescript doesn't matter
+	if (render_times.count && render_times.next == render_times.count)
+	{
+		if (fflush(stdout) == EOF)
+			err(EXIT_FAILURE, _("Failed to write to stdout"));
+		exit(EXIT_SUCCESS);
+	}
+}
+
+static void
+render_finish(void)
+{
+	if (!render_times.count)
+		render_show(render_times.elapsed);
+	// Times past the end all show the last screen
+	for (; render_times.next < render_times.count; ++render_times.next)
+		render_show(render_times.at[render_times.next]);
+}
+
+static int
+cmp_double(const void* a, const void* b)
+{
+	const double x = *(const double*)a, y = *(const double*)b;
+	return (x > y) - (x < y);
+}
+
+/* Parses the comma separated times for --render. */
+static void
+render_parse(const char* s)
+{
+	for (const char* p = s; p; p = strchr(p, ','), p = p ? p + 1 : NULL)
+		++render_times.count;
+	render_times.at = calloc(render_times.count, sizeof(*render_times.at));
+	if (!render_times.at)
+		err(EXIT_FAILURE, NULL);
+
+	char* const times = strdup(s);
+	if (!times)
+		err(EXIT_FAILURE, NULL);
+	size_t i = 0;
+	for (char* p = strtok(times, ","); p; p = strtok(NULL, ","))
+		render_times.at[i++] = gettime(p);
+	if (i != render_times.count)
+		errx(EXIT_FAILURE, _("expected a time, but got '%s'"), s);
+	free(times);
+	qsort(render_times.at, render_times.count, sizeof(*render_times.at), cmp_double);
+}
+
+/* How far --render can jump ahead: to its first screen, when it has times and no scrollback. */
+static double
+render_start(void)
+{
+	if (render_times.scrollback || !render_times.count)
+		return 0;
+	return render_times.at[0];
+}
+
+/* Writes what the screen fast forwarding built up looks like, once playing starts. */
+static void
+catchup_show(void)
+{
+	if (!catchup)
+		return;
+	// Better to leave the screen alone than to clear it for what's only part of it
+	if (!catchup_seeded)
+	{
+		vt_free(catchup);
+		catchup = NULL;
+		return;
+	}
+
+	char* buf = NULL;
+	size_t len = 0;
+	FILE* const f = open_memstream(&buf, &len);
+	if (!f)
+		err(EXIT_FAILURE, NULL);
+	// Resizes got fast forwarded through as well
+	fprintf(f, "\x1B[8;%u;%ut", catchup->rows, catchup->cols);
+	vt_redraw(catchup, f);
+	if (fclose(f) == EOF)
+		err(EXIT_FAILURE, NULL);
+
+	output_add(buf, len, false);
+	output_flush();
+	free(buf);
+	vt_free(catchup);
+	catchup = NULL;
+}
+
+/*
+ * Takes a keyframe: the size of what redraws the screen in hexadecimal, a
+ * semicolon and that, zlib compressed and base64 encoded. The screen fast
+ * forwarding to --start builds up is redrawn with it, and the one --render
+ * jumped ahead with starts from it. Otherwise the screen is already there.
+ */
+static void
+keyframe(const char* payload, const size_t len)
+{
+	struct vt* const vt = skip > 0 ? catchup : render_keyframe ? render : NULL;
+	if (!vt)
+		return;
+
+	size_t size;
+	char* const raw = keyframe_decode(payload, len, &size);
+	if (!raw)
+		return;
+	vt_write(vt, raw, size);
+	if (vt == catchup)
+		catchup_seeded = true;
+	render_keyframe = false;
+	free(raw);
+}
+
+/*
+ * Waits for a recorded delay, unless we're still fast forwarding to --start.
+ * Delays shorter than --min-frame get added to the next one instead, so the
+ * output of all of them goes out at once, in a single write.
+ */
+static void
+replay_delay(double delay, const double divi)
+{
+	static double frame;
+
+	if (render)
+	{
+		render_delay(delay);
+		return;
+	}
+
+	// Following, the data shows up at its own pace already
+	if (follow_fd != -1)
+		return;
+
+	if (skip > 0)
+	{
+		skip -= delay;
+		if (skip >= 0)
+			return;
+		delay = -skip;
+		// Playing starts now, from the screen fast forwarding left behind
+		catchup_show();
+		schedule_start();
+	}
+
+	delay /= divi;
+	if (max_idle >= 0 && delay > max_idle)
+		delay = max_idle;
+
+	frame += delay;
+	if (frame < min_frame)
+		return;
+
+	schedule_wait(frame);
+	frame = 0;
+}
+
+/*
+ * Reads the typescript, inflating it when it's a series of gzip members as
+ * written by script -z. Uncompressed regular files get mapped instead, for
+ * emit() to scan them in place.
+ */
+struct input {
+	int           fd;
+	const char*   name;
+	bool          gzip;
+	bool          eof;
+	z_stream      z;
+	size_t        consumed;   /* Bytes of (uncompressed) typescript returned */
+	off_t         offset;     /* Of the end of buf in the file */
+	size_t        pos, len;   /* Unconsumed part of buf */
+	unsigned char* buf;       /* Either storage or the mapped file */
+	size_t        mapped;     /* Size of the mapping, if any */
+	unsigned char storage[65536];
+};
+
+/*
+ * With --follow, reaching the end of the typescript means waiting for it to
+ * grow. Returns false once there's nothing left to wait for: the writer
+ * closed it, or it got deleted or renamed.
+ */
+static bool
+follow_wait(void)
+{
+	if (follow_fd == -1 || follow_closed)
+		return false;
+
+	// Show what we have before waiting
+	output_flush();
+
+	char events[4096] __attribute__((__aligned__(__alignof__(struct inotify_event))));
+	ssize_t len;
+	while ((len = read(follow_fd, events, sizeof(events))) == -1 && errno == EINTR)
+		;
+	if (len <= 0)
+		err(EXIT_FAILURE, _("failed to wait for the typescript to grow"));
+
+	// Whatever got written before closing is still to be read
+	for (const char* p = events; p < events + len;)
+	{
+		const struct inotify_event* const ev = (const struct inotify_event*)p;
+		if (ev->mask & (IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF))
+			follow_closed = true;
+		p += sizeof(*ev) + ev->len;
+	}
+	return true;
+}
+
+static ssize_t
+input_fill(struct input* in)
+{
+	if (in->pos)
+	{
+		memmove(in->buf, in->buf + in->pos, in->len - in->pos);
+		in->len -= in->pos;
+		in->pos = 0;
+	}
+
+	ssize_t ret;
+	while (((ret = read(in->fd, in->buf + in->len, sizeof(in->storage) - in->len)) == -1 && errno == EINTR)
+	    || (ret == 0 && follow_wait()))
+		;
+	if (ret == 0)
+		in->eof = true;
+	else if (ret > 0)
+	{
+		in->len += ret;
+		in->offset += ret;
+	}
+	return ret;
+}
+
+static void
+input_open(struct input* in, const int fd, const char* name)
+{
+	in->fd = fd;
+	in->name = name;
+	in->eof = false;
+	in->consumed = in->pos = in->len = 0;
+	in->offset = lseek(fd, 0, SEEK_CUR);
+	if (in->offset == (off_t)-1)
+		in->offset = 0;
+	in->buf = in->storage;
+	in->mapped = 0;
+
+	// A mapping wouldn't grow along with a typescript we follow
+	struct stat st;
+	if (follow_fd == -1 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > in->offset
+	 && (size_t)st.st_size == st.st_size)
+	{
+		unsigned char* const map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map != MAP_FAILED)
+		{
+			if (st.st_size - in->offset < 2 || map[in->offset] != 0x1f || map[in->offset + 1] != 0x8b)
 			{
-				case EINTR:
-					continue;
-				default:
-					err(EXIT_FAILURE, _("Failed to write to stdout"));
+				madvise(map, st.st_size, MADV_SEQUENTIAL);
+				in->buf = map;
+				in->mapped = st.st_size;
+				in->pos = in->offset;
+				in->len = in->offset = st.st_size;
+				in->eof = true;
+				in->gzip = false;
+				return;
 			}
+			munmap(map, st.st_size);
+		}
+	}
+
+	while (in->len < 2 && !in->eof)
+		if (input_fill(in) == -1)
+			err(EXIT_FAILURE, _("Failed to read from %s"), name);
+
+	in->gzip = in->len >= 2 && in->buf[0] == 0x1f && in->buf[1] == 0x8b;
+	if (in->gzip)
+	{
+		memset(&in->z, 0, sizeof(in->z));
+		if (inflateInit2(&in->z, 15 + 16) != Z_OK)
+			errx(EXIT_FAILURE, _("%s: failed to initialize decompression"), name);
+	}
+}
+
+static ssize_t
+input_read(struct input* in, void* dst, const size_t len)
+{
+	ssize_t ret;
+
+	if (!in->gzip)
+	{
+		if (in->pos < in->len)
+		{
+			ret = MIN(len, in->len - in->pos);
+			memcpy(dst, in->buf + in->pos, ret);
+			in->pos += ret;
+		}
+		else if (in->mapped)
+		{
+			ret = 0;
+		}
+		else
+		{
+			while (((ret = read(in->fd, dst, len)) == -1 && errno == EINTR)
+			    || (ret == 0 && len && follow_wait()))
+				;
+			if (ret > 0)
+				in->offset += ret;
 		}
 
-		*outpending -= written;
-		memmove(buf, buf + written, *outpending + processing);
+		if (ret > 0)
+			in->consumed += ret;
+		return ret;
+	}
+
+	for (;;)
+	{
+		if (in->pos == in->len && !in->eof
+		 && input_fill(in) == -1)
+			return -1;
+
+		in->z.next_in = in->buf + in->pos;
+		in->z.avail_in = in->len - in->pos;
+		in->z.next_out = dst;
+		in->z.avail_out = len;
+		const int zret = inflate(&in->z, Z_NO_FLUSH);
+		in->pos = in->len - in->z.avail_in;
+		ret = len - in->z.avail_out;
+
+		if (zret == Z_STREAM_END)
+		{
+			// Every member is a gzip stream of its own
+			inflateReset(&in->z);
+		}
+		else if (zret != Z_OK
+		      && zret != Z_BUF_ERROR)
+		{
+			errx(EXIT_FAILURE, _("%s: corrupt compressed data"), in->name);
+		}
+
+		in->consumed += ret;
+		if (ret)
+			return ret;
+
+		// An incomplete last member is what a crash leaves behind, play what we have
+		if (in->eof && in->pos == in->len)
+			return 0;
 	}
 }
 
 static void
-emit(const int fd, const char *const filename, size_t ct, const double divi)
+input_close(struct input* in)
 {
-	bool eof = false;
+	if (in->gzip)
+		inflateEnd(&in->z);
+	if (in->mapped)
+		munmap(in->buf, in->mapped);
+}
 
-	char buf[65536];
-	size_t inpending = 0;
-	size_t outpending = 0;
+/* Skips past the end of the current line, returns 0 on EOF and -1 on errors. */
+static int
+input_skip_line(struct input* in)
+{
+	if (in->gzip)
+	{
+		char c;
+		ssize_t ret;
+		while ((ret = input_read(in, &c, sizeof(c))) == sizeof(c) && c != '\n')
+			;
+		return ret;
+	}
 
-	char apc_delay_buf[65536];
-	size_t apc_delay_len = 0;
-	int apc_delay_state = 0;
-	while (ct || inpending || outpending)
+	for (;;)
 	{
-		const size_t to_read = MIN(ct, sizeof(buf) - inpending - outpending);
-		const ssize_t ret = eof ? 0 : read(fd, buf, to_read);
-		if (ret == -1)
-			err(EXIT_FAILURE, _("Unexpected error while reading %s"), filename);
-		else if (ret == 0)
-			eof = true;
-		inpending += ret;
-		if (ct != (size_t)-1)
-			ct -= ret;
+		if (in->pos == in->len)
+		{
+			if (in->eof)
+				return 0;
+			const ssize_t ret = input_fill(in);
+			if (ret <= 0)
+				return ret;
+		}
+
+		const unsigned char* const nl = memchr(in->buf + in->pos, '\n', in->len - in->pos);
+		const size_t skipped = nl ? (size_t)(nl + 1 - (in->buf + in->pos)) : in->len - in->pos;
+		in->pos += skipped;
+		in->consumed += skipped;
+		if (nl)
+			return 1;
+	}
+}
+
+/* The file offset of the next byte to read, of a compressed typescript only valid between members. */
+static off_t
+input_tell(const struct input* in)
+{
+	return in->offset - (in->len - in->pos);
+}
 
-		if (outpending + inpending == 0
-		 && !ret)
+/* Whether input_tell() can be used to resume reading at the current position. */
+static bool
+input_boundary(const struct input* in)
+{
+	return !in->gzip || in->z.total_in == 0;
+}
+
+static bool
+index_record(const int fd, const off_t pos, long long* elapsed, off_t* offset)
+{
+	char rec[INDEX_RECORD_SIZE + 1];
+	long long sec, usec, off;
+
+	if (pread(fd, rec, INDEX_RECORD_SIZE, pos * INDEX_RECORD_SIZE) != INDEX_RECORD_SIZE)
+		return false;
+	rec[INDEX_RECORD_SIZE] = '\0';
+	if (sscanf(rec, "%lld.%lld %lld", &sec, &usec, &off) != 3)
+		return false;
+
+	*elapsed = sec * 1000000 + usec;
+	*offset = off;
+	return true;
+}
+
+static void
+index_write(FILE* idx, const long long elapsed, const off_t offset)
+{
+	fprintf(idx, INDEX_RECORD_FMT, elapsed / 1000000, elapsed % 1000000, (long long)offset);
+}
+
+/*
+ * Scans a typescript for its delay commands to index it like script would
+ * have. Index points are put at delay commands, or between the members of a
+ * compressed typescript, as only there decompression can start. Commands are
+ * told apart by apc_match(), like emit() does, holding on to one split across
+ * reads until the rest of it is read.
+ */
+static void
+index_build(FILE* idx, const int fd, const char* name)
+{
+	struct input in;
+	char* buf = NULL;
+	size_t size = 0, len = 0;
+	bool keyframes = false;	/* Once there are any, index points go there only */
+	long long elapsed = 0, last = 0;
+	off_t last_offset = 0;
+
+	input_open(&in, fd, name);
+	for (;;)
+	{
+		if (len == size)
+		{
+			char* const grown = realloc(buf, size ? size * 2 : 65536);
+			if (!grown)
+				err(EXIT_FAILURE, NULL);
+			buf = grown;
+			size = size ? size * 2 : 65536;
+		}
+
+		const bool boundary = input_boundary(&in);
+		const off_t pos = input_tell(&in);
+		const ssize_t ret = input_read(&in, buf + len, size - len);
+		if (ret == -1)
+			err(EXIT_FAILURE, _("Failed to read from %s"), name);
+		if (ret == 0)
 			break;
 
-		while (inpending)
+		if (in.gzip && boundary && !len && pos
+		 && (elapsed - last >= INDEX_INTERVAL || pos - last_offset >= INDEX_SIZE))
 		{
-			--inpending;
-			const char c = buf[outpending + apc_delay_state + apc_delay_len];
+			index_write(idx, elapsed, pos);
+			last = elapsed;
+			last_offset = pos;
+		}
 
-			if     ((c == 0x1B && apc_delay_state == 0) /* | APC sequence */
-			     || (c == '_'  && apc_delay_state == 1) /* |              */
-			     || (c == 'D'  && apc_delay_state == 2)
-			     || (c == ';'  && apc_delay_state == 3))
-			{
-				++apc_delay_state;
-			}
-			else if (c != 0x1B && apc_delay_state == 4)
+		// Where buf starts in an uncompressed typescript
+		const off_t base = pos - len;
+		size_t at = 0;
+		len += ret;
+		while (at < len)
+		{
+			const char* const esc = memchr(buf + at, 0x1B, len - at);
+			if (!esc)
 			{
-				apc_delay_buf[apc_delay_len++] = c; // Actual APC delay-command content
+				at = len;
+				break;
 			}
-			else if (c == 0x1B && apc_delay_state == 4) /* | ST sequence  */
+
+			char type;
+			const char* payload;
+			size_t payload_len;
+			at = esc - buf;
+			const size_t n = apc_match(esc, len - at, &type, &payload, &payload_len);
+			if (!n)
+				break;
+
+			const off_t marker = base + at;
+			double delay;
+			if (type == 'K')
 			{
-				++apc_delay_state;
+				// Keyframes come far enough apart to all be index points
+				if (!in.gzip && marker)
+					index_write(idx, elapsed, marker);
+				keyframes = true;
 			}
-			else if (c == '\\' && apc_delay_state == 5) /* |              */
+			else if (type && delay_parse(payload, payload_len, type == 'd', &delay))
 			{
-				/* Properly formed APC delay-command, process it. */
-				apc_delay_buf[apc_delay_len++] = '\0';
-				char* end;
-				double delay = strtod(apc_delay_buf, &end);
-				if (&apc_delay_buf[apc_delay_len-1] == end)
+				if (!in.gzip && marker && !keyframes
+				 && (elapsed - last >= INDEX_INTERVAL || marker - last_offset >= INDEX_SIZE))
 				{
-					bufflush(buf, &outpending, apc_delay_state + apc_delay_len + inpending);
-					delay_for(delay / divi);
-					// Remove APC delay-command from buffer
-					memmove(buf, buf + apc_delay_state + apc_delay_len, inpending);
+					index_write(idx, elapsed, marker);
+					last = elapsed;
+					last_offset = marker;
 				}
-				else
-				{
-					outpending += apc_delay_state + apc_delay_len;
-				}
-				apc_delay_len = 0;
-				apc_delay_state = 0;
+				elapsed += (long long)(delay * 1e6 + 0.5);
+			}
+			at += n;
+		}
+		len -= at;
+		memmove(buf, buf + at, len);
+	}
+
+	// Like script, the last index point marks the end
+	index_write(idx, elapsed, input_tell(&in));
+	input_close(&in);
+	free(buf);
+}
+
+/* Whether a keyframe starts at offset, in an uncompressed typescript. */
+static bool
+keyframe_at(const int fd, const off_t offset)
+{
+	char buf[sizeof(KEYFRAME_PREFIX) - 1];
+	return pread(fd, buf, sizeof(buf), offset) == sizeof(buf) && !memcmp(buf, KEYFRAME_PREFIX, sizeof(buf));
+}
+
+/*
+ * Looks up the last index point at or before start in the typescript's
+ * index, or with keyframe the last one that's also a keyframe, building the
+ * index first when it's missing or doesn't match. With keep, a newly built
+ * index is kept for the next time. Returns false when playing has to start
+ * at the beginning.
+ */
+static bool
+index_find(const char* name, const double start, const bool keyframe, const bool keep, long long* elapsed, off_t* offset)
+{
+	char path[PATH_MAX];
+	struct stat st;
+	long long t;
+	off_t off;
+
+	const int fd = open(name, O_RDONLY);
+	if (fd == -1 || fstat(fd, &st) == -1 || !S_ISREG(st.st_mode))
+	{
+		if (fd != -1)
+			close(fd);
+		return false;
+	}
+
+	snprintf(path, sizeof(path), "%s.idx", name);
+	int ifd = open(path, O_RDONLY);
+	off_t records = 0;
+	if (ifd != -1)
+	{
+		const off_t size = lseek(ifd, 0, SEEK_END);
+		records = size > 0 && size % INDEX_RECORD_SIZE == 0 ? size / INDEX_RECORD_SIZE : 0;
+		if (!records
+		 || !index_record(ifd, records - 1, &t, &off)
+		 || off > st.st_size)
+		{
+			close(ifd);
+			ifd = -1;
+		}
+	}
+
+	if (ifd == -1)
+	{
+		// Keep it for the next time, if we're allowed to
+		char tmp[PATH_MAX + sizeof(".tmp")];
+		snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+		FILE* idx = keep ? fopen(tmp, "w+") : NULL;
+		const bool kept = idx;
+		if (!idx)
+			idx = tmpfile();
+		if (!idx)
+			err(EXIT_FAILURE, _("cannot create index for %s"), name);
+
+		index_build(idx, fd, name);
+		if (fflush(idx) == EOF)
+			err(EXIT_FAILURE, _("cannot write index for %s"), name);
+		if (kept && rename(tmp, path) == -1)
+			unlink(tmp);
+
+		ifd = dup(fileno(idx));
+		fclose(idx);
+		records = lseek(ifd, 0, SEEK_END) / INDEX_RECORD_SIZE;
+	}
+
+	// Binary search for the last index point that's not past start
+	const long long target = (long long)(start * 1e6 + 0.5);
+	off_t lo = 0, hi = records;
+	while (lo < hi)
+	{
+		const off_t mid = lo + (hi - lo) / 2;
+		if (!index_record(ifd, mid, &t, &off))
+			errx(EXIT_FAILURE, _("%s: corrupt index"), path);
+		if (t <= target)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	// Rendering needs a keyframe to start from, which may be further back
+	bool found = false;
+	while (!found && lo-- > 0 && index_record(ifd, lo, elapsed, offset) && *offset)
+		found = !keyframe || keyframe_at(fd, *offset);
+	close(ifd);
+	close(fd);
+	return found;
+}
+
+static uint64_t
+le64(const unsigned char* p)
+{
+	uint64_t v = 0;
+	for (int i = 7; i >= 0; --i)
+		v = v << 8 | p[i];
+	return v;
+}
+
+/*
+ * Reads the next entry of the timing file: a "<seconds> <bytes>" line or,
+ * when binary, a record of the delay in nanoseconds and the amount of bytes.
+ * Returns 1 on success, 0 at the end of the file and -1 when malformed.
+ */
+static int
+timing_read(FILE* f, const bool binary, double* delay, size_t* blk)
+{
+	if (binary)
+	{
+		unsigned char rec[TIMING_RECORD_SIZE];
+		do
+		{
+			// A truncated last record is what a crash leaves behind
+			if (fread(rec, 1, sizeof(rec), f) != sizeof(rec))
+				return ferror(f) ? -1 : 0;
+		} while (!memcmp(rec, TIMING_MAGIC, sizeof(rec))); // Sessions appended with script -a
+		*delay = le64(rec) / 1e9;
+		*blk = le64(rec + 8);
+		return 1;
+	}
+
+	char buf[128];
+	do
+	{
+		if (!fgets(buf, sizeof(buf), f))
+			return ferror(f) ? -1 : 0;
+	} while (*buf == '\n');
+
+	char *end, *p;
+	*delay = strtod(buf, &end);
+	if (end == buf)
+		return -1;
+	p = end;
+	*blk = strtoull(p, &end, 10);
+	if (end == p)
+		return -1;
+	while (*end == ' ' || *end == '\n')
+		++end;
+	return *end ? -1 : 1;
+}
+
+/* Carries out a matched APC command, returns false when it's malformed and goes out as-is instead. */
+static bool
+apc_run(const char type, const char* payload, const size_t len, const double divi)
+{
+	if (type == 'K')
+	{
+		keyframe(payload, len);
+		return true;
+	}
+
+	double delay;
+	if (!delay_parse(payload, len, type == 'd', &delay))
+		return false;
+	replay_delay(delay, divi);
+	return true;
+}
+
+/* emit() for mapped typescripts, jumping from ESC to ESC and writing straight from the mapping. */
+static void
+emit_mapped(struct input* in, const size_t ct, const double divi)
+{
+	const char* const data = (const char*)in->buf;
+	const size_t start = in->pos,
+	             end = ct > in->len - start ? in->len : start + ct;
+	size_t out = start, pos = start;
+
+	while (pos < end)
+	{
+		const char* const esc = memchr(data + pos, 0x1B, end - pos);
+		if (!esc)
+			break;
+
+		char type;
+		const char* payload;
+		size_t payload_len;
+		pos = esc - data;
+		size_t len = apc_match(esc, end - pos, &type, &payload, &payload_len);
+		if (!len)
+		{
+			// Cut off, so it's no command of ours
+			len = end - pos;
+		}
+		else if (type)
+		{
+			output_add(data + out, pos - out, true);
+			out = apc_run(type, payload, payload_len, divi) ? pos + len : pos;
+		}
+		pos += len;
+	}
+	output_add(data + out, end - out, true);
+
+	in->pos = end;
+	in->consumed += end - start;
+	if (ct != (size_t)-1 && end - start < ct)
+		errx(EXIT_FAILURE, _("unexpected end of file on %s (%zu, 0, 0)"), in->name, ct - (end - start));
+}
+
+/*
+ * Writes ct bytes of typescript, or all of it when ct is (size_t)-1, carrying
+ * out the APC commands in it. A command split across reads is held on to
+ * until the rest of it is read, growing the buffer for large keyframes.
+ */
+static void
+emit(struct input* in, size_t ct, const double divi)
+{
+	if (in->mapped)
+	{
+		emit_mapped(in, ct, divi);
+		return;
+	}
+	if (!ct)
+		return;
+
+	static char* buf;
+	static size_t size;
+	size_t len = 0;
+	bool last = false;
+
+	while (!last)
+	{
+		if (len == size)
+		{
+			char* const grown = realloc(buf, size ? size * 2 : 65536);
+			if (!grown)
+				err(EXIT_FAILURE, NULL);
+			buf = grown;
+			size = size ? size * 2 : 65536;
+		}
+
+		const ssize_t ret = input_read(in, buf + len, MIN(ct, size - len));
+		if (ret == -1)
+			err(EXIT_FAILURE, _("Unexpected error while reading %s"), in->name);
+		len += ret;
+		if (ct != (size_t)-1)
+			ct -= ret;
+		last = !ret || !ct;
+
+		size_t out = 0, pos = 0;
+		while (pos < len)
+		{
+			const char* const esc = memchr(buf + pos, 0x1B, len - pos);
+			if (!esc)
+			{
+				pos = len;
+				break;
 			}
-			else if (!apc_delay_state && !apc_delay_len)
+
+			char type;
+			const char* payload;
+			size_t payload_len;
+			pos = esc - buf;
+			size_t n = apc_match(esc, len - pos, &type, &payload, &payload_len);
+			if (!n)
 			{
-				++outpending;
+				// Wait for the rest, unless there's no more
+				if (!last)
+					break;
+				n = len - pos;
 			}
-			else
+			else if (type)
 			{
-				outpending += apc_delay_state + apc_delay_len + 1;
-				apc_delay_len = 0;
-				apc_delay_state = 0;
+				output_add(buf + out, pos - out, false);
+				out = apc_run(type, payload, payload_len, divi) ? pos + n : pos;
 			}
+			pos += n;
 		}
+		output_add(buf + out, pos - out, false);
+		len -= pos;
+		memmove(buf, buf + pos, len);
+	}
 
-		if ((outpending + inpending) >= (sizeof(buf) - sizeof("18446744073709551615.999999"))
-		 || !inpending)
-			bufflush(buf, &outpending, apc_delay_state + apc_delay_len + inpending);
+	if (ct && ct != (size_t)-1)
+		errx(EXIT_FAILURE, _("unexpected end of file on %s (%zu, 0, 0)"), in->name, ct);
+}
+
+/* A part of a typescript, as split up by script --rotate-interval/--rotate-size */
+struct segment {
+	const char* path;
+	unsigned    number;
+	double      start;  /* Elapsed time at which it starts */
+	bool        keyframe;  /* Right after the header, for fast forwarding to start from */
+};
+
+/* Reads the header line of a segment, returns false when it doesn't look like one. */
+static bool
+segment_header(struct segment* seg)
+{
+	char line[256];
+	size_t len = 0;
+	char c = '\0';
+	long long sec, usec;
+
+	const int fd = open(seg->path, O_RDONLY);
+	if (fd == -1)
+		err(EXIT_FAILURE, _("cannot open typescript %s"), seg->path);
+
+	struct input in;
+	input_open(&in, fd, seg->path);
+	while (len < sizeof(line) - 1 && input_read(&in, &c, sizeof(c)) == sizeof(c) && c != '\n')
+		line[len++] = c;
+	line[len] = '\0';
+	char prefix[sizeof(KEYFRAME_PREFIX) - 1];
+	seg->keyframe = c == '\n' && input_read(&in, prefix, sizeof(prefix)) == sizeof(prefix)
+	             && !memcmp(prefix, KEYFRAME_PREFIX, sizeof(prefix));
+	input_close(&in);
+	close(fd);
+
+	// The first segment is a typescript like any other
+	if (!strncmp(line, "Script started", sizeof("Script started") - 1))
+	{
+		seg->number = 0;
+		seg->start = 0;
+		return true;
 	}
 
-	if (!ct || ct == (size_t)-1)
-		return;
-	if (eof)
-		errx(EXIT_FAILURE, _("unexpected end of file on %s (%zu, %zu, %zu)"), filename, ct, outpending, inpending);
+	const char* const p = strstr(line, ", segment ");
+	if (!p || sscanf(p, ", segment %u at %lld.%lld", &seg->number, &sec, &usec) != 3)
+		return false;
+	seg->start = sec + usec / 1e6;
+	return true;
+}
+
+static int
+segment_cmp(const void* a, const void* b)
+{
+	const struct segment *x = a, *y = b;
+	return (x->number > y->number) - (x->number < y->number);
+}
+
+/*
+ * Plays the segments given by paths or glob patterns back to back, in the
+ * order given by their headers, starting with the one containing --start.
+ * Fast forwarding to it starts from the last segment with a keyframe to
+ * start from before then, or from the first one.
+ */
+static void
+play_segments(char** patterns, const int count, const double divi, const double start)
+{
+	glob_t g;
+	int flags = GLOB_NOCHECK;
+
+	for (int i = 0; i < count; ++i, flags |= GLOB_APPEND)
+		if (glob(patterns[i], flags, NULL, &g) != 0)
+			errx(EXIT_FAILURE, _("cannot expand %s"), patterns[i]);
+
+	struct segment* const segs = calloc(g.gl_pathc, sizeof(*segs));
+	if (!segs)
+		err(EXIT_FAILURE, NULL);
+	size_t n = 0;
+	for (size_t i = 0; i < g.gl_pathc; ++i)
+	{
+		// Patterns like typescript* match the segments' indexes too
+		const size_t len = strlen(g.gl_pathv[i]);
+		if (len > 4 && !strcmp(g.gl_pathv[i] + len - 4, ".idx"))
+			continue;
+
+		segs[n].path = g.gl_pathv[i];
+		if (!segment_header(&segs[n]))
+			errx(EXIT_FAILURE, _("%s: not a typescript segment"), segs[n].path);
+		++n;
+	}
+	if (!n)
+		errx(EXIT_FAILURE, _("no typescript segments given"));
+	qsort(segs, n, sizeof(*segs), segment_cmp);
+
+	size_t first = 0;
+	for (size_t i = 1; i < n; ++i)
+		if (segs[i].start <= start)
+			first = i;
+	while (first && !segs[first].keyframe)
+		--first;
+	skip = start - segs[first].start;
+	catchup_seeded = !first;
+
+	schedule_start();
+	for (size_t i = first; i < n; ++i)
+	{
+		const int fd = open(segs[i].path, O_RDONLY);
+		if (fd == -1)
+			err(EXIT_FAILURE, _("cannot open typescript %s"), segs[i].path);
+
+		struct input in;
+		input_open(&in, fd, segs[i].path);
+		if (input_skip_line(&in) == -1)
+			err(EXIT_FAILURE, _("Failed to read from %s"), segs[i].path);
+		emit(&in, (size_t)-1, divi);
+		// Output may still point into the mapping
+		output_flush();
+		input_close(&in);
+		close(fd);
+	}
 
-	err(EXIT_FAILURE, _("failed to read typescript file %s"), filename);
+	free(segs);
+	globfree(&g);
 }
 
+/* Shows a session shared by script --share as it happens. */
+static void
+attach(const char* path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	if (strlen(path) >= sizeof(addr.sun_path))
+		errx(EXIT_FAILURE, _("%s: socket path too long"), path);
+	strcpy(addr.sun_path, path);
+
+	const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd == -1 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1)
+		err(EXIT_FAILURE, _("cannot attach to %s"), path);
+
+	// There's nothing to schedule, whatever arrives is written out right away
+	char buf[65536];
+	for (;;)
+	{
+		const ssize_t len = read(fd, buf, sizeof(buf));
+		if (len == -1 && errno == EINTR)
+			continue;
+		if (len == -1)
+			err(EXIT_FAILURE, _("Failed to read from %s"), path);
+		if (len == 0)
+			break;
+		output_add(buf, len, true);
+		output_flush();
+	}
+	close(fd);
+}
 
 int
 main(int argc, char *argv[])
@@ -249,6 +1318,30 @@ main(int argc, char *argv[])
 	int c;
 	unsigned long line;
 	size_t oldblk = 0;
+	double start = 0;
+	bool stats = false;
+	bool segments = false;
+	double divisor = 0;
+	const char* attach_socket = NULL;
+	bool follow = false;
+	bool rendering = false;
+	unsigned long scrollback = 0;
+	struct vt screen, catchup_screen;
+	enum { OPT_START = CHAR_MAX + 1, OPT_STATS, OPT_MAX_IDLE, OPT_MIN_FRAME, OPT_SEGMENTS, OPT_DIVISOR, OPT_ATTACH, OPT_FOLLOW,
+	       OPT_RENDER, OPT_SCROLLBACK };
+	static const struct option longopts[] = {
+		{ "start", required_argument, NULL, OPT_START },
+		{ "stats", no_argument,       NULL, OPT_STATS },
+		{ "max-idle", required_argument, NULL, OPT_MAX_IDLE },
+		{ "min-frame", required_argument, NULL, OPT_MIN_FRAME },
+		{ "segments", no_argument,    NULL, OPT_SEGMENTS },
+		{ "divisor", required_argument, NULL, OPT_DIVISOR },
+		{ "attach", required_argument, NULL, OPT_ATTACH },
+		{ "follow", no_argument,       NULL, OPT_FOLLOW },
+		{ "render", optional_argument, NULL, OPT_RENDER },
+		{ "scrollback", required_argument, NULL, OPT_SCROLLBACK },
+		{ NULL,    0,                 NULL, 0 }
+	};
 
 	program_invocation_short_name = argv[0];
 
@@ -259,6 +1352,121 @@ main(int argc, char *argv[])
 	setlocale(LC_ALL, "");
 	setlocale(LC_NUMERIC, "C");
 
+	while ((c = getopt_long(argc, argv, "", longopts, NULL)) != -1)
+		switch (c)
+		{
+			case OPT_START:
+				start = gettime(optarg);
+				break;
+			case OPT_STATS:
+				stats = true;
+				break;
+			case OPT_MAX_IDLE:
+				max_idle = gettime(optarg);
+				break;
+			case OPT_MIN_FRAME:
+				min_frame = gettime(optarg);
+				break;
+			case OPT_SEGMENTS:
+				segments = true;
+				break;
+			case OPT_DIVISOR:
+				divisor = getnum(optarg);
+				break;
+			case OPT_ATTACH:
+				attach_socket = optarg;
+				break;
+			case OPT_FOLLOW:
+				follow = true;
+				break;
+			case OPT_RENDER:
+				rendering = true;
+				if (optarg)
+					render_parse(optarg);
+				break;
+			case OPT_SCROLLBACK:
+				scrollback = getnum(optarg);
+				render_times.scrollback = true;
+				break;
+			default:
+				usage(EXIT_FAILURE);
+		}
+	// Leave the positional arguments where they've always been
+	argv[optind - 1] = argv[0];
+	argv += optind - 1;
+	argc -= optind - 1;
+
+	if (rendering)
+	{
+		// There's no point in any of those without a terminal
+		if (attach_socket || follow || start || stats || max_idle >= 0 || min_frame)
+			usage(EXIT_FAILURE);
+		if (!vt_init(&screen, RENDER_ROWS, RENDER_COLS, scrollback))
+			err(EXIT_FAILURE, NULL);
+		render = &screen;
+	}
+	else if (render_times.scrollback)
+	{
+		usage(EXIT_FAILURE);
+	}
+
+	if (attach_socket)
+	{
+		if (argc > 1 || segments)
+			usage(EXIT_FAILURE);
+		tfile = NULL;
+		attach(attach_socket);
+		goto done;
+	}
+
+	if (follow)
+	{
+		if (argc != 2 || segments || start)
+			usage(EXIT_FAILURE);
+		tfile = NULL;
+		sname = argv[1];
+
+		follow_fd = inotify_init1(IN_CLOEXEC);
+		if (follow_fd == -1 || inotify_add_watch(follow_fd, sname, IN_MODIFY | IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF) == -1)
+			err(EXIT_FAILURE, _("cannot watch typescript %s"), sname);
+		const int fd = open(sname, O_RDONLY);
+		if (fd == -1)
+			err(EXIT_FAILURE, _("cannot open typescript %s"), sname);
+
+		// What's there already is caught up with at once, after that output follows as it's recorded
+		struct input in;
+		input_open(&in, fd, sname);
+		if (input_skip_line(&in) == -1)
+			err(EXIT_FAILURE, _("Failed to read from %s"), sname);
+		emit(&in, (size_t)-1, 1);
+		input_close(&in);
+		close(fd);
+		goto done;
+	}
+
+	// What gets fast forwarded through is kept track of, to start playing from the same screen
+	if (start > 0 && !render)
+	{
+		struct winsize win;
+		if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &win) == -1 || !win.ws_row || !win.ws_col)
+		{
+			win.ws_row = RENDER_ROWS;
+			win.ws_col = RENDER_COLS;
+		}
+		if (!vt_init(&catchup_screen, win.ws_row, win.ws_col, 0))
+			err(EXIT_FAILURE, NULL);
+		catchup = &catchup_screen;
+	}
+
+	if (segments)
+	{
+		if (argc < 2)
+			usage(EXIT_FAILURE);
+		tfile = NULL;
+		play_segments(argv + 1, argc - 1, divisor ? divisor : 1, start);
+		goto done;
+	}
+
 	if (argc > 4)
 		usage(EXIT_FAILURE);
 	if (argc < 2
@@ -304,23 +1512,67 @@ main(int argc, char *argv[])
 		}
 	}
 
+	// Jump straight to the index point closest to start, instead of fast forwarding all the way
+	long long elapsed = 0;
+	off_t offset;
+	bool seek = false;
+	skip = start;
+	const double target = render ? render_start() : start;
+	// A screen to catch up from needs a keyframe to start from, just like --render
+	if (target > 0 && !tfile && oldblk && index_find(sname, target, render || catchup, !render, &elapsed, &offset))
+		seek = lseek(sfile, offset, SEEK_SET) != (off_t)-1;
+	catchup_seeded = !seek;
+
+	struct input in;
+	input_open(&in, sfile, sname);
+	if (seek)
+	{
+		if (render)
+		{
+			render_keyframe = true;
+			render_times.elapsed = elapsed / 1e6;
+		}
+		else
+		{
+			skip = start - elapsed / 1e6;
+		}
+		goto play;
+	}
+
+	/* the file's size says nothing about the amount of typescript in it */
+	if (in.gzip && oldblk)
+		oldblk = (size_t)-1;
+
 	/* ignore the first typescript line */
-	char ci;
-	while ((c = read(sfile, &ci, sizeof(ci))) == sizeof(ci) && ci != '\n')
-		;
-	if (c == -1)
+	if (input_skip_line(&in) == -1)
 		err(EXIT_FAILURE, _("Failed to read from %s"), sname);
 
 	if (oldblk && oldblk != (size_t)-1)
-		oldblk -= lseek(sfile, 0, SEEK_CUR);
+		oldblk -= in.consumed;
+
+play:
+	if (seek)
+		oldblk = (size_t)-1;
+
+	if (divisor)
+		divi = divisor;
+	schedule_start();
+
+	bool binary_timing = false;
+	if (tfile)
+	{
+		const int first = getc(tfile);
+		binary_timing = first == '\0';
+		ungetc(first, tfile);
+	}
 
 	for(line = 0; tfile || oldblk; line++) {
 		double delay = 0;
 		size_t blk = 0;
 
-		if (tfile
-		 && fscanf(tfile, "%lf %zu\n", &delay, &blk) != 2) {
-			if (feof(tfile))
+		const int ret = tfile ? timing_read(tfile, binary_timing, &delay, &blk) : 1;
+		if (ret != 1) {
+			if (ret == 0)
 				break;
 			if (ferror(tfile))
 				err(EXIT_FAILURE,
@@ -329,14 +1581,30 @@ main(int argc, char *argv[])
 				_("timings file %s: %lu: unexpected format"),
 				tname, line);
 		}
-		delay_for(delay / divi);
+		replay_delay(delay, divi);
 
 		if (oldblk)
-			emit(sfile, sname, oldblk, divi);
+			emit(&in, oldblk, divi);
 		oldblk = blk;
 	}
 
+done:
+	output_flush();
 	if (tfile)
 		fclose(tfile);
+	if (catchup)
+		vt_free(catchup);
+	if (render)
+	{
+		render_finish();
+		vt_free(render);
+		if (fflush(stdout) == EOF)
+			err(EXIT_FAILURE, _("Failed to write to stdout"));
+	}
+
+	if (stats)
+		fprintf(stderr, _("%lu delays, %lu late, lag: worst %.6f s, mean %.6f s\n"),
+			schedule.deadlines, schedule.late, schedule.worst_lag,
+			schedule.deadlines ? schedule.total_lag / schedule.deadlines : 0.);
 	exit(EXIT_SUCCESS);
 }
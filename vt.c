@@ -0,0 +1,1034 @@
+/*
+ * Headless terminal emulator, keeping the screen a typescript leaves behind.
+ *
+ * This file is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ *
+ * Understands what programs commonly send to an xterm-like terminal:
+ * cursor movement, erasing, inserting and deleting, scrolling regions, the
+ * alternate screen, SGR attributes and colors, and the ESC [ 8 ; rows ;
+ * cols t resizes script records. Strings (OSC, DCS, APC, PM and SOS) are
+ * consumed without effect. Every character takes a single column.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "vt.h"
+
+#define MAX(a,b) ((a) < (b) ? (b) : (a))
+#define MIN(a,b) ((a) < (b) ? (a) : (b))
+
+enum
+{
+	VT_GROUND,
+	VT_ESCAPE,
+	VT_CHARSET,	/* ESC ( and the like, which take one more byte */
+	VT_CSI,
+	VT_STRING,
+	VT_STRING_ESCAPE,
+};
+
+static struct vt_cell*
+vt_row(const struct vt* vt, const unsigned y)
+{
+	return vt->lines[vt->alt][y];
+}
+
+/* What erasing leaves behind: blanks in the current background color. */
+static struct vt_cell
+vt_blank(const struct vt* vt)
+{
+	const struct vt_cell blank = {
+		.ch = ' ',
+		.attr = vt->cursor.pen.attr & VT_BG,
+		.bg = vt->cursor.pen.bg,
+	};
+	return blank;
+}
+
+static void
+vt_clear(struct vt_cell* cells, const size_t len, const struct vt_cell blank)
+{
+	if (!len)
+		return;
+
+	// Doubling copies, which memcpy() does faster than a loop does cells
+	cells[0] = blank;
+	for (size_t done = 1; done < len; done *= 2)
+		memcpy(cells + done, cells, MIN(done, len - done) * sizeof(*cells));
+}
+
+static void
+vt_clear_lines(struct vt* vt, const unsigned y, const unsigned n)
+{
+	for (unsigned i = y; i < y + n; ++i)
+		vt_clear(vt_row(vt, i), vt->cols, vt_blank(vt));
+}
+
+static void
+vt_scrollback_push(struct vt* vt, const struct vt_cell* cells)
+{
+	if (!vt->scrollback_size)
+		return;
+
+	struct vt_line* line;
+	if (vt->scrollback_count < vt->scrollback_size)
+	{
+		line = &vt->scrollback[(vt->scrollback_first + vt->scrollback_count++) % vt->scrollback_size];
+	}
+	else
+	{
+		// Full, the oldest line makes room
+		line = &vt->scrollback[vt->scrollback_first];
+		vt->scrollback_first = (vt->scrollback_first + 1) % vt->scrollback_size;
+	}
+
+	if (line->len != vt->cols)
+	{
+		struct vt_cell* const resized = realloc(line->cells, vt->cols * sizeof(*line->cells));
+		if (!resized)
+		{
+			line->len = 0;
+			return;
+		}
+		line->cells = resized;
+		line->len = vt->cols;
+	}
+	memcpy(line->cells, cells, vt->cols * sizeof(*cells));
+}
+
+/*
+ * Scrolls lines top up to bottom up by n lines. When keep is set, lines
+ * scrolling off the whole of the main screen are kept in the scrollback.
+ */
+static void
+vt_scroll_up(struct vt* vt, const unsigned top, const unsigned bottom, unsigned n, const bool keep)
+{
+	n = MIN(n, bottom - top + 1);
+	if (keep && top == 0 && bottom == vt->rows - 1 && !vt->alt)
+		for (unsigned i = 0; i < n; ++i)
+			vt_scrollback_push(vt, vt_row(vt, i));
+
+	struct vt_cell** const lines = vt->lines[vt->alt];
+	if (n == 1)
+	{
+		// What every line of plain output does, spare it the copies
+		struct vt_cell* const gone = lines[top];
+		for (unsigned y = top; y < bottom; ++y)
+			lines[y] = lines[y + 1];
+		lines[bottom] = gone;
+	}
+	else
+	{
+		struct vt_cell* gone[n];
+		memcpy(gone, lines + top, sizeof(gone));
+		memmove(lines + top, lines + top + n, (bottom - top + 1 - n) * sizeof(*lines));
+		memcpy(lines + bottom + 1 - n, gone, sizeof(gone));
+	}
+	vt_clear_lines(vt, bottom + 1 - n, n);
+}
+
+static void
+vt_scroll_down(struct vt* vt, const unsigned top, const unsigned bottom, unsigned n)
+{
+	n = MIN(n, bottom - top + 1);
+	struct vt_cell** const lines = vt->lines[vt->alt];
+	struct vt_cell* gone[n];
+	memcpy(gone, lines + bottom + 1 - n, sizeof(gone));
+	memmove(lines + top + n, lines + top, (bottom - top + 1 - n) * sizeof(*lines));
+	memcpy(lines + top, gone, sizeof(gone));
+	vt_clear_lines(vt, top, n);
+}
+
+static void
+vt_linefeed(struct vt* vt)
+{
+	if (vt->cursor.y == vt->bottom)
+		vt_scroll_up(vt, vt->top, vt->bottom, 1, true);
+	else if (vt->cursor.y + 1 < vt->rows)
+		++vt->cursor.y;
+}
+
+static void
+vt_reverse_linefeed(struct vt* vt)
+{
+	if (vt->cursor.y == vt->top)
+		vt_scroll_down(vt, vt->top, vt->bottom, 1);
+	else if (vt->cursor.y)
+		--vt->cursor.y;
+}
+
+static void
+vt_goto(struct vt* vt, const long x, const long y)
+{
+	vt->cursor.x = MIN((unsigned long)MAX(x, 0), vt->cols - 1);
+	vt->cursor.y = MIN((unsigned long)MAX(y, 0), vt->rows - 1);
+	vt->wrap_pending = false;
+}
+
+static void
+vt_put(struct vt* vt, const uint32_t ch)
+{
+	if (vt->wrap_pending)
+	{
+		vt->cursor.x = 0;
+		vt_linefeed(vt);
+		vt->wrap_pending = false;
+	}
+
+	struct vt_cell* const cell = vt_row(vt, vt->cursor.y) + vt->cursor.x;
+	*cell = vt->cursor.pen;
+	cell->ch = ch;
+
+	if (vt->cursor.x + 1 < vt->cols)
+		++vt->cursor.x;
+	else
+		vt->wrap_pending = vt->autowrap;
+}
+
+static void
+vt_reset(struct vt* vt)
+{
+	vt->alt = false;
+	memset(&vt->cursor, 0, sizeof(vt->cursor));
+	vt->saved[0] = vt->saved[1] = vt->cursor;
+	vt->wrap_pending = false;
+	vt->autowrap = true;
+	vt->top = 0;
+	vt->bottom = vt->rows - 1;
+	for (int i = 0; i < 2; ++i)
+		vt_clear(vt->screen[i], (size_t)vt->rows * vt->cols, vt_blank(vt));
+}
+
+bool
+vt_init(struct vt* vt, const unsigned rows, const unsigned cols, const unsigned scrollback)
+{
+	memset(vt, 0, sizeof(*vt));
+	if (scrollback && !(vt->scrollback = calloc(scrollback, sizeof(*vt->scrollback))))
+		return false;
+	vt->scrollback_size = scrollback;
+	if (!vt_resize(vt, rows, cols))
+	{
+		free(vt->scrollback);
+		return false;
+	}
+	vt_reset(vt);
+	return true;
+}
+
+void
+vt_free(struct vt* vt)
+{
+	for (unsigned i = 0; i < vt->scrollback_size; ++i)
+		free(vt->scrollback[i].cells);
+	free(vt->scrollback);
+	for (int i = 0; i < 2; ++i)
+	{
+		free(vt->screen[i]);
+		free(vt->lines[i]);
+	}
+}
+
+/*
+ * Changes the size of the screen, a dimension of 0 keeps the current one.
+ * When the screen gets shorter than the cursor's line, the lines above it
+ * scroll off to keep it on screen.
+ */
+bool
+vt_resize(struct vt* vt, unsigned rows, unsigned cols)
+{
+	rows = rows ? rows : vt->rows;
+	cols = cols ? cols : vt->cols;
+	if (!rows || !cols)
+		return false;
+	if (rows == vt->rows && cols == vt->cols)
+		return true;
+
+	struct vt_cell* screen[2];
+	struct vt_cell** lines[2];
+	for (int i = 0; i < 2; ++i)
+	{
+		screen[i] = malloc((size_t)rows * cols * sizeof(struct vt_cell));
+		lines[i] = malloc(rows * sizeof(struct vt_cell*));
+		if (!screen[i] || !lines[i])
+		{
+			for (int j = 0; j <= i; ++j)
+			{
+				free(screen[j]);
+				free(lines[j]);
+			}
+			return false;
+		}
+		vt_clear(screen[i], (size_t)rows * cols, vt_blank(vt));
+		for (unsigned y = 0; y < rows; ++y)
+			lines[i][y] = screen[i] + (size_t)y * cols;
+	}
+
+	if (vt->screen[0])
+	{
+		const unsigned shift = vt->cursor.y >= rows ? vt->cursor.y + 1 - rows : 0;
+		for (int i = 0; i < 2; ++i)
+		{
+			for (unsigned y = 0; y < shift && i == 0; ++y)
+				vt_scrollback_push(vt, vt->lines[0][y]);
+			for (unsigned y = shift; y < vt->rows && y - shift < rows; ++y)
+				memcpy(lines[i][y - shift], vt->lines[i][y], MIN(cols, vt->cols) * sizeof(struct vt_cell));
+			free(vt->screen[i]);
+			free(vt->lines[i]);
+		}
+		vt->cursor.y -= shift;
+	}
+
+	for (int i = 0; i < 2; ++i)
+	{
+		vt->screen[i] = screen[i];
+		vt->lines[i] = lines[i];
+	}
+	vt->rows = rows;
+	vt->cols = cols;
+	vt->top = 0;
+	vt->bottom = rows - 1;
+	vt_goto(vt, vt->cursor.x, vt->cursor.y);
+	for (int i = 0; i < 2; ++i)
+	{
+		vt->saved[i].x = MIN(vt->saved[i].x, cols - 1);
+		vt->saved[i].y = MIN(vt->saved[i].y, rows - 1);
+	}
+	return true;
+}
+
+static unsigned
+vt_param(const struct vt* vt, const unsigned i, const unsigned def)
+{
+	return i < vt->nparams && vt->params[i] ? vt->params[i] : def;
+}
+
+/* Maps 0-255 values of red, green and blue to the closest color in the 6x6x6 cube of the palette. */
+static uint8_t
+vt_rgb(const unsigned r, const unsigned g, const unsigned b)
+{
+	return 16 + 36 * ((MIN(r, 255) * 5 + 127) / 255) + 6 * ((MIN(g, 255) * 5 + 127) / 255) + (MIN(b, 255) * 5 + 127) / 255;
+}
+
+static void
+vt_sgr(struct vt* vt)
+{
+	struct vt_cell* const pen = &vt->cursor.pen;
+
+	if (!vt->nparams)
+		vt->params[vt->nparams++] = 0;
+
+	for (unsigned i = 0; i < vt->nparams; ++i)
+	{
+		const unsigned p = vt->params[i];
+		switch (p)
+		{
+			case 0:
+				memset(pen, 0, sizeof(*pen));
+				break;
+			case 1: pen->attr |= VT_BOLD; break;
+			case 2: pen->attr |= VT_DIM; break;
+			case 3: pen->attr |= VT_ITALIC; break;
+			case 4: pen->attr |= VT_UNDERLINE; break;
+			case 5: pen->attr |= VT_BLINK; break;
+			case 7: pen->attr |= VT_REVERSE; break;
+			case 8: pen->attr |= VT_INVISIBLE; break;
+			case 9: pen->attr |= VT_STRIKE; break;
+			case 22: pen->attr &= ~(VT_BOLD | VT_DIM); break;
+			case 23: pen->attr &= ~VT_ITALIC; break;
+			case 24: pen->attr &= ~VT_UNDERLINE; break;
+			case 25: pen->attr &= ~VT_BLINK; break;
+			case 27: pen->attr &= ~VT_REVERSE; break;
+			case 28: pen->attr &= ~VT_INVISIBLE; break;
+			case 29: pen->attr &= ~VT_STRIKE; break;
+			case 39: pen->attr &= ~VT_FG; break;
+			case 49: pen->attr &= ~VT_BG; break;
+			case 38:
+			case 48:
+			{
+				// Extended colors: 5;index or 2;red;green;blue
+				unsigned color;
+				if (vt_param(vt, i + 1, 0) == 5 && i + 2 < vt->nparams)
+				{
+					color = MIN(vt->params[i + 2], 255);
+					i += 2;
+				}
+				else if (vt_param(vt, i + 1, 0) == 2 && i + 4 < vt->nparams)
+				{
+					color = vt_rgb(vt->params[i + 2], vt->params[i + 3], vt->params[i + 4]);
+					i += 4;
+				}
+				else
+				{
+					return;
+				}
+
+				if (p == 38)
+				{
+					pen->fg = color;
+					pen->attr |= VT_FG;
+				}
+				else
+				{
+					pen->bg = color;
+					pen->attr |= VT_BG;
+				}
+				break;
+			}
+			default:
+				if (p >= 30 && p <= 37)
+				{
+					pen->fg = p - 30;
+					pen->attr |= VT_FG;
+				}
+				else if (p >= 40 && p <= 47)
+				{
+					pen->bg = p - 40;
+					pen->attr |= VT_BG;
+				}
+				else if (p >= 90 && p <= 97)
+				{
+					pen->fg = p - 90 + 8;
+					pen->attr |= VT_FG;
+				}
+				else if (p >= 100 && p <= 107)
+				{
+					pen->bg = p - 100 + 8;
+					pen->attr |= VT_BG;
+				}
+				break;
+		}
+	}
+}
+
+static void
+vt_save_cursor(struct vt* vt)
+{
+	vt->saved[vt->alt] = vt->cursor;
+}
+
+static void
+vt_restore_cursor(struct vt* vt)
+{
+	vt->cursor = vt->saved[vt->alt];
+	vt_goto(vt, vt->cursor.x, vt->cursor.y);
+}
+
+static void
+vt_mode(struct vt* vt, const bool set)
+{
+	if (vt->private != '?')
+		return;
+
+	for (unsigned i = 0; i < vt->nparams; ++i)
+		switch (vt->params[i])
+		{
+			case 7:
+				vt->autowrap = set;
+				if (!set)
+					vt->wrap_pending = false;
+				break;
+			case 1049:
+				// Like 47, but saving and restoring the cursor of the main screen
+				if (set && !vt->alt)
+					vt_save_cursor(vt);
+				// fall through
+			case 47:
+			case 1047:
+				if (set != vt->alt)
+				{
+					vt->alt = set;
+					if (set)
+						vt_clear_lines(vt, 0, vt->rows);
+				}
+				if (!set && vt->params[i] == 1049)
+					vt_restore_cursor(vt);
+				break;
+		}
+}
+
+static void
+vt_csi(struct vt* vt, const char final)
+{
+	struct vt_cursor* const c = &vt->cursor;
+	const unsigned n = vt_param(vt, 0, 1);
+	struct vt_cell* const row = vt_row(vt, c->y);
+
+	if (vt->intermediate)
+	{
+		// Soft reset
+		if (vt->intermediate == '!' && final == 'p')
+		{
+			memset(&c->pen, 0, sizeof(c->pen));
+			vt->autowrap = true;
+			vt->top = 0;
+			vt->bottom = vt->rows - 1;
+		}
+		return;
+	}
+	if (final == 'h' || final == 'l')
+	{
+		vt_mode(vt, final == 'h');
+		return;
+	}
+	if (vt->private)
+		return;
+
+	switch (final)
+	{
+		case '@':
+		{
+			const unsigned len = MIN(n, vt->cols - c->x);
+			memmove(row + c->x + len, row + c->x, (vt->cols - c->x - len) * sizeof(*row));
+			vt_clear(row + c->x, len, vt_blank(vt));
+			vt->wrap_pending = false;
+			break;
+		}
+		case 'A':
+			vt_goto(vt, c->x, (long)c->y - (c->y >= vt->top ? MIN(n, c->y - vt->top) : n));
+			break;
+		case 'B':
+		case 'e':
+			vt_goto(vt, c->x, c->y <= vt->bottom ? c->y + MIN(n, vt->bottom - c->y) : (long)c->y + n);
+			break;
+		case 'C':
+		case 'a':
+			vt_goto(vt, (long)c->x + n, c->y);
+			break;
+		case 'D':
+			vt_goto(vt, (long)c->x - n, c->y);
+			break;
+		case 'E':
+			vt_goto(vt, 0, (long)c->y + n);
+			break;
+		case 'F':
+			vt_goto(vt, 0, (long)c->y - n);
+			break;
+		case 'G':
+		case '`':
+			vt_goto(vt, (long)n - 1, c->y);
+			break;
+		case 'H':
+		case 'f':
+			vt_goto(vt, (long)vt_param(vt, 1, 1) - 1, (long)n - 1);
+			break;
+		case 'I':
+			vt_goto(vt, (c->x / 8 + n) * 8, c->y);
+			break;
+		case 'J':
+			switch (vt_param(vt, 0, 0))
+			{
+				case 0:
+					vt_clear(row + c->x, vt->cols - c->x, vt_blank(vt));
+					vt_clear_lines(vt, c->y + 1, vt->rows - c->y - 1);
+					break;
+				case 1:
+					vt_clear_lines(vt, 0, c->y);
+					vt_clear(row, c->x + 1, vt_blank(vt));
+					break;
+				case 3:
+					vt->scrollback_count = 0;
+					// fall through
+				case 2:
+					vt_clear_lines(vt, 0, vt->rows);
+					break;
+			}
+			vt->wrap_pending = false;
+			break;
+		case 'K':
+			switch (vt_param(vt, 0, 0))
+			{
+				case 0:
+					vt_clear(row + c->x, vt->cols - c->x, vt_blank(vt));
+					break;
+				case 1:
+					vt_clear(row, c->x + 1, vt_blank(vt));
+					break;
+				case 2:
+					vt_clear(row, vt->cols, vt_blank(vt));
+					break;
+			}
+			vt->wrap_pending = false;
+			break;
+		case 'L':
+			if (c->y >= vt->top && c->y <= vt->bottom)
+				vt_scroll_down(vt, c->y, vt->bottom, n);
+			vt_goto(vt, 0, c->y);
+			break;
+		case 'M':
+			if (c->y >= vt->top && c->y <= vt->bottom)
+				vt_scroll_up(vt, c->y, vt->bottom, n, false);
+			vt_goto(vt, 0, c->y);
+			break;
+		case 'P':
+		{
+			const unsigned len = MIN(n, vt->cols - c->x);
+			memmove(row + c->x, row + c->x + len, (vt->cols - c->x - len) * sizeof(*row));
+			vt_clear(row + vt->cols - len, len, vt_blank(vt));
+			vt->wrap_pending = false;
+			break;
+		}
+		case 'S':
+			vt_scroll_up(vt, vt->top, vt->bottom, n, true);
+			break;
+		case 'T':
+			vt_scroll_down(vt, vt->top, vt->bottom, n);
+			break;
+		case 'X':
+			vt_clear(row + c->x, MIN(n, vt->cols - c->x), vt_blank(vt));
+			vt->wrap_pending = false;
+			break;
+		case 'd':
+			vt_goto(vt, c->x, (long)n - 1);
+			break;
+		case 'm':
+			vt_sgr(vt);
+			break;
+		case 'r':
+		{
+			const unsigned top = vt_param(vt, 0, 1) - 1,
+			               bottom = MIN(vt_param(vt, 1, vt->rows), vt->rows) - 1;
+			if (top < bottom)
+			{
+				vt->top = top;
+				vt->bottom = bottom;
+				vt_goto(vt, 0, 0);
+			}
+			break;
+		}
+		case 's':
+			vt_save_cursor(vt);
+			break;
+		case 'u':
+			vt_restore_cursor(vt);
+			break;
+		case 't':
+			// Resizes, as recorded by script
+			if (vt_param(vt, 0, 0) == 8)
+				vt_resize(vt, vt_param(vt, 1, 0), vt_param(vt, 2, 0));
+			break;
+	}
+}
+
+static void
+vt_escape(struct vt* vt, const char c)
+{
+	vt->state = VT_GROUND;
+	switch (c)
+	{
+		case '[':
+			vt->state = VT_CSI;
+			vt->nparams = 0;
+			vt->private = vt->intermediate = 0;
+			memset(vt->params, 0, sizeof(vt->params));
+			break;
+		case ']':
+		case 'P':
+		case '_':
+		case '^':
+		case 'X':
+			vt->state = VT_STRING;
+			break;
+		case '(':
+		case ')':
+		case '*':
+		case '+':
+		case '#':
+			vt->state = VT_CHARSET;
+			break;
+		case '7':
+			vt_save_cursor(vt);
+			break;
+		case '8':
+			vt_restore_cursor(vt);
+			break;
+		case 'D':
+			vt_linefeed(vt);
+			vt->wrap_pending = false;
+			break;
+		case 'E':
+			vt->cursor.x = 0;
+			vt_linefeed(vt);
+			vt->wrap_pending = false;
+			break;
+		case 'M':
+			vt_reverse_linefeed(vt);
+			vt->wrap_pending = false;
+			break;
+		case 'c':
+			vt_reset(vt);
+			break;
+	}
+}
+
+static void
+vt_control(struct vt* vt, const char c)
+{
+	switch (c)
+	{
+		case '\b':
+			if (vt->cursor.x)
+				--vt->cursor.x;
+			vt->wrap_pending = false;
+			break;
+		case '\t':
+			vt_goto(vt, (vt->cursor.x / 8 + 1) * 8, vt->cursor.y);
+			break;
+		case '\n':
+		case '\v':
+		case '\f':
+			vt_linefeed(vt);
+			vt->wrap_pending = false;
+			break;
+		case '\r':
+			vt->cursor.x = 0;
+			vt->wrap_pending = false;
+			break;
+		case 0x1B:
+			vt->state = VT_ESCAPE;
+			break;
+	}
+}
+
+/* Feeds bytes sent to the terminal, may be split anywhere. */
+void
+vt_write(struct vt* vt, const char* data, const size_t len)
+{
+	const unsigned char* p = (const unsigned char*)data;
+	const unsigned char* const end = p + len;
+
+	while (p < end)
+	{
+		const unsigned char c = *p++;
+
+		switch (vt->state)
+		{
+			case VT_GROUND:
+				if (c >= 0x20 && c < 0x7F && !vt->utf8_pending)
+				{
+					// Plain text goes straight to the screen, for as long as it lasts
+					vt_put(vt, c);
+					while (p < end && *p >= 0x20 && *p < 0x7F && !vt->wrap_pending)
+					{
+						const size_t run = MIN((size_t)(end - p), vt->cols - vt->cursor.x);
+						struct vt_cell* const cell = vt_row(vt, vt->cursor.y) + vt->cursor.x;
+						size_t i = 0;
+						for (; i < run && p[i] >= 0x20 && p[i] < 0x7F; ++i)
+						{
+							cell[i] = vt->cursor.pen;
+							cell[i].ch = p[i];
+						}
+						p += i;
+						vt->cursor.x += i;
+						if (vt->cursor.x == vt->cols)
+						{
+							vt->cursor.x = vt->cols - 1;
+							vt->wrap_pending = vt->autowrap;
+							if (!vt->autowrap)
+								while (p < end && *p >= 0x20 && *p < 0x7F)
+									++p;
+						}
+					}
+				}
+				else if ((c == '\n' || c == '\r') && !vt->utf8_pending)
+				{
+					vt_control(vt, c);
+				}
+				else if (c >= 0x80)
+				{
+					if (vt->utf8_pending && (c & 0xC0) == 0x80)
+					{
+						vt->utf8 = vt->utf8 << 6 | (c & 0x3F);
+						if (!--vt->utf8_pending)
+							vt_put(vt, vt->utf8);
+					}
+					else
+					{
+						if (vt->utf8_pending)
+							vt_put(vt, 0xFFFD);
+						vt->utf8_pending = c >= 0xF0 ? 3 : c >= 0xE0 ? 2 : c >= 0xC0 ? 1 : 0;
+						vt->utf8 = c & (0x3F >> vt->utf8_pending);
+						if (!vt->utf8_pending)
+							vt_put(vt, 0xFFFD);
+					}
+				}
+				else
+				{
+					if (vt->utf8_pending)
+					{
+						vt->utf8_pending = 0;
+						vt_put(vt, 0xFFFD);
+					}
+					if (c < 0x20)
+						vt_control(vt, c);
+					else if (c >= 0x20 && c < 0x7F)
+						--p; // Retry as plain text
+				}
+				break;
+
+			case VT_ESCAPE:
+				if (c < 0x20)
+					vt_control(vt, c);
+				else
+					vt_escape(vt, c);
+				break;
+
+			case VT_CHARSET:
+				vt->state = VT_GROUND;
+				break;
+
+			case VT_CSI:
+				if (c >= '0' && c <= '9')
+				{
+					unsigned* const param = &vt->params[vt->nparams ? vt->nparams - 1 : 0];
+					if (!vt->nparams)
+						vt->nparams = 1;
+					*param = MIN(*param * 10 + (c - '0'), 65535U);
+				}
+				else if (c == ';' || c == ':')
+				{
+					if (!vt->nparams)
+						vt->nparams = 1;
+					if (vt->nparams < sizeof(vt->params) / sizeof(vt->params[0]))
+						++vt->nparams;
+				}
+				else if (c >= '<' && c <= '?')
+				{
+					vt->private = c;
+				}
+				else if (c >= 0x20 && c <= 0x2F)
+				{
+					vt->intermediate = c;
+				}
+				else if (c >= 0x40 && c <= 0x7E)
+				{
+					vt->state = VT_GROUND;
+					vt_csi(vt, c);
+				}
+				else if (c == 0x18 || c == 0x1A)
+				{
+					vt->state = VT_GROUND;
+				}
+				else if (c < 0x20)
+				{
+					vt_control(vt, c);
+				}
+				break;
+
+			case VT_STRING:
+			{
+				// Jump to whatever could end it
+				const unsigned char* q = p - 1;
+				while (q < end && *q != 0x1B && *q != 0x07 && *q != 0x18 && *q != 0x1A)
+					++q;
+				p = q;
+				if (p == end)
+					break;
+				vt->state = *p++ == 0x1B ? VT_STRING_ESCAPE : VT_GROUND;
+				break;
+			}
+
+			case VT_STRING_ESCAPE:
+				// Anything but ST aborts the string and starts an escape sequence of its own
+				vt->state = VT_GROUND;
+				if (c != '\\')
+					vt_escape(vt, c);
+				break;
+		}
+	}
+}
+
+static void
+vt_putchar(FILE* f, const uint32_t ch)
+{
+	char buf[4];
+
+	if (ch < 0x80)
+	{
+		putc(ch ? (int)ch : ' ', f);
+		return;
+	}
+
+	size_t n;
+	if (ch < 0x800)
+	{
+		buf[0] = 0xC0 | ch >> 6;
+		n = 2;
+	}
+	else if (ch < 0x10000)
+	{
+		buf[0] = 0xE0 | ch >> 12;
+		n = 3;
+	}
+	else
+	{
+		buf[0] = 0xF0 | (ch >> 18 & 0x07);
+		n = 4;
+	}
+	for (size_t j = 1; j < n; ++j)
+		buf[j] = 0x80 | (ch >> 6 * (n - 1 - j) & 0x3F);
+	fwrite(buf, 1, n, f);
+}
+
+static void
+vt_dump_line(FILE* f, const struct vt_cell* cells, unsigned len)
+{
+	while (len && (cells[len - 1].ch == ' ' || !cells[len - 1].ch))
+		--len;
+
+	for (unsigned i = 0; i < len; ++i)
+		vt_putchar(f, cells[i].ch);
+	putc('\n', f);
+}
+
+/* Writes the text on screen, preceded by the scrollback when asked for, without trailing blank lines. */
+void
+vt_dump(const struct vt* vt, FILE* f, const bool scrollback)
+{
+	unsigned rows = vt->rows;
+	while (rows)
+	{
+		const struct vt_cell* const row = vt_row(vt, rows - 1);
+		unsigned x = 0;
+		while (x < vt->cols && row[x].ch == ' ')
+			++x;
+		if (x < vt->cols)
+			break;
+		--rows;
+	}
+
+	for (unsigned i = 0; scrollback && i < vt->scrollback_count; ++i)
+	{
+		const struct vt_line* const line = &vt->scrollback[(vt->scrollback_first + i) % vt->scrollback_size];
+		vt_dump_line(f, line->cells, line->len);
+	}
+	for (unsigned y = 0; y < rows; ++y)
+		vt_dump_line(f, vt_row(vt, y), vt->cols);
+}
+
+static bool
+vt_same_pen(const struct vt_cell* a, const struct vt_cell* b)
+{
+	return a->attr == b->attr
+	    && (!(a->attr & VT_FG) || a->fg == b->fg)
+	    && (!(a->attr & VT_BG) || a->bg == b->bg);
+}
+
+static void
+vt_redraw_pen(FILE* f, const struct vt_cell* pen)
+{
+	static const struct {
+		uint16_t attr;
+		unsigned sgr;
+	} attrs[] = {
+		{ VT_BOLD, 1 }, { VT_DIM, 2 }, { VT_ITALIC, 3 }, { VT_UNDERLINE, 4 },
+		{ VT_BLINK, 5 }, { VT_REVERSE, 7 }, { VT_INVISIBLE, 8 }, { VT_STRIKE, 9 },
+	};
+
+	fputs("\033[0", f);
+	for (size_t i = 0; i < sizeof(attrs) / sizeof(attrs[0]); ++i)
+		if (pen->attr & attrs[i].attr)
+			fprintf(f, ";%u", attrs[i].sgr);
+	if (pen->attr & VT_FG)
+		fprintf(f, ";38;5;%u", pen->fg);
+	if (pen->attr & VT_BG)
+		fprintf(f, ";48;5;%u", pen->bg);
+	putc('m', f);
+}
+
+static void
+vt_redraw_cell(FILE* f, const struct vt_cell* cell, struct vt_cell* pen)
+{
+	if (!vt_same_pen(cell, pen))
+	{
+		*pen = *cell;
+		vt_redraw_pen(f, pen);
+	}
+	vt_putchar(f, cell->ch);
+}
+
+/* Draws either screen from scratch, leaving out the blanks erasing leaves behind anyway, and saves its cursor. */
+static void
+vt_redraw_screen(const struct vt* vt, FILE* f, const bool alt, struct vt_cell* pen)
+{
+	fputs("\033[H\033[2J", f);
+	for (unsigned y = 0; y < vt->rows; ++y)
+	{
+		const struct vt_cell* const row = vt->lines[alt][y];
+		unsigned len = vt->cols;
+		while (len && row[len - 1].ch == ' ' && !row[len - 1].attr)
+			--len;
+		if (!len)
+			continue;
+
+		fprintf(f, "\033[%u;1H", y + 1);
+		for (unsigned x = 0; x < len; ++x)
+			vt_redraw_cell(f, &row[x], pen);
+	}
+
+	const struct vt_cursor* const saved = &vt->saved[alt];
+	fprintf(f, "\033[%u;%uH", saved->y + 1, saved->x + 1);
+	if (!vt_same_pen(pen, &saved->pen))
+	{
+		*pen = saved->pen;
+		vt_redraw_pen(f, pen);
+	}
+	fputs("\0337", f);
+}
+
+/*
+ * Writes what gets a terminal of the same size to show the same screens,
+ * with the cursor, its attributes, the saved cursors, the scrolling region
+ * and autowrap as they are.
+ */
+void
+vt_redraw(const struct vt* vt, FILE* f)
+{
+	struct vt_cell pen = { 0 };
+
+	fputs("\033[?47l\033[r\033[?7h\033[0m", f);
+	vt_redraw_screen(vt, f, false, &pen);
+	if (vt->alt)
+	{
+		if (pen.attr)
+		{
+			memset(&pen, 0, sizeof(pen));
+			fputs("\033[0m", f);
+		}
+		fputs("\033[?47h", f);
+		vt_redraw_screen(vt, f, true, &pen);
+	}
+
+	if (vt->top || vt->bottom != vt->rows - 1)
+		fprintf(f, "\033[%u;%ur", vt->top + 1, vt->bottom + 1);
+	if (!vt->autowrap)
+		fputs("\033[?7l", f);
+	if (vt->wrap_pending)
+	{
+		// Rewriting the last column is what leaves the terminal about to wrap
+		fprintf(f, "\033[%u;%uH", vt->cursor.y + 1, vt->cols);
+		vt_redraw_cell(f, vt_row(vt, vt->cursor.y) + vt->cols - 1, &pen);
+	}
+	else
+	{
+		fprintf(f, "\033[%u;%uH", vt->cursor.y + 1, vt->cursor.x + 1);
+	}
+	if (!vt_same_pen(&pen, &vt->cursor.pen))
+		vt_redraw_pen(f, &vt->cursor.pen);
+}
+
+/* Whether what got fed so far ends in between characters and sequences. */
+bool
+vt_settled(const struct vt* vt)
+{
+	return vt->state == VT_GROUND && !vt->utf8_pending;
+}
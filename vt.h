@@ -0,0 +1,88 @@
+/*
+ * Headless terminal emulator, keeping the screen a typescript leaves behind.
+ *
+ * This file is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef VT_H
+#define VT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* Cell attributes */
+#define VT_BOLD      0x0001
+#define VT_DIM       0x0002
+#define VT_ITALIC    0x0004
+#define VT_UNDERLINE 0x0008
+#define VT_BLINK     0x0010
+#define VT_REVERSE   0x0020
+#define VT_INVISIBLE 0x0040
+#define VT_STRIKE    0x0080
+#define VT_FG        0x0100	/* fg holds a color, instead of the default being used */
+#define VT_BG        0x0200	/* bg holds a color, instead of the default being used */
+
+/* Colors are indexes in the 256 color palette, true colors get approximated. */
+struct vt_cell
+{
+	uint32_t ch;
+	uint16_t attr;
+	uint8_t  fg, bg;
+};
+
+struct vt_line
+{
+	struct vt_cell* cells;
+	unsigned        len;
+};
+
+struct vt_cursor
+{
+	unsigned       x, y;
+	struct vt_cell pen;	/* Attributes and colors for what gets written */
+};
+
+struct vt
+{
+	unsigned         rows, cols;
+	struct vt_cell*  screen[2];	/* The main and alternate screens, rows * cols cells each */
+	struct vt_cell** lines[2];	/* Their lines, scrolling only moves these around */
+	bool             alt;	/* The alternate screen is shown */
+	struct vt_cursor cursor;
+	struct vt_cursor saved[2];	/* Saved by DECSC, for either screen */
+	bool             wrap_pending;	/* The last column got written, wrap before the next character */
+	bool             autowrap;
+	unsigned         top, bottom;	/* Scrolling region */
+
+	/* Lines scrolled off the top of the main screen, oldest first */
+	struct vt_line*  scrollback;
+	unsigned         scrollback_size, scrollback_first, scrollback_count;
+
+	/* Parser */
+	int              state;
+	unsigned         params[16];
+	unsigned         nparams;
+	char             private, intermediate;
+	uint32_t         utf8;
+	unsigned         utf8_pending;
+};
+
+bool vt_init(struct vt* vt, unsigned rows, unsigned cols, unsigned scrollback);
+void vt_free(struct vt* vt);
+bool vt_resize(struct vt* vt, unsigned rows, unsigned cols);
+void vt_write(struct vt* vt, const char* data, size_t len);
+void vt_dump(const struct vt* vt, FILE* f, bool scrollback);
+void vt_redraw(const struct vt* vt, FILE* f);
+bool vt_settled(const struct vt* vt);
+
+#endif